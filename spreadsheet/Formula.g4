@@ -9,10 +9,18 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | FUNCTION '(' arg (',' arg)* ')'  # Call
+    | SHEET? CELL  # Cell
     | NUMBER  # Literal
     ;
 
+// a range is only allowed as a function argument; both corners of a
+// range of another sheet lie on that sheet: Sheet2!A1:B5
+arg
+    : SHEET? CELL ':' CELL  # Range
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +34,8 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+FUNCTION: 'SUM' | 'AVERAGE' | 'MIN' | 'MAX' | 'COUNT' ;
 CELL: [A-Z]+[0-9]+ ;
+// the name of another sheet before a cell or a range: Sheet2!A1
+SHEET: [A-Za-z_] [A-Za-z0-9_]* '!' ;
 WS: [ \t\n\r]+ -> skip ;
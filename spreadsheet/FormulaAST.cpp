@@ -1,14 +1,26 @@
 #include "FormulaAST.h"
 
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <type_traits>
+#include <utility>
 
 namespace ASTImpl {
 
@@ -67,214 +79,1139 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
+namespace {
+Position Absolute(Position cell, Position origin) {
+    return {origin.row + cell.row, origin.col + cell.col};
+}
+
+Range Absolute(Range range, Position origin) {
+    return {Absolute(range.first, origin), Absolute(range.last, origin)};
+}
+
+// overflow and division by zero both end up as inf or nan
+double CheckFinite(double result) {
+    if (!std::isfinite(result)) {
+        throw FormulaError(FormulaError::Category::Div0);
+    }
+    return result;
+}
+
+// empty cells read as zero, errors are rethrown to abort the evaluation
+double ReadCell(const SheetInterface& sheet, Position pos) {
+    if (!pos.IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    const auto value = sheet.GetNumericValue(pos);
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    throw std::get<FormulaError>(value);
+}
+
+// The names of the sheets a formula refers to, numbered from one.
+struct SheetNameTable {
+    const SheetName* names;
+    const char* chars;
+
+    std::string_view operator[](std::uint32_t sheet) const {
+        const SheetName& name = names[sheet - 1];
+        return {chars + name.offset, name.size};
+    }
+};
+
+// The sheets a formula refers to, looked up by name once per evaluation.
+// Index 0 is the sheet of the formula itself; a sheet that is not found
+// reads as #REF!.
+class ResolvedSheets {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(/*добавьте сюда нужные аргументы*/ args) const = 0;
+    ResolvedSheets(const SheetInterface& sheet, SheetNameTable names, std::uint32_t count) {
+        if (count >= INLINE_COUNT) {
+            heap_.resize(count + 1);
+            sheets_ = heap_.data();
+        }
+        sheets_[0] = &sheet;
+        for (std::uint32_t i = 1; i <= count; ++i) {
+            sheets_[i] = sheet.FindSheet(names[i]);
+        }
+    }
+    ResolvedSheets(const ResolvedSheets&) = delete;
+    ResolvedSheets& operator=(const ResolvedSheets&) = delete;
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    const SheetInterface& operator[](std::uint16_t sheet) const {
+        if (sheets_[sheet] == nullptr) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return *sheets_[sheet];
+    }
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
+private:
+    static constexpr size_t INLINE_COUNT = 8;
+
+    const SheetInterface* inline_sheets_[INLINE_COUNT];
+    std::vector<const SheetInterface*> heap_;
+    const SheetInterface** sheets_ = inline_sheets_;
+};
+
+struct FunctionName {
+    Function function;
+    std::string_view name;
+};
+
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {Function::Sum, "SUM"},
+    {Function::Average, "AVERAGE"},
+    {Function::Min, "MIN"},
+    {Function::Max, "MAX"},
+    {Function::Count, "COUNT"},
+};
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.name == name) {
+            return entry.function;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view GetFunctionName(Function function) {
+    return FUNCTION_NAMES[static_cast<size_t>(function)].name;
+}
+
+// Reductions over contiguous values. Independent accumulators break the
+// dependency between consecutive steps, and the fixed-size inner loop is
+// turned by the compiler into packed vector instructions even at -O2;
+// a sum may differ from the left-to-right one in the last bits.
+template <typename Op>
+double Reduce(const double* values, size_t count, double init, Op op) {
+    constexpr size_t LANES = 4;
+    double lanes[LANES];
+    std::fill(std::begin(lanes), std::end(lanes), init);
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            lanes[lane] = op(lanes[lane], values[i + lane]);
         }
+    }
+    double result = init;
+    for (const double lane : lanes) {
+        result = op(result, lane);
+    }
+    for (; i < count; ++i) {
+        result = op(result, values[i]);
+    }
+    return result;
+}
+
+double SumKernel(const double* values, size_t count) {
+    return Reduce(values, count, 0.0, [](double lhs, double rhs) {
+        return lhs + rhs;
+    });
+}
 
-        DoPrintFormula(out, precedence);
+double MinKernel(const double* values, size_t count) {
+    return Reduce(values, count, HUGE_VAL, [](double lhs, double rhs) {
+        return rhs < lhs ? rhs : lhs;
+    });
+}
+
+double MaxKernel(const double* values, size_t count) {
+    return Reduce(values, count, -HUGE_VAL, [](double lhs, double rhs) {
+        return rhs > lhs ? rhs : lhs;
+    });
+}
+
+// A call keeps two values while its arguments are added: the running
+// sum, minimum or maximum and the number of values seen so far.
+double InitialValue(Function function) {
+    switch (function) {
+        case Function::Min:
+            return HUGE_VAL;
+        case Function::Max:
+            return -HUGE_VAL;
+        default:
+            return 0;
+    }
+}
 
-        if (parens_needed) {
+void Accumulate(Function function, double& value, double& count, double argument) {
+    CheckFinite(argument);
+    switch (function) {
+        case Function::Sum:
+        case Function::Average:
+            value += argument;
+            break;
+        case Function::Min:
+            value = std::min(value, argument);
+            break;
+        case Function::Max:
+            value = std::max(value, argument);
+            break;
+        case Function::Count:
+            break;
+    }
+    ++count;
+}
+
+// A range comes in as a summary of its numbers. The sheet may keep the
+// summary between evaluations, so a call over a large range does not
+// have to read it again. Only MIN and MAX need the extrema.
+void AccumulateRange(const SheetInterface& sheet, Range range, Function function, double& value,
+                     double& count) {
+    if (!range.first.IsValid() || !range.last.IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+    }
+    const bool with_extrema = function == Function::Min || function == Function::Max;
+    const RangeSummary summary = sheet.GetRangeSummary(range, with_extrema);
+    switch (function) {
+        case Function::Sum:
+        case Function::Average:
+            value += summary.sum;
+            break;
+        case Function::Min:
+            value = std::min(value, summary.min);
+            break;
+        case Function::Max:
+            value = std::max(value, summary.max);
+            break;
+        case Function::Count:
+            break;
+    }
+    count += static_cast<double>(summary.count);
+}
+
+// an average of nothing is a division by zero, the minimum and maximum
+// of nothing are zero
+double CallResult(Function function, double value, double count) {
+    switch (function) {
+        case Function::Sum:
+            return CheckFinite(value);
+        case Function::Average:
+            return CheckFinite(value / count);
+        case Function::Min:
+        case Function::Max:
+            return count == 0 ? 0 : value;
+        case Function::Count:
+            return count;
+    }
+    assert(false);
+    return 0;
+}
+
+char OperatorSign(NodeType type) {
+    switch (type) {
+        case NodeType::Add:
+        case NodeType::UnaryPlus:
+            return '+';
+        case NodeType::Subtract:
+        case NodeType::UnaryMinus:
+            return '-';
+        case NodeType::Multiply:
+            return '*';
+        case NodeType::Divide:
+            return '/';
+        default:
+            assert(false);
+            return '?';
+    }
+}
+
+// higher is tighter
+ExprPrecedence GetPrecedence(const Node& node) {
+    switch (node.type) {
+        case NodeType::Add:
+            return EP_ADD;
+        case NodeType::Subtract:
+            return EP_SUB;
+        case NodeType::Multiply:
+            return EP_MUL;
+        case NodeType::Divide:
+            return EP_DIV;
+        case NodeType::UnaryPlus:
+        case NodeType::UnaryMinus:
+            return EP_UNARY;
+        case NodeType::Number:
+        case NodeType::Cell:
+        case NodeType::Range:
+        case NodeType::ArgumentList:
+        case NodeType::Call:
+            return EP_ATOM;
+    }
+    // have to do this because VC++ has a buggy warning
+    assert(false);
+    return static_cast<ExprPrecedence>(INT_MAX);
+}
+
+void PrintCell(std::ostream& out, Position cell) {
+    if (!cell.IsValid()) {
+        out << FormulaError::Category::Ref;
+    } else {
+        out << cell.ToString();
+    }
+}
+
+// a range of another sheet names the sheet once, before its first corner
+void PrintSheet(std::ostream& out, SheetNameTable sheets, std::uint16_t sheet) {
+    if (sheet != 0) {
+        out << sheets[sheet] << '!';
+    }
+}
+
+// cell references are stored relative to the origin passed in
+void PrintNode(const Node* nodes, std::uint32_t index, std::ostream& out, Position origin, SheetNameTable sheets) {
+    const Node& node = nodes[index];
+    switch (node.type) {
+        case NodeType::Number:
+            out << node.number;
+            break;
+        case NodeType::Cell:
+            PrintSheet(out, sheets, node.sheet);
+            PrintCell(out, Absolute(node.cell, origin));
+            break;
+        case NodeType::UnaryPlus:
+        case NodeType::UnaryMinus:
+            out << '(' << OperatorSign(node.type) << ' ';
+            PrintNode(nodes, node.children.lhs, out, origin, sheets);
+            out << ')';
+            break;
+        case NodeType::Range:
+            PrintSheet(out, sheets, node.sheet);
+            PrintCell(out, Absolute(nodes[node.children.lhs].cell, origin));
+            out << ':';
+            PrintCell(out, Absolute(nodes[node.children.rhs].cell, origin));
+            break;
+        case NodeType::ArgumentList:
+            PrintNode(nodes, node.children.lhs, out, origin, sheets);
+            out << ' ';
+            PrintNode(nodes, node.children.rhs, out, origin, sheets);
+            break;
+        case NodeType::Call:
+            out << '(' << GetFunctionName(node.function) << ' ';
+            PrintNode(nodes, node.children.lhs, out, origin, sheets);
             out << ')';
+            break;
+        default:
+            out << '(' << OperatorSign(node.type) << ' ';
+            PrintNode(nodes, node.children.lhs, out, origin, sheets);
+            out << ' ';
+            PrintNode(nodes, node.children.rhs, out, origin, sheets);
+            out << ')';
+            break;
+    }
+}
+
+// same text as std::ostream << number with the default precision of 6
+void AppendNumber(std::string& out, double number) {
+    char chars[32];
+    const auto result = std::to_chars(chars, chars + sizeof(chars), number, std::chars_format::general, 6);
+    out.append(chars, result.ptr);
+}
+
+void AppendCell(std::string& out, Position cell) {
+    if (!cell.IsValid()) {
+        out += FormulaError(FormulaError::Category::Ref).ToString();
+    } else {
+        out += cell.ToString();
+    }
+}
+
+void AppendSheet(std::string& out, SheetNameTable sheets, std::uint16_t sheet) {
+    if (sheet != 0) {
+        out += sheets[sheet];
+        out += '!';
+    }
+}
+
+// appends to a string rather than a stream: formulas are printed for every
+// GetText, and a stream per call costs more than the printing itself
+void PrintFormulaNode(const Node* nodes, std::uint32_t index, std::string& out, ExprPrecedence parent_precedence,
+                      Position origin, SheetNameTable sheets, bool right_child = false) {
+    const Node& node = nodes[index];
+    const auto precedence = GetPrecedence(node);
+    const auto mask = right_child ? PR_RIGHT : PR_LEFT;
+    const bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+    if (parens_needed) {
+        out += '(';
+    }
+
+    switch (node.type) {
+        case NodeType::Number:
+            AppendNumber(out, node.number);
+            break;
+        case NodeType::Cell:
+            AppendSheet(out, sheets, node.sheet);
+            AppendCell(out, Absolute(node.cell, origin));
+            break;
+        case NodeType::UnaryPlus:
+        case NodeType::UnaryMinus:
+            out += OperatorSign(node.type);
+            PrintFormulaNode(nodes, node.children.lhs, out, precedence, origin, sheets);
+            break;
+        case NodeType::Range:
+            AppendSheet(out, sheets, node.sheet);
+            AppendCell(out, Absolute(nodes[node.children.lhs].cell, origin));
+            out += ':';
+            AppendCell(out, Absolute(nodes[node.children.rhs].cell, origin));
+            break;
+        case NodeType::ArgumentList:
+            PrintFormulaNode(nodes, node.children.lhs, out, EP_ATOM, origin, sheets);
+            out += ',';
+            PrintFormulaNode(nodes, node.children.rhs, out, EP_ATOM, origin, sheets);
+            break;
+        case NodeType::Call:
+            out += GetFunctionName(node.function);
+            out += '(';
+            PrintFormulaNode(nodes, node.children.lhs, out, EP_ATOM, origin, sheets);
+            out += ')';
+            break;
+        default:
+            PrintFormulaNode(nodes, node.children.lhs, out, precedence, origin, sheets);
+            out += OperatorSign(node.type);
+            PrintFormulaNode(nodes, node.children.rhs, out, precedence, origin, sheets, /* right_child = */ true);
+            break;
+    }
+
+    if (parens_needed) {
+        out += ')';
+    }
+}
+
+double EvaluateNode(const Node* nodes, std::uint32_t index, const ResolvedSheets& sheets, Position origin);
+
+// A cell passed to a function directly is read like a one-cell range.
+void EvaluateArguments(const Node* nodes, std::uint32_t index, Function function, double& value, double& count,
+                       const ResolvedSheets& sheets, Position origin) {
+    const Node& node = nodes[index];
+    switch (node.type) {
+        case NodeType::ArgumentList:
+            EvaluateArguments(nodes, node.children.lhs, function, value, count, sheets, origin);
+            EvaluateArguments(nodes, node.children.rhs, function, value, count, sheets, origin);
+            break;
+        case NodeType::Range: {
+            const Range range{nodes[node.children.lhs].cell, nodes[node.children.rhs].cell};
+            AccumulateRange(sheets[node.sheet], Absolute(range, origin), function, value, count);
+            break;
+        }
+        case NodeType::Cell: {
+            const Position cell = Absolute(node.cell, origin);
+            AccumulateRange(sheets[node.sheet], {cell, cell}, function, value, count);
+            break;
         }
+        default:
+            Accumulate(function, value, count, EvaluateNode(nodes, index, sheets, origin));
+            break;
     }
-};
+}
 
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
+double EvaluateNode(const Node* nodes, std::uint32_t index, const ResolvedSheets& sheets, Position origin) {
+    const Node& node = nodes[index];
+    switch (node.type) {
+        case NodeType::Number:
+            return node.number;
+        case NodeType::Cell:
+            return ReadCell(sheets[node.sheet], Absolute(node.cell, origin));
+        case NodeType::UnaryPlus:
+            return EvaluateNode(nodes, node.children.lhs, sheets, origin);
+        case NodeType::UnaryMinus:
+            return -EvaluateNode(nodes, node.children.lhs, sheets, origin);
+        case NodeType::Call: {
+            double value = InitialValue(node.function);
+            double count = 0;
+            EvaluateArguments(nodes, node.children.lhs, node.function, value, count, sheets, origin);
+            return CallResult(node.function, value, count);
+        }
+        default:
+            break;
+    }
+    const double lhs = EvaluateNode(nodes, node.children.lhs, sheets, origin);
+    const double rhs = EvaluateNode(nodes, node.children.rhs, sheets, origin);
+    switch (node.type) {
+        case NodeType::Add:
+            return CheckFinite(lhs + rhs);
+        case NodeType::Subtract:
+            return CheckFinite(lhs - rhs);
+        case NodeType::Multiply:
+            return CheckFinite(lhs * rhs);
+        case NodeType::Divide:
+            return CheckFinite(lhs / rhs);
+        default:
+            assert(false);
+            return 0;
+    }
+}
 
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
-                return EP_ADD;
-            case Subtract:
-                return EP_SUB;
-            case Multiply:
-                return EP_MUL;
-            case Divide:
-                return EP_DIV;
+// Emits a binary operation. An operation on two literals is folded unless
+// that would hide an error.
+void CompileBinary(NodeType type, std::vector<Instruction>& program) {
+    const size_t size = program.size();
+    if (program[size - 2].code == OpCode::PushNumber
+        && program[size - 1].code == OpCode::PushNumber) {
+        const double lhs = program[size - 2].number;
+        const double rhs = program[size - 1].number;
+        double result = 0;
+        switch (type) {
+            case NodeType::Add:
+                result = lhs + rhs;
+                break;
+            case NodeType::Subtract:
+                result = lhs - rhs;
+                break;
+            case NodeType::Multiply:
+                result = lhs * rhs;
+                break;
+            case NodeType::Divide:
+                result = lhs / rhs;
+                break;
             default:
-                // have to do this because VC++ has a buggy warning
                 assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
+        }
+        if (std::isfinite(result)) {
+            program.pop_back();
+            program.back().number = result;
+            return;
         }
     }
 
-    double Evaluate(/*добавьте нужные аргументы*/) const override {
-			// Скопируйте ваше решение из предыдущих уроков.
+    switch (type) {
+        case NodeType::Add:
+            program.emplace_back(OpCode::Add);
+            break;
+        case NodeType::Subtract:
+            program.emplace_back(OpCode::Subtract);
+            break;
+        case NodeType::Multiply:
+            program.emplace_back(OpCode::Multiply);
+            break;
+        case NodeType::Divide:
+            program.emplace_back(OpCode::Divide);
+            break;
+        default:
+            assert(false);
     }
+}
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+// Where the calls of a formula start and which nodes are their arguments.
+struct CallLayout {
+    std::vector<std::uint32_t> subtree_sizes;
+    // (first node of the call, the call node), outer calls first on ties
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> starts;
+    // the function a node is a direct argument of
+    std::vector<std::optional<Function>> argument_of;
 };
 
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
+void LayOutCalls(const Node* nodes, std::uint32_t node_count, CallLayout& layout) {
+    auto& sizes = layout.subtree_sizes;
+    sizes.assign(node_count, 1);
+    layout.starts.clear();
+    layout.argument_of.assign(node_count, std::nullopt);
+    for (std::uint32_t i = 0; i < node_count; ++i) {
+        const Node& node = nodes[i];
+        switch (node.type) {
+            case NodeType::Number:
+            case NodeType::Cell:
+                break;
+            case NodeType::UnaryPlus:
+            case NodeType::UnaryMinus:
+                sizes[i] += sizes[node.children.lhs];
+                break;
+            case NodeType::Call: {
+                sizes[i] += sizes[node.children.lhs];
+                layout.starts.emplace_back(i + 1 - sizes[i], i);
+                std::uint32_t arguments = node.children.lhs;
+                while (nodes[arguments].type == NodeType::ArgumentList) {
+                    layout.argument_of[nodes[arguments].children.rhs] = node.function;
+                    arguments = nodes[arguments].children.lhs;
+                }
+                layout.argument_of[arguments] = node.function;
+                break;
+            }
+            default:
+                sizes[i] += sizes[node.children.lhs] + sizes[node.children.rhs];
+                break;
+        }
+    }
+    std::sort(layout.starts.begin(), layout.starts.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first != rhs.first ? lhs.first < rhs.first : lhs.second > rhs.second;
+    });
+}
+
+// the corners of a range are the two nodes right before it
+bool IsRangeCorner(const Node* nodes, std::uint32_t node_count, std::uint32_t index) {
+    return (index + 1 < node_count && nodes[index + 1].type == NodeType::Range)
+           || (index + 2 < node_count && nodes[index + 2].type == NodeType::Range);
+}
+
+// The nodes are already in postfix order, so compiling is a single pass
+// that only drops unary pluses and folds operations on literals. Calls
+// need a look at the whole tree first: the accumulator of a call goes on
+// the stack before the first node of the call, and each argument is added
+// to it right after its last node. Ranges are numbered in node order,
+// those of other sheets together with the other references to them.
+void Compile(const Node* nodes, std::uint32_t node_count, std::vector<Instruction>& program,
+             CallLayout& layout) {
+    const bool has_calls = std::any_of(nodes, nodes + node_count, [](const Node& node) {
+        return node.type == NodeType::Call;
+    });
+    if (has_calls) {
+        LayOutCalls(nodes, node_count, layout);
+    }
+    size_t next_start = 0;
+    std::uint32_t next_range = 0;
+    std::uint32_t next_reference = 0;
+    for (std::uint32_t i = 0; i < node_count; ++i) {
+        std::optional<Function> argument_of;
+        if (has_calls) {
+            for (; next_start < layout.starts.size() && layout.starts[next_start].first == i; ++next_start) {
+                program.emplace_back(OpCode::BeginCall, nodes[layout.starts[next_start].second].function);
+            }
+            argument_of = layout.argument_of[i];
+        }
+
+        const Node& node = nodes[i];
+        switch (node.type) {
+            case NodeType::Number:
+                program.emplace_back(OpCode::PushNumber, node.number);
+                break;
+            case NodeType::Cell:
+                if (has_calls && IsRangeCorner(nodes, node_count, i)) {
+                    continue;
+                }
+                next_reference += node.sheet != 0;
+                if (argument_of) {
+                    // a cell passed to a function directly is read like a one-cell range
+                    program.emplace_back(OpCode::AccumulateCell, *argument_of, node.cell, node.sheet);
+                    continue;
+                }
+                program.emplace_back(OpCode::PushCell, node.cell, node.sheet);
+                break;
+            case NodeType::UnaryPlus:
+                break;
+            case NodeType::UnaryMinus:
+                if (program.back().code == OpCode::PushNumber) {
+                    program.back().number = -program.back().number;
+                } else {
+                    program.emplace_back(OpCode::Negate);
+                }
+                break;
+            case NodeType::Range:
+                program.emplace_back(OpCode::AccumulateRange, *argument_of,
+                                     node.sheet != 0 ? next_reference++ : next_range++, node.sheet);
+                continue;
+            case NodeType::ArgumentList:
+                continue;
+            case NodeType::Call:
+                program.emplace_back(OpCode::EndCall, node.function);
+                break;
+            default:
+                CompileBinary(node.type, program);
+                break;
+        }
+        if (argument_of) {
+            program.emplace_back(OpCode::Accumulate, *argument_of);
+        }
+    }
+}
+
+// Deepest stack the program needs, or nullopt if some instruction lacks
+// operands or the program does not leave exactly one value. Instructions
+// between BeginCall and EndCall may only use the values above the
+// accumulator of that call.
+std::optional<std::uint32_t> StackDepth(const Instruction* program, std::uint32_t size) {
+    struct Call {
+        Function function;
+        std::uint32_t base;  // depth with the accumulator on top
     };
+    std::vector<Call> calls;
+    std::uint32_t depth = 0;
+    std::uint32_t max_depth = 0;
+    for (std::uint32_t i = 0; i < size; ++i) {
+        const Instruction& instruction = program[i];
+        const std::uint32_t floor = calls.empty() ? 0 : calls.back().base;
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+            case OpCode::PushCell:
+                max_depth = std::max(max_depth, ++depth);
+                break;
+            case OpCode::Negate:
+                if (depth < floor + 1) {
+                    return std::nullopt;
+                }
+                break;
+            case OpCode::BeginCall:
+                depth += 2;
+                max_depth = std::max(max_depth, depth);
+                calls.push_back({instruction.function, depth});
+                break;
+            case OpCode::Accumulate:
+                if (calls.empty() || calls.back().function != instruction.function || depth != floor + 1) {
+                    return std::nullopt;
+                }
+                --depth;
+                break;
+            case OpCode::AccumulateCell:
+            case OpCode::AccumulateRange:
+                if (calls.empty() || calls.back().function != instruction.function || depth != floor) {
+                    return std::nullopt;
+                }
+                break;
+            case OpCode::EndCall:
+                if (calls.empty() || calls.back().function != instruction.function || depth != floor) {
+                    return std::nullopt;
+                }
+                calls.pop_back();
+                --depth;
+                break;
+            default:
+                if (depth < floor + 2) {
+                    return std::nullopt;
+                }
+                --depth;
+                break;
+        }
+    }
+    if (depth != 1 || !calls.empty()) {
+        return std::nullopt;
+    }
+    return max_depth;
+}
+
+enum class TokenType {
+    Number,
+    Cell,
+    Function,
+    Sheet,  // the name of a sheet followed by '!'
+
+    Add,
+    Sub,
+    Mul,
+    Div,
+    LeftParen,
+    RightParen,
+    Colon,
+    Comma,
+    End,
+};
+
+struct Token {
+    TokenType type = TokenType::End;
+    std::string_view text;
+};
 
+// Splits a formula into the tokens of Formula.g4 in place. Tokens are
+// matched greedily like the ANTLR lexer does; anything else is an error.
+class Lexer {
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
+    explicit Lexer(std::string_view text)
+        : text_(text) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+    Token Next() {
+        while (pos_ < text_.size()
+               && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            return {TokenType::End, {}};
+        }
+
+        const size_t start = pos_;
+        const char c = text_[pos_];
+        size_t end = start + 1;
+        TokenType type;
+        switch (c) {
+            case '+':
+                type = TokenType::Add;
+                break;
+            case '-':
+                type = TokenType::Sub;
+                break;
+            case '*':
+                type = TokenType::Mul;
+                break;
+            case '/':
+                type = TokenType::Div;
+                break;
+            case '(':
+                type = TokenType::LeftParen;
+                break;
+            case ')':
+                type = TokenType::RightParen;
+                break;
+            case ':':
+                type = TokenType::Colon;
+                break;
+            case ',':
+                type = TokenType::Comma;
+                break;
+            default:
+                if (const size_t name_end = SkipName(start);
+                    name_end > start && name_end < text_.size() && text_[name_end] == '!') {
+                    end = name_end + 1;
+                    type = TokenType::Sheet;
+                } else if (c >= 'A' && c <= 'Z') {
+                    size_t letters_end = start;
+                    while (letters_end < text_.size() && text_[letters_end] >= 'A' && text_[letters_end] <= 'Z') {
+                        ++letters_end;
+                    }
+                    end = SkipDigits(letters_end);
+                    if (end != letters_end) {
+                        type = TokenType::Cell;
+                    } else if (FindFunction(text_.substr(start, end - start))) {
+                        type = TokenType::Function;
+                    } else {
+                        throw ParsingError("Error when lexing: " + std::string(text_.substr(start)));
+                    }
+                } else {
+                    end = MatchNumber(start);
+                    if (end == start) {
+                        throw ParsingError("Error when lexing: " + std::string(text_.substr(start)));
+                    }
+                    type = TokenType::Number;
+                }
+        }
+        pos_ = end;
+        return {type, text_.substr(start, end - start)};
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    // SHEET: [A-Za-z_] [A-Za-z0-9_]* '!'; returns pos if no name starts there
+    size_t SkipName(size_t pos) const {
+        auto is_letter = [](char c) {
+            return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+        };
+        if (pos == text_.size() || !is_letter(text_[pos])) {
+            return pos;
+        }
+        while (pos < text_.size() && (is_letter(text_[pos]) || IsDigit(text_[pos]))) {
+            ++pos;
+        }
+        return pos;
     }
 
-    double Evaluate(/*добавьте нужные аргументы*/ args) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
+    size_t SkipDigits(size_t pos) const {
+        while (pos < text_.size() && IsDigit(text_[pos])) {
+            ++pos;
+        }
+        return pos;
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t MatchNumber(size_t pos) const {
+        size_t end = SkipDigits(pos);
+        if (end < text_.size() && text_[end] == '.') {
+            const size_t fraction_end = SkipDigits(end + 1);
+            if (fraction_end > end + 1) {
+                end = fraction_end;
+            }
+        }
+        if (end == pos) {
+            return pos;
+        }
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            const size_t exponent_end = SkipDigits(exponent);
+            if (exponent_end > exponent) {
+                end = exponent_end;
+            }
+        }
+        return end;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
 };
 
-class CellExpr final : public Expr {
-public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+// Buffers reused by every parse on the thread, so that in the steady state
+// the only allocation of a parse is the arena of the resulting FormulaAST.
+struct ParseBuffers {
+    std::vector<Node> nodes;
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+    std::vector<SheetReference> references;
+    std::vector<std::string_view> sheet_names;
+    std::vector<Instruction> program;
+    CallLayout layout;
+};
+
+ParseBuffers& GetParseBuffers() {
+    thread_local ParseBuffers buffers;
+    return buffers;
+}
+
+std::uint32_t AddNode(std::vector<Node>& nodes, Node node) {
+    nodes.push_back(node);
+    return static_cast<std::uint32_t>(nodes.size() - 1);
+}
+
+Position ParsePosition(std::string_view text) {
+    const auto value = Position::FromString(text);
+    if (!value.IsValid()) {
+        throw FormulaException("Invalid position: " + std::string(text));
     }
+    return value;
+}
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
+// Returns the number of the sheet named by a SHEET token, adding the name
+// if the formula has not referred to it yet.
+std::uint16_t AddSheetName(std::vector<std::string_view>& names, std::string_view token) {
+    const std::string_view name = token.substr(0, token.size() - 1);  // without the '!'
+    const auto it = std::find(names.begin(), names.end(), name);
+    if (it != names.end()) {
+        return static_cast<std::uint16_t>(it - names.begin() + 1);
+    }
+    if (names.size() == UINT16_MAX) {
+        throw ParsingError("Too many sheets in a formula");
+    }
+    names.push_back(name);
+    return static_cast<std::uint16_t>(names.size());
+}
+
+// Adds a cell reference. Cells of other sheets are kept apart, so that
+// cells only lists the cells of the formula's own sheet.
+std::uint32_t AddCell(std::vector<Node>& nodes, std::vector<Position>& cells,
+                      std::vector<SheetReference>& references, std::uint16_t sheet, Position cell) {
+    if (sheet == 0) {
+        cells.push_back(cell);
+    } else {
+        references.push_back({sheet, {cell, cell}});
     }
+    return AddNode(nodes, Node(NodeType::Cell, cell, sheet));
+}
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+// Adds the corners and the node of a range, normalized so that the first
+// corner is the top left one.
+std::uint32_t AddRange(std::vector<Node>& nodes, std::vector<Position>& cells, std::vector<Range>& ranges,
+                       std::vector<SheetReference>& references, std::uint16_t sheet, Position lhs, Position rhs) {
+    const Range range{{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+                      {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+    if (sheet == 0) {
+        cells.push_back(range.first);
+        cells.push_back(range.last);
+        ranges.push_back(range);
+    } else {
+        references.push_back({sheet, range});
     }
+    const std::uint32_t first = AddNode(nodes, Node(NodeType::Cell, range.first, sheet));
+    const std::uint32_t last = AddNode(nodes, Node(NodeType::Cell, range.last, sheet));
+    Node node(NodeType::Range, first, last);
+    node.sheet = sheet;
+    return AddNode(nodes, node);
+}
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+// Recursive descent parser for the grammar in Formula.g4. Unary operators
+// bind tighter than binary ones, binary operators are left-associative.
+// Nodes are emitted in postfix order as the parser leaves them.
+class NativeParser {
+public:
+    explicit NativeParser(std::string_view text)
+        : lexer_(text)
+        , nodes_(GetParseBuffers().nodes)
+        , cells_(GetParseBuffers().cells)
+        , ranges_(GetParseBuffers().ranges)
+        , references_(GetParseBuffers().references)
+        , sheet_names_(GetParseBuffers().sheet_names) {
+        nodes_.clear();
+        cells_.clear();
+        ranges_.clear();
+        references_.clear();
+        sheet_names_.clear();
+        Advance();
     }
 
-    double Evaluate(/*добавьте нужные аргументы*/ args) const override {
-        // реализуйте метод.
+    FormulaAST Parse() {
+        ParseBinary(LEVEL_ADD);
+        if (token_.type != TokenType::End) {
+            throw ParsingError("Unexpected token: " + std::string(token_.text));
+        }
+        return FormulaAST(nodes_, cells_, ranges_, references_, sheet_names_);
     }
 
 private:
-    const Position* cell_;
-};
+    // binary operator levels, higher is tighter
+    static constexpr int LEVEL_ADD = 0;
+    static constexpr int LEVEL_MUL = 1;
 
-class NumberExpr final : public Expr {
-public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+    void Advance() {
+        token_ = lexer_.Next();
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    std::uint32_t ParseBinary(int min_level) {
+        std::uint32_t lhs = ParseUnary();
+        while (true) {
+            int level;
+            NodeType type;
+            switch (token_.type) {
+                case TokenType::Add:
+                    level = LEVEL_ADD;
+                    type = NodeType::Add;
+                    break;
+                case TokenType::Sub:
+                    level = LEVEL_ADD;
+                    type = NodeType::Subtract;
+                    break;
+                case TokenType::Mul:
+                    level = LEVEL_MUL;
+                    type = NodeType::Multiply;
+                    break;
+                case TokenType::Div:
+                    level = LEVEL_MUL;
+                    type = NodeType::Divide;
+                    break;
+                default:
+                    return lhs;
+            }
+            if (level < min_level) {
+                return lhs;
+            }
+            Advance();
+            const std::uint32_t rhs = ParseBinary(level + 1);
+            lhs = AddNode(nodes_, Node(type, lhs, rhs));
+        }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    std::uint32_t ParseUnary() {
+        if (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+            const auto type = token_.type == TokenType::Sub ? NodeType::UnaryMinus : NodeType::UnaryPlus;
+            Advance();
+            const std::uint32_t operand = ParseUnary();
+            return AddNode(nodes_, Node(type, operand, 0));
+        }
+        return ParsePrimary();
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    std::uint32_t ParsePrimary() {
+        const Token token = token_;
+        switch (token.type) {
+            case TokenType::LeftParen: {
+                Advance();
+                const std::uint32_t expr = ParseBinary(LEVEL_ADD);
+                if (token_.type != TokenType::RightParen) {
+                    throw ParsingError("Expected ')'");
+                }
+                Advance();
+                return expr;
+            }
+            case TokenType::Number: {
+                Advance();
+                return AddNode(nodes_, Node(NodeType::Number, ParseNumber(token.text)));
+            }
+            case TokenType::Cell: {
+                Advance();
+                return AddCell(nodes_, cells_, references_, 0, ParsePosition(token.text));
+            }
+            case TokenType::Sheet: {
+                Advance();
+                if (token_.type != TokenType::Cell) {
+                    throw ParsingError("Expected a cell after '" + std::string(token.text) + "'");
+                }
+                const Position value = ParsePosition(token_.text);
+                Advance();
+                return AddCell(nodes_, cells_, references_, AddSheetName(sheet_names_, token.text), value);
+            }
+            case TokenType::Function:
+                Advance();
+                return ParseCall(*FindFunction(token.text));
+            default:
+                throw ParsingError("Unexpected token: " + std::string(token.text));
+        }
     }
 
-    double Evaluate(/*добавьте нужные аргументы*/ args) const override {
-        return value_;
+    void Expect(TokenType type, const char* text) {
+        if (token_.type != type) {
+            throw ParsingError(std::string("Expected '") + text + "'");
+        }
+        Advance();
     }
 
-private:
-    double value_;
-};
+    // FUNCTION '(' arg (',' arg)* ')'
+    std::uint32_t ParseCall(Function function) {
+        Expect(TokenType::LeftParen, "(");
+        std::uint32_t arguments = ParseArgument();
+        while (token_.type == TokenType::Comma) {
+            Advance();
+            const std::uint32_t argument = ParseArgument();
+            arguments = AddNode(nodes_, Node(NodeType::ArgumentList, arguments, argument));
+        }
+        Expect(TokenType::RightParen, ")");
+        return AddNode(nodes_, Node(NodeType::Call, function, arguments, 0));
+    }
 
-class ParseASTListener final : public FormulaBaseListener {
-public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    // SHEET? CELL ':' CELL | expr
+    std::uint32_t ParseArgument() {
+        Lexer lookahead = lexer_;
+        const Token corner = token_.type == TokenType::Sheet ? lookahead.Next() : token_;
+        if (corner.type == TokenType::Cell && lookahead.Next().type == TokenType::Colon) {
+            const std::uint16_t sheet = token_.type == TokenType::Sheet ? AddSheetName(sheet_names_, token_.text) : 0;
+            const Position lhs = ParsePosition(corner.text);
+            lexer_ = lookahead;
+            Advance();
+            if (token_.type != TokenType::Cell) {
+                throw ParsingError("Expected a cell after ':'");
+            }
+            const Position rhs = ParsePosition(token_.text);
+            Advance();
+            return AddRange(nodes_, cells_, ranges_, references_, sheet, lhs, rhs);
+        }
+        return ParseBinary(LEVEL_ADD);
+    }
 
-        return root;
+    // Accepts the same values as reading a double from a stream: overflow is
+    // an error, underflow rounds towards zero.
+    static double ParseNumber(std::string_view text) {
+        double value = 0;
+        const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error == std::errc::result_out_of_range) {
+            const std::string copy(text);
+            errno = 0;
+            value = std::strtod(copy.c_str(), nullptr);
+            if (std::isinf(value)) {
+                throw ParsingError("Invalid number: " + copy);
+            }
+        } else if (error != std::errc{} || end != text.data() + text.size()) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        return value;
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    Lexer lexer_;
+    Token token_;
+    std::vector<Node>& nodes_;
+    std::vector<Position>& cells_;
+    std::vector<Range>& ranges_;
+    std::vector<SheetReference>& references_;
+    std::vector<std::string_view>& sheet_names_;
+};
+
+#ifdef SPREADSHEET_WITH_ANTLR
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    FormulaAST MakeAST() const {
+        assert(args_.size() == 1 && args_.front() == nodes_.size() - 1);
+        return FormulaAST(nodes_, cells_, ranges_, references_, sheet_names_);
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        const std::uint32_t operand = args_.back();
 
-        UnaryOpExpr::Type type;
+        NodeType type;
         if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+            type = NodeType::UnaryMinus;
         } else {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            type = NodeType::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = AddNode(nodes_, Node(type, operand, 0));
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -286,44 +1223,54 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(AddNode(nodes_, Node(NodeType::Number, value)));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
-        }
+        const Position value = ParsePosition(ctx->CELL()->getSymbol()->getText());
+        args_.push_back(AddCell(nodes_, cells_, references_, AddSheet(ctx->SHEET()), value));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        const std::uint16_t sheet = AddSheet(ctx->SHEET());
+        const Position lhs = ParsePosition(ctx->CELL(0)->getSymbol()->getText());
+        const Position rhs = ParsePosition(ctx->CELL(1)->getSymbol()->getText());
+        args_.push_back(AddRange(nodes_, cells_, ranges_, references_, sheet, lhs, rhs));
+        JoinArgument(ctx);
+    }
+
+    void exitArgument(FormulaParser::ArgumentContext* ctx) override {
+        JoinArgument(ctx);
+    }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        assert(args_.size() >= 1);
+        const auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+        assert(function.has_value());
+        args_.back() = AddNode(nodes_, Node(NodeType::Call, *function, args_.back(), 0));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        const std::uint32_t rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        const std::uint32_t lhs = args_.back();
 
-        BinaryOpExpr::Type type;
+        NodeType type;
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            type = NodeType::Add;
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            type = NodeType::Subtract;
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            type = NodeType::Multiply;
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            type = NodeType::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = AddNode(nodes_, Node(type, lhs, rhs));
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -331,8 +1278,37 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    // the number of the sheet of an optional SHEET token, 0 if there is none
+    std::uint16_t AddSheet(antlr4::tree::TerminalNode* sheet) {
+        if (sheet == nullptr) {
+            return 0;
+        }
+        sheet_texts_.push_back(sheet->getSymbol()->getText());
+        return AddSheetName(sheet_names_, sheet_texts_.back());
+    }
+
+    // every argument but the first joins the list of the ones before it
+    // right away, so that the list nodes stay in postfix order
+    void JoinArgument(FormulaParser::ArgContext* ctx) {
+        auto* call = static_cast<FormulaParser::CallContext*>(ctx->parent);
+        if (call->arg(0) == ctx) {
+            return;
+        }
+        assert(args_.size() >= 2);
+        const std::uint32_t rhs = args_.back();
+        args_.pop_back();
+        args_.back() = AddNode(nodes_, Node(NodeType::ArgumentList, args_.back(), rhs));
+    }
+
+    // indices of the nodes that have no parent yet
+    std::vector<std::uint32_t> args_;
+    std::vector<Node> nodes_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    std::vector<SheetReference> references_;
+    // the names point into the token texts, which do not move in a deque
+    std::deque<std::string> sheet_texts_;
+    std::vector<std::string_view> sheet_names_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -345,10 +1321,7 @@ public:
     }
 };
 
-}  // namespace
-}  // namespace ASTImpl
-
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -366,39 +1339,638 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.MakeAST();
+}
+#endif  // SPREADSHEET_WITH_ANTLR
+
+// numbers are compared bitwise: -0 and 0 print differently
+bool IsSameNumber(double lhs, double rhs) {
+    return std::memcmp(&lhs, &rhs, sizeof(double)) == 0;
+}
+
+// compares only the union member the node type uses, never the padding
+bool IsSameNode(const Node& lhs, const Node& rhs) {
+    if (lhs.type != rhs.type || lhs.function != rhs.function || lhs.sheet != rhs.sheet) {
+        return false;
+    }
+    switch (lhs.type) {
+        case NodeType::Number:
+            return IsSameNumber(lhs.number, rhs.number);
+        case NodeType::Cell:
+            return lhs.cell == rhs.cell;
+        default:
+            return lhs.children.lhs == rhs.children.lhs && lhs.children.rhs == rhs.children.rhs;
+    }
+}
+
+bool IsSameInstruction(const Instruction& lhs, const Instruction& rhs) {
+    if (lhs.code != rhs.code || lhs.function != rhs.function || lhs.sheet != rhs.sheet) {
+        return false;
+    }
+    switch (lhs.code) {
+        case OpCode::PushNumber:
+            return IsSameNumber(lhs.number, rhs.number);
+        case OpCode::PushCell:
+        case OpCode::AccumulateCell:
+            return lhs.cell == rhs.cell;
+        case OpCode::AccumulateRange:
+            return lhs.range == rhs.range;
+        default:
+            return true;
+    }
+}
+
+}  // namespace
+}  // namespace ASTImpl
+
+RangeSummary Summarize(const double* values, size_t count, bool with_extrema) {
+    RangeSummary summary;
+    summary.sum = ASTImpl::SumKernel(values, count);
+    summary.count = count;
+    if (with_extrema) {
+        summary.min = ASTImpl::MinKernel(values, count);
+        summary.max = ASTImpl::MaxKernel(values, count);
+    }
+    return summary;
+}
+
+RangeSummary Summarize(const std::vector<double>& values, bool with_extrema) {
+    return Summarize(values.data(), values.size(), with_extrema);
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(text);
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaAST(in_str, ParserBackend::Native);
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+FormulaAST ParseFormulaAST(std::string_view in, ParserBackend backend) {
+    switch (backend) {
+        case ParserBackend::Native:
+            return ASTImpl::NativeParser(in).Parse();
+        case ParserBackend::Antlr:
+#ifdef SPREADSHEET_WITH_ANTLR
+        {
+            std::istringstream stream{std::string(in)};
+            return ASTImpl::ParseWithAntlr(stream);
+        }
+#else
+            throw std::logic_error("Formula parser is built without ANTLR");
+#endif
     }
+    throw std::logic_error("Unknown formula parser");
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+bool IsValidSheetName(std::string_view name) {
+    // a name is valid if it lexes as a whole SHEET token
+    const std::string token = std::string(name) + '!';
+    ASTImpl::Lexer lexer(token);
+    try {
+        const auto first = lexer.Next();
+        return first.type == ASTImpl::TokenType::Sheet && first.text.size() == token.size();
+    } catch (const ParsingError&) {
+        return false;
+    }
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+bool MakeRelativeKey(std::string_view formula, Position anchor, std::string& key) {
+    using ASTImpl::TokenType;
+
+    key.clear();
+    ASTImpl::Lexer lexer(formula);
+    try {
+        for (auto token = lexer.Next(); token.type != TokenType::End; token = lexer.Next()) {
+            if (token.type == TokenType::Cell) {
+                const Position cell = Position::FromString(token.text);
+                if (!cell.IsValid()) {
+                    return false;
+                }
+                key += "R[";
+                key += std::to_string(cell.row - anchor.row);
+                key += "]C[";
+                key += std::to_string(cell.col - anchor.col);
+                key += ']';
+            } else {
+                key += token.text;
+            }
+            // keeps "1 2" and "12" apart
+            key += ' ';
+        }
+    } catch (const ParsingError&) {
+        return false;
+    }
+    return true;
+}
+
+bool ExpandRelativeKey(std::string_view key, std::string& formula, Position& anchor) {
+    // the tokens end with a space each; a cell token is R[row]C[col]
+    std::vector<std::string_view> tokens;
+    std::vector<Position> offsets;
+    Position min_offset{0, 0};
+    for (size_t begin = 0; begin < key.size();) {
+        const size_t end = key.find(' ', begin);
+        if (end == begin || end == std::string_view::npos) {
+            return false;
+        }
+        const std::string_view token = key.substr(begin, end - begin);
+        begin = end + 1;
+        tokens.push_back(token);
+        if (token.size() < 2 || token.substr(0, 2) != "R[") {
+            continue;
+        }
+        Position offset;
+        const char* const token_end = token.data() + token.size();
+        const auto row = std::from_chars(token.data() + 2, token_end, offset.row);
+        if (row.ec != std::errc() || token_end - row.ptr < 3 || std::string_view(row.ptr, 3) != "]C[") {
+            return false;
+        }
+        const auto col = std::from_chars(row.ptr + 3, token_end, offset.col);
+        if (col.ec != std::errc() || col.ptr + 1 != token_end || *col.ptr != ']') {
+            return false;
+        }
+        offsets.push_back(offset);
+        min_offset = {std::min(min_offset.row, offset.row), std::min(min_offset.col, offset.col)};
+    }
+    anchor = {-min_offset.row, -min_offset.col};
+    formula.clear();
+    size_t next_offset = 0;
+    for (const std::string_view token : tokens) {
+        if (token.substr(0, 2) == "R[") {
+            const Position offset = offsets[next_offset++];
+            const Position cell{anchor.row + offset.row, anchor.col + offset.col};
+            if (!cell.IsValid()) {
+                return false;
+            }
+            formula += cell.ToString();
+        } else {
+            formula += token;
+        }
+        formula += ' ';
+    }
+    return true;
 }
 
-double FormulaAST::Execute(/*добавьте нужные аргументы*/ args) const {
-    return root_expr_->Evaluate(/*добавьте нужные аргументы*/ args);
+void FormulaAST::Rebase(Position origin) {
+    auto relative = [origin](Position& cell) {
+        cell = {cell.row - origin.row, cell.col - origin.col};
+    };
+    std::for_each(Cells(), Cells() + cell_count_, relative);
+    std::for_each(Nodes(), Nodes() + node_count_, [&relative](ASTImpl::Node& node) {
+        if (node.type == ASTImpl::NodeType::Cell) {
+            relative(node.cell);
+        }
+    });
+    std::for_each(Program(), Program() + program_size_, [&relative](ASTImpl::Instruction& instruction) {
+        if (instruction.code == ASTImpl::OpCode::PushCell || instruction.code == ASTImpl::OpCode::AccumulateCell) {
+            relative(instruction.cell);
+        }
+    });
+    std::for_each(Ranges(), Ranges() + range_count_, [&relative](Range& range) {
+        relative(range.first);
+        relative(range.last);
+    });
+    std::for_each(References(), References() + reference_count_, [&relative](ASTImpl::SheetReference& reference) {
+        relative(reference.range.first);
+        relative(reference.range.last);
+    });
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+std::string_view FormulaAST::GetSheetName(std::uint32_t sheet) const {
+    return ASTImpl::SheetNameTable{SheetNames(), NameChars()}[sheet];
+}
+
+void FormulaAST::GetReferencedCells(Position origin, std::vector<Position>& cells) const {
+    cells.clear();
+    // the cells are sorted already, a shift keeps them sorted
+    for (const Position cell : GetCells()) {
+        const Position pos = ASTImpl::Absolute(cell, origin);
+        if (pos.IsValid() && (cells.empty() || !(cells.back() == pos))) {
+            cells.push_back(pos);
+        }
+    }
+    if (range_count_ == 0) {
+        return;
+    }
+    for (const Range relative : GetRanges()) {
+        const Range range = ASTImpl::Absolute(relative, origin);
+        if (!range.first.IsValid() || !range.last.IsValid()) {
+            continue;
+        }
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                cells.push_back({row, col});
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+}
+
+void FormulaAST::GetDependencies(Position origin, std::vector<Position>& cells, std::vector<Range>& ranges) const {
+    cells.clear();
+    ranges.clear();
+    ForEachRange(origin, [&ranges](Range range) {
+        ranges.push_back(range);
+    });
+    for (const Position cell : GetCells()) {
+        const Position pos = ASTImpl::Absolute(cell, origin);
+        if (!pos.IsValid() || (!cells.empty() && cells.back() == pos)) {
+            continue;
+        }
+        // range corners are among the cells too
+        const bool covered = std::any_of(ranges.begin(), ranges.end(), [pos](Range range) {
+            return range.Contains(pos);
+        });
+        if (!covered) {
+            cells.push_back(pos);
+        }
+    }
+}
+
+void FormulaAST::PrintCells(std::ostream& out, Position origin) const {
+    for (auto cell : GetCells()) {
+        out << ASTImpl::Absolute(cell, origin).ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out, Position origin) const {
+    ASTImpl::PrintNode(Nodes(), node_count_ - 1, out, origin, {SheetNames(), NameChars()});
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position origin) const {
+    std::string text;
+    PrintFormula(text, origin);
+    out << text;
+}
+
+void FormulaAST::PrintFormula(std::string& out, Position origin) const {
+    ASTImpl::PrintFormulaNode(Nodes(), node_count_ - 1, out, ASTImpl::EP_ATOM, origin, {SheetNames(), NameChars()});
+}
+
+double FormulaAST::Execute(const SheetInterface& sheet, Position origin) const {
+    using ASTImpl::OpCode;
+
+    // typical formulas fit into the fixed buffer, deeper ones use the heap
+    constexpr size_t INLINE_STACK_DEPTH = 64;
+    double inline_stack[INLINE_STACK_DEPTH];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (stack_depth_ > INLINE_STACK_DEPTH) {
+        heap_stack.resize(stack_depth_);
+        stack = heap_stack.data();
+    }
+
+    const ASTImpl::ResolvedSheets sheets(sheet, {SheetNames(), NameChars()}, sheet_count_);
+    // inf and nan survive every operation except being a divisor, so it is
+    // enough to check divisors and the final result instead of every step
+    double* top = stack;  // one past the topmost value
+    for (const auto& instruction : GetProgram()) {
+        switch (instruction.code) {
+            case OpCode::PushNumber:
+                *top++ = instruction.number;
+                break;
+            case OpCode::PushCell:
+                *top++ = ASTImpl::ReadCell(sheets[instruction.sheet], ASTImpl::Absolute(instruction.cell, origin));
+                break;
+            case OpCode::Add:
+                --top;
+                top[-1] = top[-1] + top[0];
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] = top[-1] - top[0];
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] = top[-1] * top[0];
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] = top[-1] / ASTImpl::CheckFinite(top[0]);
+                break;
+            case OpCode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::BeginCall:
+                top[0] = ASTImpl::InitialValue(instruction.function);
+                top[1] = 0;
+                top += 2;
+                break;
+            case OpCode::Accumulate:
+                --top;
+                ASTImpl::Accumulate(instruction.function, top[-2], top[-1], top[0]);
+                break;
+            case OpCode::AccumulateCell: {
+                const Position cell = ASTImpl::Absolute(instruction.cell, origin);
+                ASTImpl::AccumulateRange(sheets[instruction.sheet], {cell, cell}, instruction.function, top[-2],
+                                         top[-1]);
+                break;
+            }
+            case OpCode::AccumulateRange: {
+                const Range range = instruction.sheet == 0 ? Ranges()[instruction.range]
+                                                           : References()[instruction.range].range;
+                ASTImpl::AccumulateRange(sheets[instruction.sheet], ASTImpl::Absolute(range, origin),
+                                         instruction.function, top[-2], top[-1]);
+                break;
+            }
+            case OpCode::EndCall:
+                --top;
+                top[-1] = ASTImpl::CallResult(instruction.function, top[-1], top[0]);
+                break;
+        }
+    }
+    assert(top == stack + 1);
+    return ASTImpl::CheckFinite(stack[0]);
+}
+
+double FormulaAST::ExecuteTree(const SheetInterface& sheet, Position origin) const {
+    const ASTImpl::ResolvedSheets sheets(sheet, {SheetNames(), NameChars()}, sheet_count_);
+    return ASTImpl::EvaluateNode(Nodes(), node_count_ - 1, sheets, origin);
+}
+
+// the arena is a raw block that is never destroyed element by element,
+// and each array in it starts at a boundary suitable for the previous one
+static_assert(std::is_trivially_destructible_v<ASTImpl::Node>
+              && std::is_trivially_destructible_v<ASTImpl::Instruction>
+              && std::is_trivially_destructible_v<Position>);
+static_assert(std::is_trivially_destructible_v<Range>
+              && std::is_trivially_destructible_v<ASTImpl::SheetReference>
+              && std::is_trivially_destructible_v<ASTImpl::SheetName>);
+static_assert(alignof(ASTImpl::Node) >= alignof(ASTImpl::Instruction)
+              && alignof(ASTImpl::Instruction) >= alignof(Position)
+              && alignof(Position) >= alignof(Range)
+              && alignof(Range) >= alignof(ASTImpl::SheetReference)
+              && alignof(ASTImpl::SheetReference) >= alignof(ASTImpl::SheetName));
+
+FormulaAST::FormulaAST(const std::vector<ASTImpl::Node>& nodes, const std::vector<Position>& cells,
+                       const std::vector<Range>& ranges, const std::vector<ASTImpl::SheetReference>& references,
+                       const std::vector<std::string_view>& sheet_names) {
+    assert(!nodes.empty());
+    auto& program = ASTImpl::GetParseBuffers().program;
+    program.clear();
+    ASTImpl::Compile(nodes.data(), static_cast<std::uint32_t>(nodes.size()), program,
+                     ASTImpl::GetParseBuffers().layout);
+
+    size_t name_size = 0;
+    for (const std::string_view name : sheet_names) {
+        name_size += name.size();
+    }
+    if (name_size > UINT32_MAX) {
+        throw ParsingError("Sheet names are too long");
+    }
+    Allocate(static_cast<std::uint32_t>(nodes.size()), static_cast<std::uint32_t>(program.size()),
+             static_cast<std::uint32_t>(cells.size()), static_cast<std::uint32_t>(ranges.size()),
+             static_cast<std::uint32_t>(references.size()), static_cast<std::uint32_t>(sheet_names.size()),
+             static_cast<std::uint32_t>(name_size));
+    std::uninitialized_copy(nodes.begin(), nodes.end(), Nodes());
+    std::uninitialized_copy(program.begin(), program.end(), Program());
+    std::uninitialized_copy(cells.begin(), cells.end(), Cells());
+    std::uninitialized_copy(ranges.begin(), ranges.end(), Ranges());
+    std::uninitialized_copy(references.begin(), references.end(), References());
+    std::uint32_t offset = 0;
+    for (std::uint32_t i = 0; i < sheet_count_; ++i) {
+        const auto size = static_cast<std::uint32_t>(sheet_names[i].size());
+        SheetNames()[i] = {offset, size};
+        std::memcpy(NameChars() + offset, sheet_names[i].data(), size);
+        offset += size;
+    }
+    std::sort(Cells(), Cells() + cell_count_);  // to avoid sorting in GetReferencedCells
+    stack_depth_ = *ASTImpl::StackDepth(Program(), program_size_);
 }
 
 FormulaAST::~FormulaAST() = default;
+
+void FormulaAST::Allocate(std::uint32_t node_count, std::uint32_t program_size, std::uint32_t cell_count,
+                          std::uint32_t range_count, std::uint32_t reference_count, std::uint32_t sheet_count,
+                          std::uint32_t name_size) {
+    node_count_ = node_count;
+    program_size_ = program_size;
+    cell_count_ = cell_count;
+    range_count_ = range_count;
+    reference_count_ = reference_count;
+    sheet_count_ = sheet_count;
+    name_size_ = name_size;
+    arena_ = std::make_unique<std::byte[]>(ArenaSize());
+}
+
+size_t FormulaAST::ArenaSize() const {
+    return node_count_ * sizeof(ASTImpl::Node) + program_size_ * sizeof(ASTImpl::Instruction)
+           + cell_count_ * sizeof(Position) + range_count_ * sizeof(Range)
+           + reference_count_ * sizeof(ASTImpl::SheetReference) + sheet_count_ * sizeof(ASTImpl::SheetName)
+           + name_size_;
+}
+
+bool FormulaAST::operator==(const FormulaAST& other) const {
+    if (node_count_ != other.node_count_ || program_size_ != other.program_size_ || cell_count_ != other.cell_count_
+        || range_count_ != other.range_count_ || reference_count_ != other.reference_count_
+        || sheet_count_ != other.sheet_count_) {
+        return false;
+    }
+    for (std::uint32_t sheet = 1; sheet <= sheet_count_; ++sheet) {
+        if (GetSheetName(sheet) != other.GetSheetName(sheet)) {
+            return false;
+        }
+    }
+    return std::equal(Nodes(), Nodes() + node_count_, other.Nodes(), ASTImpl::IsSameNode)
+           && std::equal(Program(), Program() + program_size_, other.Program(), ASTImpl::IsSameInstruction)
+           && std::equal(Cells(), Cells() + cell_count_, other.Cells())
+           && std::equal(Ranges(), Ranges() + range_count_, other.Ranges())
+           && std::equal(References(), References() + reference_count_, other.References());
+}
+
+void FormulaAST::Serialize(std::string& out) const {
+    const std::uint32_t counts[] = {node_count_,      program_size_, cell_count_, range_count_,
+                                    reference_count_, sheet_count_,  name_size_};
+    out.append(reinterpret_cast<const char*>(counts), sizeof(counts));
+    out.append(reinterpret_cast<const char*>(arena_.get()), ArenaSize());
+}
+
+FormulaAST FormulaAST::Deserialize(std::string_view& in) {
+    using ASTImpl::NodeType;
+    using ASTImpl::OpCode;
+
+    std::uint32_t counts[7];
+    if (in.size() < sizeof(counts)) {
+        throw ParsingError("Truncated formula");
+    }
+    std::memcpy(counts, in.data(), sizeof(counts));
+    in.remove_prefix(sizeof(counts));
+    // the limits keep the arena size far from overflowing size_t
+    constexpr std::uint32_t max_count = 1u << 24;
+    if (counts[0] == 0 || std::any_of(std::begin(counts), std::end(counts), [](std::uint32_t count) {
+            return count > max_count;
+        })) {
+        throw ParsingError("Malformed formula");
+    }
+    FormulaAST ast;
+    ast.Allocate(counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6]);
+    if (in.size() < ast.ArenaSize()) {
+        throw ParsingError("Truncated formula");
+    }
+    std::memcpy(ast.arena_.get(), in.data(), ast.ArenaSize());
+    in.remove_prefix(ast.ArenaSize());
+
+    const Position* cells_begin = ast.Cells();
+    const Position* cells_end = cells_begin + ast.cell_count_;
+    auto is_known_cell = [cells_begin, cells_end](Position cell) {
+        return std::binary_search(cells_begin, cells_end, cell);
+    };
+    if (!std::is_sorted(cells_begin, cells_end)) {
+        throw ParsingError("Malformed formula");
+    }
+    if (ast.sheet_count_ > UINT16_MAX) {
+        throw ParsingError("Malformed formula");
+    }
+    for (std::uint32_t i = 0; i < ast.sheet_count_; ++i) {
+        const ASTImpl::SheetName name = ast.SheetNames()[i];
+        if (std::uint64_t{name.offset} + name.size > ast.name_size_) {
+            throw ParsingError("Malformed formula");
+        }
+    }
+    const ASTImpl::SheetReference* references = ast.References();
+    for (std::uint32_t i = 0; i < ast.reference_count_; ++i) {
+        if (references[i].sheet == 0 || references[i].sheet > ast.sheet_count_) {
+            throw ParsingError("Malformed formula");
+        }
+    }
+
+    // every subtree must occupy the segment that ends at its root,
+    // then printing and tree evaluation visit each node once; ranges and
+    // argument lists may only be arguments of a call
+    std::vector<std::uint32_t> subtree_size(ast.node_count_);
+    const ASTImpl::Node* nodes = ast.Nodes();
+    auto is_expression = [nodes](std::uint32_t index) {
+        return nodes[index].type != NodeType::Range && nodes[index].type != NodeType::ArgumentList;
+    };
+    std::uint32_t range_index = 0;
+    std::uint32_t reference_index = 0;
+    // references to other sheets go in node order, range corners aside
+    auto is_next_reference = [&](std::uint32_t sheet, Range range) {
+        return reference_index < ast.reference_count_
+               && references[reference_index++] == ASTImpl::SheetReference{sheet, range};
+    };
+    for (std::uint32_t i = 0; i < ast.node_count_; ++i) {
+        const auto& node = nodes[i];
+        if (node.sheet > ast.sheet_count_
+            || (node.sheet != 0 && node.type != NodeType::Cell && node.type != NodeType::Range)) {
+            throw ParsingError("Malformed formula");
+        }
+        std::uint32_t size = 1;
+        switch (node.type) {
+            case NodeType::Number:
+                break;
+            case NodeType::Cell:
+                if (node.sheet == 0 ? !is_known_cell(node.cell)
+                                    : !ASTImpl::IsRangeCorner(nodes, ast.node_count_, i)
+                                          && !is_next_reference(node.sheet, {node.cell, node.cell})) {
+                    throw ParsingError("Malformed formula");
+                }
+                break;
+            case NodeType::Add:
+            case NodeType::Subtract:
+            case NodeType::Multiply:
+            case NodeType::Divide:
+            case NodeType::ArgumentList: {
+                const auto [lhs, rhs] = node.children;
+                if (i == 0 || rhs != i - 1 || subtree_size[rhs] > rhs || lhs != rhs - subtree_size[rhs]) {
+                    throw ParsingError("Malformed formula");
+                }
+                const bool is_list = node.type == NodeType::ArgumentList;
+                if (nodes[rhs].type == NodeType::ArgumentList || (!is_list && !is_expression(lhs))
+                    || (!is_list && !is_expression(rhs))) {
+                    throw ParsingError("Malformed formula");
+                }
+                size += subtree_size[lhs] + subtree_size[rhs];
+                break;
+            }
+            case NodeType::UnaryPlus:
+            case NodeType::UnaryMinus:
+            case NodeType::Call:
+                if (i == 0 || node.children.lhs != i - 1
+                    || (node.type != NodeType::Call && !is_expression(i - 1))
+                    || node.function > ASTImpl::Function::Count) {
+                    throw ParsingError("Malformed formula");
+                }
+                size += subtree_size[i - 1];
+                break;
+            case NodeType::Range: {
+                const auto [lhs, rhs] = node.children;
+                if (i < 2 || lhs != i - 2 || rhs != i - 1 || nodes[lhs].type != NodeType::Cell
+                    || nodes[rhs].type != NodeType::Cell || nodes[lhs].sheet != node.sheet
+                    || nodes[rhs].sheet != node.sheet
+                    || nodes[rhs].cell.row < nodes[lhs].cell.row || nodes[rhs].cell.col < nodes[lhs].cell.col) {
+                    throw ParsingError("Malformed formula");
+                }
+                const Range range{nodes[lhs].cell, nodes[rhs].cell};
+                if (node.sheet == 0 ? range_index == ast.range_count_ || !(ast.Ranges()[range_index++] == range)
+                                    : !is_next_reference(node.sheet, range)) {
+                    throw ParsingError("Malformed formula");
+                }
+                size += 2;
+                break;
+            }
+            default:
+                throw ParsingError("Malformed formula");
+        }
+        subtree_size[i] = size;
+    }
+    if (subtree_size.back() != ast.node_count_ || !is_expression(ast.node_count_ - 1)
+        || range_index != ast.range_count_ || reference_index != ast.reference_count_) {
+        throw ParsingError("Malformed formula");
+    }
+
+    const ASTImpl::Instruction* program = ast.Program();
+    for (std::uint32_t i = 0; i < ast.program_size_; ++i) {
+        const auto& instruction = program[i];
+        const bool has_cell = instruction.code == OpCode::PushCell || instruction.code == OpCode::AccumulateCell;
+        const std::uint32_t range_count = instruction.sheet == 0 ? ast.range_count_ : ast.reference_count_;
+        if (instruction.code > OpCode::EndCall || instruction.function > ASTImpl::Function::Count
+            || instruction.sheet > ast.sheet_count_
+            || (has_cell && instruction.sheet == 0 && !is_known_cell(instruction.cell))
+            || (instruction.code == OpCode::AccumulateRange && instruction.range >= range_count)) {
+            throw ParsingError("Malformed formula");
+        }
+    }
+    const auto depth = ASTImpl::StackDepth(program, ast.program_size_);
+    if (!depth) {
+        throw ParsingError("Malformed formula");
+    }
+    ast.stack_depth_ = *depth;
+    return ast;
+}
+
+ASTImpl::Node* FormulaAST::Nodes() const {
+    return reinterpret_cast<ASTImpl::Node*>(arena_.get());
+}
+
+ASTImpl::Instruction* FormulaAST::Program() const {
+    const size_t offset = node_count_ * sizeof(ASTImpl::Node);
+    return reinterpret_cast<ASTImpl::Instruction*>(arena_.get() + offset);
+}
+
+Position* FormulaAST::Cells() const {
+    const size_t offset = node_count_ * sizeof(ASTImpl::Node) + program_size_ * sizeof(ASTImpl::Instruction);
+    return reinterpret_cast<Position*>(arena_.get() + offset);
+}
+
+Range* FormulaAST::Ranges() const {
+    return reinterpret_cast<Range*>(Cells() + cell_count_);
+}
+
+ASTImpl::SheetReference* FormulaAST::References() const {
+    return reinterpret_cast<ASTImpl::SheetReference*>(Ranges() + range_count_);
+}
+
+ASTImpl::SheetName* FormulaAST::SheetNames() const {
+    return reinterpret_cast<ASTImpl::SheetName*>(References() + reference_count_);
+}
+
+char* FormulaAST::NameChars() const {
+    return reinterpret_cast<char*>(SheetNames() + sheet_count_);
+}
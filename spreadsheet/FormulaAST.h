@@ -1,15 +1,193 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
-class Expr;
-}
+// Функции формул. Все они сворачивают свои аргументы, числа и диапазоны,
+// в одно число.
+enum class Function : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+enum class OpCode : std::uint8_t {
+    PushNumber,
+    PushCell,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,
+    // Вызов функции: BeginCall кладёт на стек аккумулятор из двух чисел,
+    // Accumulate снимает со стека аргумент и добавляет его в аккумулятор,
+    // AccumulateCell и AccumulateRange добавляют числа ячейки и диапазона,
+    // EndCall заменяет аккумулятор результатом функции.
+    BeginCall,
+    Accumulate,
+    AccumulateCell,
+    AccumulateRange,
+    EndCall,
+};
+
+// Одна инструкция постфиксной программы. Операнд хранится прямо в инструкции,
+// поэтому программа - один непрерывный массив без указателей.
+struct Instruction {
+    explicit Instruction(OpCode code)
+        : code(code)
+        , number(0) {
+    }
+    Instruction(OpCode code, double number)
+        : code(code)
+        , number(number) {
+    }
+    Instruction(OpCode code, Position cell, std::uint16_t sheet = 0)
+        : code(code)
+        , sheet(sheet)
+        , cell(cell) {
+    }
+    Instruction(OpCode code, Function function, std::uint32_t range = 0, std::uint16_t sheet = 0)
+        : code(code)
+        , function(function)
+        , sheet(sheet)
+        , range(range) {
+    }
+    Instruction(OpCode code, Function function, Position cell, std::uint16_t sheet = 0)
+        : code(code)
+        , function(function)
+        , sheet(sheet)
+        , cell(cell) {
+    }
+
+    OpCode code;
+    Function function = Function::Sum;
+    // лист ячейки или диапазона: ноль - лист формулы, иначе номер имени
+    // листа в формуле, см. FormulaAST::GetSheetName
+    std::uint16_t sheet = 0;
+    union {
+        double number;
+        Position cell;
+        // номер в массиве диапазонов формулы, а у диапазона другого листа -
+        // в массиве ссылок на другие листы
+        std::uint32_t range;
+    };
+};
+
+enum class NodeType : std::uint8_t {
+    Number,
+    Cell,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    UnaryPlus,
+    UnaryMinus,
+    // Диапазон lhs:rhs, дети - узлы Cell. Встречается только как аргумент.
+    Range,
+    // Аргументы функции: lhs - предыдущие аргументы, rhs - последний.
+    ArgumentList,
+    // Вызов функции, lhs - единственный аргумент или ArgumentList.
+    Call,
+};
+
+// Узел дерева формулы. Все узлы формулы лежат в одном массиве в
+// постфиксном порядке: поддерево занимает непрерывный отрезок, который
+// заканчивается его корнем. Дети задаются 32-битными индексами в массиве.
+struct Node {
+    struct Children {
+        std::uint32_t lhs;  // у унарной операции - операнд
+        std::uint32_t rhs;
+    };
+
+    Node(NodeType type, double number)
+        : type(type)
+        , number(number) {
+    }
+    Node(NodeType type, Position cell, std::uint16_t sheet = 0)
+        : type(type)
+        , sheet(sheet)
+        , cell(cell) {
+    }
+    Node(NodeType type, std::uint32_t lhs, std::uint32_t rhs)
+        : type(type)
+        , children{lhs, rhs} {
+    }
+    Node(NodeType type, Function function, std::uint32_t lhs, std::uint32_t rhs)
+        : type(type)
+        , function(function)
+        , children{lhs, rhs} {
+    }
+
+    NodeType type;
+    Function function = Function::Sum;  // у вызова
+    // у ячейки и диапазона - лист, как в Instruction; углы диапазона
+    // другого листа помечены тем же листом
+    std::uint16_t sheet = 0;
+    union {
+        double number;
+        Position cell;
+        Children children;
+    };
+};
+
+// Ссылка формулы на ячейку или диапазон другого листа: отдельная ячейка -
+// диапазон из одной ячейки. Лист - номер его имени в формуле, с единицы.
+struct SheetReference {
+    std::uint32_t sheet;
+    Range range;
+
+    bool operator==(const SheetReference& other) const {
+        return sheet == other.sheet && range == other.range;
+    }
+};
+
+// Имя листа в формуле: отрезок общего массива символов имён.
+struct SheetName {
+    std::uint32_t offset;
+    std::uint32_t size;
+};
+
+// Непрерывный массив объектов, которым владеет кто-то другой.
+template <typename T>
+class Span {
+public:
+    Span(const T* data, size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+
+    const T* begin() const {
+        return data_;
+    }
+    const T* end() const {
+        return data_ + size_;
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+private:
+    const T* data_;
+    size_t size_;
+};
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,33 +195,188 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // Узлы должны идти в постфиксном порядке, корень - последним. Узлы,
+    // скомпилированная программа, отсортированные ячейки, диапазоны,
+    // ссылки на другие листы и имена этих листов копируются в один блок
+    // памяти: формула - это одно выделение. В cells и ranges - только
+    // ссылки на свой лист, ссылки на другие листы идут в references в
+    // порядке узлов.
+    FormulaAST(const std::vector<ASTImpl::Node>& nodes, const std::vector<Position>& cells,
+               const std::vector<Range>& ranges, const std::vector<ASTImpl::SheetReference>& references,
+               const std::vector<std::string_view>& sheet_names);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& arg) const;
-    void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Переводит ссылки на ячейки в смещения относительно origin. После этого
+    // дерево годится для любой ячейки, в которую формула скопирована со
+    // сдвигом: её позиция передаётся как origin в методы ниже. У дерева,
+    // которое не переводилось, origin - ячейка A1.
+    void Rebase(Position origin);
+
+    // Вычисляет формулу по скомпилированной программе. Если ячейка, на
+    // которую ссылается формула, содержит ошибку, бросает эту FormulaError.
+    // Другие листы ищутся по имени через sheet.FindSheet; ссылка на лист,
+    // которого нет, - ошибка #REF!.
+    double Execute(const SheetInterface& sheet, Position origin = {0, 0}) const;
+    // Вычисляет формулу обходом дерева. Медленнее Execute, оставлен как
+    // эталон для проверки компилятора и для замеров.
+    double ExecuteTree(const SheetInterface& sheet, Position origin = {0, 0}) const;
+    void PrintCells(std::ostream& out, Position origin = {0, 0}) const;
+    void Print(std::ostream& out, Position origin = {0, 0}) const;
+    void PrintFormula(std::ostream& out, Position origin = {0, 0}) const;
+    // Дописывает формулу в out. Числа печатаются так же, как потоком с
+    // точностью по умолчанию.
+    void PrintFormula(std::string& out, Position origin = {0, 0}) const;
+
+    // Ячейки своего листа, на которые формула ссылается по одной, включая
+    // углы диапазонов.
+    ASTImpl::Span<Position> GetCells() const {
+        return {Cells(), cell_count_};
+    }
+
+    // Нормализованные диапазоны своего листа в порядке их появления в
+    // формуле.
+    ASTImpl::Span<Range> GetRanges() const {
+        return {Ranges(), range_count_};
+    }
+
+    // Ссылки на другие листы в порядке их появления в формуле.
+    ASTImpl::Span<ASTImpl::SheetReference> GetSheetReferences() const {
+        return {References(), reference_count_};
+    }
+
+    // Число различных листов, на которые ссылается формула, и имя листа
+    // с номером sheet, от единицы до этого числа.
+    [[nodiscard]] std::uint32_t GetSheetCount() const {
+        return sheet_count_;
+    }
+    [[nodiscard]] std::string_view GetSheetName(std::uint32_t sheet) const;
+
+    // Заполняет cells ячейками формулы с началом в origin: отдельными
+    // ячейками и всеми ячейками диапазонов, по возрастанию и без повторов.
+    void GetReferencedCells(Position origin, std::vector<Position>& cells) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Заполняет cells ячейками, на которые формула ссылается по одной и
+    // которые не лежат ни в одном её диапазоне, а ranges - её диапазонами,
+    // всё с началом в origin. Размер результата не зависит от площади
+    // диапазонов.
+    void GetDependencies(Position origin, std::vector<Position>& cells, std::vector<Range>& ranges) const;
+
+    // Вызывает func(range) для каждого диапазона формулы с началом в
+    // origin в порядке их появления. Диапазоны за пределами таблицы
+    // пропускаются.
+    template <typename Func>
+    void ForEachRange(Position origin, Func func) const {
+        for (const Range relative : GetRanges()) {
+            const Range range{{origin.row + relative.first.row, origin.col + relative.first.col},
+                              {origin.row + relative.last.row, origin.col + relative.last.col}};
+            if (range.first.IsValid() && range.last.IsValid()) {
+                func(range);
+            }
+        }
+    }
+
+    // Вызывает func(sheet_name, range) для каждой ссылки на другой лист с
+    // началом в origin в порядке их появления. Ссылки за пределами
+    // таблицы пропускаются.
+    template <typename Func>
+    void ForEachSheetReference(Position origin, Func func) const {
+        for (const auto& reference : GetSheetReferences()) {
+            const Range range{{origin.row + reference.range.first.row, origin.col + reference.range.first.col},
+                              {origin.row + reference.range.last.row, origin.col + reference.range.last.col}};
+            if (range.first.IsValid() && range.last.IsValid()) {
+                func(GetSheetName(reference.sheet), range);
+            }
+        }
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    ASTImpl::Span<ASTImpl::Instruction> GetProgram() const {
+        return {Program(), program_size_};
     }
 
+    // Одинаковы ли деревья, программы, ссылки и имена листов двух формул.
+    // Блоки памяти побайтно не сравниваются: в узлах и инструкциях есть
+    // выравнивание и неиспользуемые части объединений.
+    bool operator==(const FormulaAST& other) const;
+
+    // Дописывает в out размеры частей дерева и его блок памяти как есть.
+    // Представление зависит от раскладки Node и Instruction, поэтому
+    // читать его может только сборка с той же раскладкой.
+    void Serialize(std::string& out) const;
+    // Читает дерево, записанное Serialize, из начала in и сдвигает in за
+    // него. Формула не разбирается заново, проверяется только, что дерево
+    // и программа согласованы и не выходят за свои границы. Бросает
+    // ParsingError, если данные повреждены.
+    static FormulaAST Deserialize(std::string_view& in);
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    FormulaAST() = default;
+    // Выделяет блок памяти под части заданных размеров.
+    void Allocate(std::uint32_t node_count, std::uint32_t program_size, std::uint32_t cell_count,
+                  std::uint32_t range_count, std::uint32_t reference_count, std::uint32_t sheet_count,
+                  std::uint32_t name_size);
+    [[nodiscard]] size_t ArenaSize() const;
+
+    ASTImpl::Node* Nodes() const;
+    ASTImpl::Instruction* Program() const;
+    Position* Cells() const;
+    Range* Ranges() const;
+    ASTImpl::SheetReference* References() const;
+    ASTImpl::SheetName* SheetNames() const;
+    char* NameChars() const;
+
+    // one block holding, in this order:
+    // - the tree nodes, used for printing;
+    // - the tree compiled into postfix order, evaluated
+    //   by a stack machine without recursion;
+    // - the sorted cells, so that they can be traversed
+    //   without going through the whole AST;
+    // - the ranges, indexed by AccumulateRange instructions;
+    // - the references to other sheets, indexed by AccumulateRange
+    //   instructions of those sheets;
+    // - the sheet names and their characters
+    std::unique_ptr<std::byte[]> arena_;
+    std::uint32_t node_count_ = 0;
+    std::uint32_t program_size_ = 0;
+    std::uint32_t cell_count_ = 0;
+    std::uint32_t range_count_ = 0;
+    std::uint32_t reference_count_ = 0;
+    std::uint32_t sheet_count_ = 0;
+    std::uint32_t name_size_ = 0;
+    std::uint32_t stack_depth_ = 0;
+};
 
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+// Разбор формул выполняет собственный парсер с рекурсивным спуском. Парсер на
+// основе ANTLR собирается, если определён SPREADSHEET_WITH_ANTLR, и даёт
+// то же дерево и те же ошибки; он оставлен для сверки.
+enum class ParserBackend {
+    Native,
+    Antlr,
 };
 
+// Сводка чисел values теми же векторными ядрами, что считают функции
+// формул. Минимум и максимум ищутся, только если with_extrema.
+RangeSummary Summarize(const double* values, size_t count, bool with_extrema);
+RangeSummary Summarize(const std::vector<double>& values, bool with_extrema);
+
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view in, ParserBackend backend);
+
+// Можно ли назвать лист name так, чтобы формулы ссылались на него как
+// name!A1: латинские буквы, цифры и подчёркивание, первой - не цифра.
+bool IsValidSheetName(std::string_view name);
+
+// Записывает в key формулу, в которой ссылки на ячейки заменены смещениями
+// относительно anchor (R[-1]C[2]). Формулы с равными ключами разбираются в
+// одно и то же дерево, сдвинутое на разность якорей. Сама формула не
+// разбирается, только делится на лексемы. Возвращает false, если лексер
+// не принимает формулу или она ссылается на несуществующую ячейку.
+bool MakeRelativeKey(std::string_view formula, Position anchor, std::string& key);
+// Обратное MakeRelativeKey: записывает в formula формулу с ключом key,
+// лексемы которой разделены пробелами, а в anchor - ячейку, ближайшую к
+// A1, от которой все смещения ключа остаются в пределах таблицы.
+// Возвращает false, если key не похож на ключ или ссылки не помещаются в
+// таблицу. Формула не проверяется: её ключ может не совпасть с key.
+bool ExpandRelativeKey(std::string_view key, std::string& formula, Position& anchor);
@@ -0,0 +1,47 @@
+#include "bench_runner_p.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Все выделения памяти программы замеров проходят через эти operator new и
+// operator delete. Массивные и nothrow-формы стандартной библиотеки
+// вызывают их же. Перед каждым блоком хранится его размер, чтобы при
+// освобождении знать, сколько памяти вернулось.
+namespace {
+    constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+
+    std::atomic<std::size_t> allocation_count{0};
+    std::atomic<std::size_t> allocated_bytes{0};
+    std::atomic<std::size_t> freed_bytes{0};
+}  // namespace
+
+AllocationStats GetAllocationStats() {
+    const std::size_t allocated = allocated_bytes.load(std::memory_order_relaxed);
+    return {allocation_count.load(std::memory_order_relaxed), allocated,
+            allocated - freed_bytes.load(std::memory_order_relaxed)};
+}
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (auto* block = static_cast<std::size_t*>(std::malloc(HEADER_SIZE + size))) {
+        *block = size;
+        return reinterpret_cast<char*>(block) + HEADER_SIZE;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    if (pointer == nullptr) {
+        return;
+    }
+    auto* block = reinterpret_cast<std::size_t*>(static_cast<char*>(pointer) - HEADER_SIZE);
+    freed_bytes.fetch_add(*block, std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete(void* pointer, std::size_t /* size */) noexcept {
+    operator delete(pointer);
+}
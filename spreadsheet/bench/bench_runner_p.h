@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// Минимальный набор инструментов для замеров производительности.
+// Каждый замер - функция без аргументов, которая сама печатает свои результаты.
+class Stopwatch {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Stopwatch() : start_(Clock::now()) {}
+
+    void Restart() {
+        start_ = Clock::now();
+    }
+
+    [[nodiscard]] double Seconds() const {
+        return std::chrono::duration<double>(Clock::now() - start_).count();
+    }
+
+private:
+    Clock::time_point start_;
+};
+
+inline void ReportThroughput(const std::string& name, std::size_t operations, double seconds) {
+    std::cout << "  " << std::left << std::setw(40) << name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << operations / seconds / 1e6 << " Mops/s"
+              << std::setw(10) << seconds * 1e3 << " ms" << std::endl;
+}
+
+inline void ReportBandwidth(const std::string& name, std::size_t bytes, double seconds) {
+    std::cout << "  " << std::left << std::setw(40) << name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << bytes / seconds / 1e6 << " MB/s  "
+              << std::setw(10) << seconds * 1e3 << " ms" << std::endl;
+}
+
+// Не даёт компилятору выбросить вычисление, результат которого не используется.
+template <typename T>
+void DoNotOptimize(T value) {
+    [[maybe_unused]] static volatile T sink;
+    sink = value;
+}
+
+// Сколько раз и сколько байт программа выделила с момента запуска и сколько
+// из них ещё не освобождено.
+struct AllocationStats {
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+    std::size_t live_bytes = 0;
+};
+
+AllocationStats GetAllocationStats();
+
+class BenchRunner {
+public:
+    template <class BenchFunc>
+    void RunBench(BenchFunc func, const std::string& bench_name) {
+        std::cout << bench_name << std::endl;
+        Stopwatch watch;
+        func();
+        std::cout << "  total " << std::fixed << std::setprecision(2) << watch.Seconds() << " s"
+                  << std::endl;
+    }
+};
+
+#define RUN_BENCH(br, func) br.RunBench(func, #func)
@@ -0,0 +1,1030 @@
+#include "../FormulaAST.h"
+#include "../common.h"
+#include "../formula.h"
+#include "../sheet.h"
+#include "../snapshot.h"
+#include "../tsv_import.h"
+#include "../workbook.h"
+#include "bench_runner_p.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+    // Плотный блок текстовых ячеек: запись и чтение по всей площади.
+    void BenchDenseSetGetCell() {
+        constexpr int rows = 1024;
+        constexpr int cols = 256;
+        constexpr int reads = 10;
+        auto sheet = CreateSheet();
+
+        Stopwatch watch;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet->SetCell(Position{row, col}, "x");
+            }
+        }
+        ReportThroughput("SetCell, dense text", std::size_t{rows} * cols, watch.Seconds());
+
+        watch.Restart();
+        std::size_t found = 0;
+        for (int i = 0; i < reads; ++i) {
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    found += sheet->GetCell(Position{row, col}) != nullptr;
+                }
+            }
+        }
+        DoNotOptimize(found);
+        ReportThroughput("GetCell, dense text", std::size_t{rows} * cols * reads, watch.Seconds());
+    }
+
+    // Вычисление одной и той же формулы обходом дерева и стековой машиной.
+    void BenchFormulaTreeVsBytecode() {
+        constexpr int iterations = 2'000'000;
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 16; ++row) {
+            for (int col = 0; col < 5; ++col) {
+                sheet->SetCell(Position{row, col}, "=" + std::to_string(row + 0.5 * col));
+            }
+        }
+
+        for (const std::string expr : {"(1+2)*3-4/(5+1)+-6*2.5", "A1+B2*C3", "(A1+B2)*C3-4/(D4+1)+-E5*2.5",
+                                       "A1+A2+A3+A4+A5+A6+A7+A8+A9+A10+A11+A12+A13+A14+A15+A16"}) {
+            const FormulaAST ast = ParseFormulaAST(expr);
+            std::cout << "  " << expr << std::endl;
+
+            Stopwatch watch;
+            double sum = 0;
+            for (int i = 0; i < iterations; ++i) {
+                sum += ast.ExecuteTree(*sheet);
+            }
+            DoNotOptimize(sum);
+            ReportThroughput("tree walker", iterations, watch.Seconds());
+
+            watch.Restart();
+            sum = 0;
+            for (int i = 0; i < iterations; ++i) {
+                sum += ast.Execute(*sheet);
+            }
+            DoNotOptimize(sum);
+            ReportThroughput("bytecode", iterations, watch.Seconds());
+        }
+    }
+
+    // Формула, читающая числа, записанные в ячейки как текст.
+    void BenchFormulaReadsNumericText() {
+        constexpr int iterations = 200'000;
+        auto sheet = CreateSheet();
+        std::string expr;
+        for (int row = 0; row < 16; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row * 1.25));
+            expr += (row > 0 ? "+A" : "A") + std::to_string(row + 1);
+        }
+        const auto formula = ParseFormula(expr);
+
+        Stopwatch watch;
+        double sum = 0;
+        for (int i = 0; i < iterations; ++i) {
+            sum += std::get<double>(formula->Evaluate(*sheet));
+        }
+        DoNotOptimize(sum);
+        ReportThroughput("16 text cells per evaluation", iterations, watch.Seconds());
+    }
+
+    // Полный пересчёт тысячи независимых цепочек формул при разном числе потоков.
+    void BenchParallelRecalculation() {
+        constexpr int chains = 1000;
+        constexpr int chain_length = 200;
+        Sheet sheet;
+        for (int col = 0; col < chains; ++col) {
+            sheet.SetCell(Position{0, col}, std::to_string(col));
+            for (int row = 1; row < chain_length; ++row) {
+                const std::string prev = Position{row - 1, col}.ToString();
+                sheet.SetCell(Position{row, col}, "=" + prev + "*1.0001+" + prev + "/3-1");
+            }
+        }
+
+        for (size_t threads : {1, 2, 4, 8, 16}) {
+            for (int col = 0; col < chains; ++col) {
+                sheet.SetCell(Position{0, col}, std::to_string(col + threads));
+            }
+            Stopwatch watch;
+            sheet.Recalculate(threads);
+            ReportThroughput(std::to_string(threads) + " threads, formulas", std::size_t{chains} * (chain_length - 1),
+                             watch.Seconds());
+        }
+    }
+
+    // Разбор большого количества формул каждым из парсеров.
+    void BenchFormulaParsing() {
+        constexpr int formulas = 200'000;
+        std::vector<std::string> texts;
+        texts.reserve(formulas);
+        for (int i = 0; i < formulas; ++i) {
+            const std::string row = std::to_string(i % 16000 + 1);
+            texts.push_back("(A" + row + "+B" + row + ")*C" + row + "-" + std::to_string(i) + ".5/(D" + row + "+1)");
+        }
+
+        auto run = [&texts](const std::string& name, ParserBackend backend) {
+            Stopwatch watch;
+            std::size_t cells = 0;
+            for (const auto& text : texts) {
+                cells += ParseFormulaAST(text, backend).GetProgram().size();
+            }
+            DoNotOptimize(cells);
+            ReportThroughput(name, texts.size(), watch.Seconds());
+        };
+        run("native parser, formulas", ParserBackend::Native);
+#ifdef SPREADSHEET_WITH_ANTLR
+        run("ANTLR parser, formulas", ParserBackend::Antlr);
+#endif
+    }
+
+    // Столбец из одной и той же формулы, протянутой вниз: разбор каждой
+    // копии против общего дерева из таблицы формул листа.
+    void BenchFillDownFormulas() {
+        constexpr int rows = 500'000;
+        std::vector<std::string> texts;
+        texts.reserve(rows);
+        for (int row = 0; row < rows; ++row) {
+            const std::string r = std::to_string(row % Position::MAX_ROWS + 1);
+            texts.push_back("A" + r + "*B" + r + "+C" + r);
+        }
+
+        Stopwatch watch;
+        std::vector<std::unique_ptr<FormulaInterface>> parsed;
+        parsed.reserve(rows);
+        for (const auto& text : texts) {
+            parsed.push_back(ParseFormula(text));
+        }
+        ReportThroughput("separate trees, formulas", rows, watch.Seconds());
+        parsed.clear();
+
+        watch.Restart();
+        FormulaTable formulas;
+        for (int row = 0; row < rows; ++row) {
+            parsed.push_back(ParseFormula(texts[row], Position{row % Position::MAX_ROWS, 3}, formulas));
+        }
+        ReportThroughput("shared trees, formulas", rows, watch.Seconds());
+        std::cout << "  parsed " << formulas.GetParseCount() << " of " << rows << " formulas\n";
+    }
+
+    // Выделения памяти на разбор одной формулы, когда парсер уже прогрет.
+    void BenchFormulaAllocations() {
+        constexpr int repeats = 1000;
+        const std::vector<std::string> texts = {
+            "A1*B1+C1",
+            "(A1+B1)*C1-12.5/(D1+1)",
+            "-(B2-A2)/2+C2*C2*C2-(D7+E7+F7+G7)/4",
+        };
+        for (int i = 0; i < 10; ++i) {
+            for (const auto& text : texts) {
+                DoNotOptimize(ParseFormulaAST(text).GetProgram().size());
+            }
+        }
+
+        std::vector<FormulaAST> parsed;
+        parsed.reserve(std::size_t{repeats} * texts.size());
+        const AllocationStats before = GetAllocationStats();
+        for (int i = 0; i < repeats; ++i) {
+            for (const auto& text : texts) {
+                parsed.push_back(ParseFormulaAST(text));
+            }
+        }
+        const AllocationStats after = GetAllocationStats();
+        const double formulas = static_cast<double>(parsed.size());
+        std::cout << "  per formula: " << (after.count - before.count) / formulas << " allocations, "
+                  << (after.bytes - before.bytes) / formulas << " bytes allocated, "
+                  << (after.live_bytes - before.live_bytes) / formulas << " bytes kept" << std::endl;
+    }
+
+    // Правки отдельных ячеек на листе с миллионом формул: столбцы-цепочки,
+    // в которых каждая ячейка ссылается на ячейку выше. Правка переводит
+    // ячейку на случайную ячейку соседнего столбца и иногда замыкает цикл.
+    void BenchInteractiveEdits() {
+        constexpr int rows = 1000;
+        constexpr int cols = 1000;
+        constexpr int edits = 2000;
+        Sheet sheet;
+        Stopwatch watch;
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell(Position{0, col}, "1");
+            for (int row = 1; row < rows; ++row) {
+                sheet.SetCell(Position{row, col}, "=" + Position{row - 1, col}.ToString() + "+1");
+            }
+        }
+        ReportThroughput("fill, formulas", std::size_t{rows} * cols, watch.Seconds());
+
+        std::mt19937 random(42);
+        std::vector<double> latencies;
+        latencies.reserve(edits);
+        int cycles = 0;
+        for (int i = 0; i < edits; ++i) {
+            const int col = static_cast<int>(random() % cols);
+            const Position pos{1 + static_cast<int>(random() % (rows - 1)), col};
+            const Position ref{static_cast<int>(random() % rows), (col + 1 + static_cast<int>(random() % 2) * (cols - 2)) % cols};
+            const std::string text = "=" + ref.ToString() + "+1";
+            watch.Restart();
+            try {
+                sheet.SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                ++cycles;
+            }
+            latencies.push_back(watch.Seconds());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::setprecision(3) << "  edit latency, ms: p50 " << latencies[edits / 2] * 1e3 << ", p99 "
+                  << latencies[edits * 99 / 100] * 1e3 << ", max " << latencies.back() * 1e3 << "; " << cycles
+                  << " cycles rejected" << std::endl;
+    }
+
+    // Загрузка модели: столбцы-цепочки формул по 1000 строк. Отдельные
+    // SetCell против одного пакета SetCells на разных размерах листа.
+    void BenchBatchImport() {
+        constexpr int rows = 1000;
+        for (int cols : {250, 500, 1000}) {
+            auto make_cells = [cols] {
+                std::vector<std::pair<Position, std::string>> cells;
+                cells.reserve(std::size_t{rows} * cols);
+                for (int col = 0; col < cols; ++col) {
+                    cells.emplace_back(Position{0, col}, "1");
+                    for (int row = 1; row < rows; ++row) {
+                        cells.emplace_back(Position{row, col}, "=" + Position{row - 1, col}.ToString() + "+1");
+                    }
+                }
+                return cells;
+            };
+            const std::string size = std::to_string(rows * cols / 1000) + "k";
+            {
+                auto cells = make_cells();
+                Sheet sheet;
+                Stopwatch watch;
+                for (auto& [pos, text] : cells) {
+                    sheet.SetCell(pos, std::move(text));
+                }
+                ReportThroughput("SetCell, " + size + " cells", cells.size(), watch.Seconds());
+            }
+            {
+                auto cells = make_cells();
+                const std::size_t count = cells.size();
+                Sheet sheet;
+                Stopwatch watch;
+                sheet.SetCells(std::move(cells));
+                ReportThroughput("SetCells, " + size + " cells", count, watch.Seconds());
+            }
+        }
+    }
+
+    // Выгрузка PrintTexts, загруженная обратно: построчное чтение потока с
+    // SetCell на каждое поле против отображённого в память файла.
+    void BenchImportTexts() {
+        constexpr int rows = 8000;
+        constexpr int cols = 64;
+        auto export_sheet = [](bool with_formulas) {
+            Sheet sheet;
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell(Position{row, 0}, std::to_string(row * 7 % 1000) + ".25");
+                sheet.SetCell(Position{row, 1}, "item " + std::to_string(row));
+                for (int col = 2; col < cols; ++col) {
+                    const Position pos{row, col};
+                    if (!with_formulas || col % 2 == 0) {
+                        sheet.SetCell(pos, std::to_string(row + col));
+                    } else if (row == 0) {
+                        sheet.SetCell(pos, "=" + Position{row, col - 1}.ToString() + "*2");
+                    } else {
+                        sheet.SetCell(pos, "=" + Position{row, col - 1}.ToString() + "*2+"
+                                          + Position{row - 1, col}.ToString());
+                    }
+                }
+            }
+            std::ostringstream texts;
+            sheet.PrintTexts(texts);
+            return texts.str();
+        };
+        const auto path = std::filesystem::temp_directory_path() / "spreadsheet_bench_import.tsv";
+        for (bool with_formulas : {false, true}) {
+            const std::string texts = export_sheet(with_formulas);
+            std::ofstream(path, std::ios::binary) << texts;
+            const std::string kind = with_formulas ? "formulas" : "values";
+            {
+                Sheet sheet;
+                Stopwatch watch;
+                std::ifstream input(path, std::ios::binary);
+                std::string line;
+                for (int row = 0; std::getline(input, line); ++row) {
+                    std::istringstream fields(line);
+                    std::string field;
+                    for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+                        if (!field.empty()) {
+                            sheet.SetCell(Position{row, col}, std::move(field));
+                        }
+                    }
+                }
+                ReportBandwidth("getline + SetCell, " + kind, texts.size(), watch.Seconds());
+            }
+            {
+                Sheet sheet;
+                Stopwatch watch;
+                ImportTextsFile(sheet, path.string());
+                ReportBandwidth("ImportTextsFile, " + kind, texts.size(), watch.Seconds());
+            }
+        }
+        std::remove(path.string().c_str());
+    }
+
+    // Запуск модели на 2M ячеек: загрузка текстов с пересчётом против
+    // снимка, в котором формулы уже разобраны и вычислены.
+    void BenchSnapshotStartup() {
+        constexpr int rows = 10000;
+        constexpr int cols = 200;
+        const auto dir = std::filesystem::temp_directory_path();
+        const auto texts_path = dir / "spreadsheet_bench_startup.tsv";
+        const auto snapshot_path = dir / "spreadsheet_bench_startup.bin";
+        {
+            std::vector<std::pair<Position, std::string>> cells;
+            cells.reserve(std::size_t{rows} * cols);
+            for (int row = 0; row < rows; ++row) {
+                cells.emplace_back(Position{row, 0}, "item " + std::to_string(row));
+                for (int col = 1; col < cols; ++col) {
+                    const Position pos{row, col};
+                    if (col % 2 == 0) {
+                        cells.emplace_back(pos, std::to_string(row % 100) + ".5");
+                    } else if (row == 0) {
+                        cells.emplace_back(pos, "=" + Position{row, col - 1}.ToString() + "*2");
+                    } else {
+                        cells.emplace_back(pos, "=" + Position{row, col - 1}.ToString() + "+"
+                                                    + Position{row - 1, col}.ToString() + "/2");
+                    }
+                }
+            }
+            Sheet sheet;
+            sheet.SetCells(std::move(cells));
+            sheet.Recalculate();
+            std::ofstream texts(texts_path, std::ios::binary);
+            sheet.PrintTexts(texts);
+            Stopwatch watch;
+            std::ofstream snapshot(snapshot_path, std::ios::binary);
+            SaveSnapshot(sheet, snapshot);
+            snapshot.close();
+            ReportThroughput("SaveSnapshot, 2M cells", std::size_t{rows} * cols, watch.Seconds());
+            std::cout << "  snapshot " << std::filesystem::file_size(snapshot_path) / 1000000 << " MB, texts "
+                      << std::filesystem::file_size(texts_path) / 1000000 << " MB" << std::endl;
+        }
+        {
+            Sheet sheet;
+            Stopwatch watch;
+            ImportTextsFile(sheet, texts_path.string());
+            sheet.Recalculate();
+            ReportThroughput("ImportTextsFile + Recalculate", std::size_t{rows} * cols, watch.Seconds());
+        }
+        {
+            Sheet sheet;
+            Stopwatch watch;
+            LoadSnapshotFile(sheet, snapshot_path.string());
+            ReportThroughput("LoadSnapshotFile", std::size_t{rows} * cols, watch.Seconds());
+            DoNotOptimize(std::get<double>(sheet.GetCell(Position{rows - 1, cols - 1})->GetValue()));
+        }
+        std::remove(texts_path.string().c_str());
+        std::remove(snapshot_path.string().c_str());
+    }
+
+    // Поток, который отбрасывает вывод: замеряется только форматирование.
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override {
+            return c;
+        }
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+
+    // Выгрузка листа на 1M ячеек против его пересчёта. Для сравнения -
+    // прежняя печать: GetCell на каждую позицию и operator<< для значений.
+    void BenchPrintSheet() {
+        constexpr int rows = 1000;
+        constexpr int cols = 1000;
+        constexpr std::size_t cells = std::size_t{rows} * cols;
+        Sheet sheet;
+        {
+            std::vector<std::pair<Position, std::string>> texts;
+            texts.reserve(cells);
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    const Position pos{row, col};
+                    if (col % 2 == 0) {
+                        texts.emplace_back(pos, std::to_string(row * 3 + col) + ".125");
+                    } else {
+                        texts.emplace_back(pos, "=" + Position{row, col - 1}.ToString() + "/7");
+                    }
+                }
+            }
+            sheet.SetCells(std::move(texts));
+        }
+        Stopwatch watch;
+        sheet.Recalculate();
+        ReportThroughput("Recalculate", cells, watch.Seconds());
+
+        NullBuffer null_buffer;
+        std::ostream output(&null_buffer);
+        watch.Restart();
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    output << '\t';
+                }
+                if (const Cell* cell = sheet.GetCell(Position{row, col})) {
+                    std::visit([&output](const auto& value) {
+                        output << value;
+                    }, cell->GetValue());
+                }
+            }
+            output << '\n';
+        }
+        ReportThroughput("GetCell + operator<< values", cells, watch.Seconds());
+        watch.Restart();
+        sheet.PrintValues(output);
+        ReportThroughput("PrintValues", cells, watch.Seconds());
+        watch.Restart();
+        sheet.PrintTexts(output);
+        ReportThroughput("PrintTexts", cells, watch.Seconds());
+        watch.Restart();
+        for (int row = 0; row < rows; row += 50) {
+            sheet.PrintValues(output, Position{row, 100}, Size{50, 80});
+        }
+        ReportThroughput("PrintValues, 50x80 viewports", std::size_t{rows} * 80, watch.Seconds());
+    }
+
+    // SUM по блоку из 100000 чисел против той же суммы, записанной
+    // цепочкой сложений: вычисление готовой формулы и запись формулы в
+    // лист вместе с первым вычислением. В листе не больше 16384 строк,
+    // поэтому блок - десять столбцов по 10000 ячеек.
+    void BenchRangeAggregates() {
+        constexpr int rows = 10'000;
+        constexpr int cols = 10;
+        constexpr std::size_t cells = std::size_t{rows} * cols;
+        constexpr int iterations = 50;
+        Sheet sheet;
+        std::string chain;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                const Position pos{row, col};
+                sheet.SetCell(pos, std::to_string((row + col) % 1000 * 0.25));
+                chain += (chain.empty() ? "" : "+") + pos.ToString();
+            }
+        }
+        const std::string range = "A1:" + Position{rows - 1, cols - 1}.ToString();
+        auto short_name = [](const std::string& expr) {
+            return expr.size() < 24 ? expr : expr.substr(0, 12) + "...";
+        };
+
+        for (const std::string& expr : {"SUM(" + range + ")", chain, "MAX(" + range + ")",
+                                        "AVERAGE(" + range + ")", "COUNT(" + range + ")"}) {
+            const auto formula = ParseFormula(expr);
+            Stopwatch watch;
+            double sum = 0;
+            for (int i = 0; i < iterations; ++i) {
+                sum += std::get<double>(formula->Evaluate(sheet));
+            }
+            DoNotOptimize(sum);
+            ReportThroughput("Evaluate " + short_name(expr) + ", cells", cells * iterations, watch.Seconds());
+        }
+
+        const Position target{0, cols};
+        for (const std::string& expr : {"SUM(" + range + ")", chain}) {
+            Stopwatch watch;
+            sheet.SetCell(target, "=" + expr);
+            DoNotOptimize(std::get<double>(sheet.GetCell(target)->GetValue()));
+            ReportThroughput("SetCell " + short_name(expr) + ", cells", cells, watch.Seconds());
+            sheet.ClearCell(target);
+        }
+    }
+
+    // Чтение диапазонов, в которых лежат вычисленные формулы и текст:
+    // значения берутся из столбцов хранилища значений листа, а не из ячеек.
+    void BenchColumnarScans() {
+        constexpr int rows = 16'000;
+        constexpr int iterations = 100;
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < rows; ++row) {
+            const std::string index = std::to_string(row + 1);
+            cells.emplace_back(Position{row, 0}, std::to_string(row % 1000 * 0.25));
+            cells.emplace_back(Position{row, 1}, "=A" + index + "*2");
+            cells.emplace_back(Position{row, 2}, row % 3 == 0 ? "text" : std::to_string(row % 7));
+        }
+        sheet.SetCells(std::move(cells));
+        sheet.Recalculate();
+        const std::string last = std::to_string(rows);
+
+        for (const std::string& expr : {"SUM(B1:B" + last + ")", "MAX(B1:B" + last + ")",
+                                        "COUNT(A1:C" + last + ")", "AVERAGE(A1:C" + last + ")"}) {
+            const auto formula = ParseFormula(expr);
+            const std::size_t scanned = expr[0] == 'S' || expr[0] == 'M' ? rows : std::size_t{rows} * 3;
+            Stopwatch watch;
+            double sum = 0;
+            for (int i = 0; i < iterations; ++i) {
+                sum += std::get<double>(formula->Evaluate(sheet));
+            }
+            DoNotOptimize(sum);
+            ReportThroughput("Evaluate " + expr.substr(0, expr.find('(')) + " over formulas, cells",
+                             scanned * iterations, watch.Seconds());
+        }
+
+        std::string chain;
+        for (int row = 1; row <= 1000; ++row) {
+            chain += (chain.empty() ? "B" : "+B") + std::to_string(row * 97 % rows + 1);
+        }
+        const auto formula = ParseFormula(chain);
+        Stopwatch watch;
+        double sum = 0;
+        for (int i = 0; i < iterations * 10; ++i) {
+            sum += std::get<double>(formula->Evaluate(sheet));
+        }
+        DoNotOptimize(sum);
+        ReportThroughput("Evaluate 1000 references to formulas, reads", std::size_t{1000} * iterations * 10,
+                         watch.Seconds());
+    }
+
+    // Много формул над одним большим диапазоном: запись формул, правка
+    // ячейки внутри диапазона со сбросом зависимых и пересчёт. Диапазоны
+    // лежат в индексе листа, поэтому запись формулы не связывает её с
+    // каждой ячейкой диапазона.
+    void BenchLargeRangeDependencies() {
+        constexpr int rows = 10'000;
+        constexpr int formulas = 2'000;
+        constexpr int edits = 1'000;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 100));
+        }
+
+        Stopwatch watch;
+        for (int i = 0; i < formulas; ++i) {
+            const int last = rows - i;
+            sheet.SetCell(Position{i, 1}, "=SUM(A1:A" + std::to_string(last) + ")");
+        }
+        ReportThroughput("SetCell SUM over ~10000 cells, formulas", formulas, watch.Seconds());
+
+        watch.Restart();
+        std::mt19937 random(42);
+        std::uniform_int_distribution<int> row_of(0, rows - 1);
+        for (int i = 0; i < edits; ++i) {
+            sheet.SetCell(Position{row_of(random), 0}, std::to_string(i % 100));
+        }
+        ReportThroughput("SetCell in range, invalidations", std::size_t{edits} * formulas, watch.Seconds());
+
+        watch.Restart();
+        sheet.Recalculate();
+        ReportThroughput("Recalculate, formulas", formulas, watch.Seconds());
+        DoNotOptimize(std::get<double>(sheet.GetCell(Position{formulas - 1, 1})->GetValue()));
+    }
+
+    // Поток котировок: одна правка числа в большом столбце, после которой
+    // читаются все агрегаты над ним. Сводки диапазонов поправляются на
+    // разность, поэтому тик не перечитывает столбец.
+    void BenchLiveFeedAggregates() {
+        constexpr int rows = 10'000;
+        constexpr int ticks = 20'000;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 1000 * 0.5));
+        }
+        const std::string range = "(A1:A" + std::to_string(rows) + ")";
+        const std::vector<std::string> functions{"SUM", "AVERAGE", "COUNT", "MIN", "MAX"};
+        for (size_t i = 0; i < functions.size(); ++i) {
+            sheet.SetCell(Position{0, 2 + static_cast<int>(i)}, "=" + functions[i] + range);
+        }
+
+        std::mt19937 random(42);
+        std::uniform_int_distribution<int> row_of(0, rows - 1);
+        std::uniform_int_distribution<int> price_of(0, 100'000);
+        double total = 0;
+        Stopwatch watch;
+        for (int tick = 0; tick < ticks; ++tick) {
+            sheet.SetCell(Position{row_of(random), 0}, std::to_string(price_of(random) * 0.01));
+            for (size_t i = 0; i < functions.size(); ++i) {
+                total += std::get<double>(sheet.GetCell(Position{0, 2 + static_cast<int>(i)})->GetValue());
+            }
+        }
+        DoNotOptimize(total);
+        ReportThroughput("ticks, 5 aggregates over 10000 cells", ticks, watch.Seconds());
+    }
+
+    // Память листа на ячейку при миллионе ячеек одного вида: пустых,
+    // текстовых и формул. Учитывается всё, что лист держит после записи:
+    // ячейки, связи, значения, деревья формул.
+    void BenchCellMemory() {
+        constexpr int rows = 1000;
+        constexpr int cols = 1000;
+        constexpr double cells = double{rows} * cols;
+        auto report = [](const std::string& kind, std::size_t bytes) {
+            std::cout << "  " << std::left << std::setw(40) << kind + " cells, bytes per cell" << std::right
+                      << std::fixed << std::setprecision(1) << std::setw(10) << bytes / cells << std::endl;
+        };
+        auto measure = [](auto fill) {
+            const AllocationStats before = GetAllocationStats();
+            Sheet sheet;
+            fill(sheet);
+            return GetAllocationStats().live_bytes - before.live_bytes;
+        };
+
+        auto fill = [](const std::string& text) {
+            return [text](Sheet& sheet) {
+                std::vector<std::pair<Position, std::string>> edits;
+                edits.reserve(std::size_t{rows} * cols);
+                for (int row = 0; row < rows; ++row) {
+                    for (int col = 0; col < cols; ++col) {
+                        edits.emplace_back(Position{row, col}, text);
+                    }
+                }
+                sheet.SetCells(std::move(edits));
+            };
+        };
+        report("empty", measure(fill("")));
+        report("text", measure(fill("item 42")));
+
+        // каждая формула, кроме первой в строке, ссылается на ячейку слева
+        report("formula", measure([](Sheet& sheet) {
+            std::vector<std::pair<Position, std::string>> edits;
+            edits.reserve(std::size_t{rows} * cols);
+            for (int row = 0; row < rows; ++row) {
+                edits.emplace_back(Position{row, 0}, "=1");
+                for (int col = 1; col < cols; ++col) {
+                    edits.emplace_back(Position{row, col}, "=" + Position{row, col - 1}.ToString() + "+1");
+                }
+            }
+            sheet.SetCells(std::move(edits));
+        }));
+    }
+
+    // Общая модель для потоков запросов: писатель правит входные числа и
+    // публикует версии, читатели берут последнюю версию и читают из неё
+    // случайные значения. Строки - цепочки формул слева направо.
+    void BenchPublishedReaders() {
+        constexpr int rows = 1000;
+        constexpr int cols = 64;
+        constexpr int reads_per_version = 100;
+        constexpr double seconds = 0.3;
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < rows; ++row) {
+            cells.emplace_back(Position{row, 0}, "1");
+            for (int col = 1; col < cols; ++col) {
+                cells.emplace_back(Position{row, col}, "=" + Position{row, col - 1}.ToString() + "+1");
+            }
+        }
+        sheet.SetCells(std::move(cells));
+
+        Stopwatch watch;
+        sheet.Publish();
+        ReportThroughput("first Publish, cells", std::size_t{rows} * cols, watch.Seconds());
+
+        std::mt19937 random(42);
+        auto edit = [&sheet, &random] {
+            sheet.SetCell(Position{static_cast<int>(random() % rows), 0}, std::to_string(random() % 100));
+        };
+        constexpr int publications = 1000;
+        watch.Restart();
+        for (int i = 0; i < publications; ++i) {
+            edit();
+            sheet.Publish();
+        }
+        std::cout << std::setprecision(3) << "  edit + Publish, us: " << watch.Seconds() / publications * 1e6
+                  << std::endl;
+
+        for (const int reader_count : {1, 4}) {
+            std::atomic<bool> done = false;
+            std::atomic<std::size_t> reads = 0;
+            std::vector<std::thread> readers;
+            for (int reader = 0; reader < reader_count; ++reader) {
+                readers.emplace_back([&sheet, &done, &reads, reader] {
+                    std::mt19937 reader_random(reader);
+                    std::size_t count = 0;
+                    double sum = 0;
+                    while (!done.load(std::memory_order_relaxed)) {
+                        const Sheet::VersionReference version = sheet.GetPublishedVersion();
+                        for (int i = 0; i < reads_per_version; ++i) {
+                            const Position pos{static_cast<int>(reader_random() % rows),
+                                               static_cast<int>(reader_random() % cols)};
+                            sum += std::get<double>(version->GetNumericValue(pos));
+                        }
+                        count += reads_per_version;
+                    }
+                    DoNotOptimize(sum);
+                    reads += count;
+                });
+            }
+            std::size_t published = 0;
+            watch.Restart();
+            while (watch.Seconds() < seconds) {
+                edit();
+                sheet.Publish();
+                ++published;
+            }
+            done = true;
+            for (std::thread& reader : readers) {
+                reader.join();
+            }
+            const double elapsed = watch.Seconds();
+            ReportThroughput(std::to_string(reader_count) + " readers, reads", reads.load(), elapsed);
+            std::cout << std::setprecision(3) << "  publications per second: " << published / elapsed << std::endl;
+        }
+    }
+
+    // Тик фронтенда: одна правка входного числа, затем клиент узнаёт, что
+    // поменялось. Опрос перечитывает значения всего листа, подписка
+    // получает список изменённых позиций. Строки - цепочки формул слева
+    // направо, правка меняет одну строку.
+    void BenchChangeNotifications() {
+        constexpr int rows = 2000;
+        constexpr int cols = 50;
+        constexpr int poll_ticks = 20;
+        constexpr int ticks = 2000;
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < rows; ++row) {
+            cells.emplace_back(Position{row, 0}, "1");
+            for (int col = 1; col < cols; ++col) {
+                cells.emplace_back(Position{row, col}, "=" + Position{row, col - 1}.ToString() + "+1");
+            }
+        }
+        sheet.SetCells(std::move(cells));
+        sheet.Recalculate();
+
+        std::mt19937 random(42);
+        Stopwatch watch;
+        double sum = 0;
+        for (int tick = 0; tick < poll_ticks; ++tick) {
+            sheet.SetCell(Position{static_cast<int>(random() % rows), 0}, std::to_string(random() % 100));
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    sum += std::get<double>(sheet.GetCell(Position{row, col})->GetNumericValue());
+                }
+            }
+        }
+        const double poll_seconds = watch.Seconds();
+
+        size_t delivered = 0;
+        sheet.Subscribe([&delivered](const std::vector<Position>& changed) {
+            delivered += changed.size();
+        });
+        watch.Restart();
+        for (int tick = 0; tick < ticks; ++tick) {
+            sheet.SetCell(Position{static_cast<int>(random() % rows), 0}, std::to_string(random() % 100));
+        }
+        const double subscribe_seconds = watch.Seconds();
+        DoNotOptimize(sum);
+        std::cout << std::setprecision(3) << "  per tick, us: polling " << poll_seconds / poll_ticks * 1e6
+                  << ", subscription " << subscribe_seconds / ticks * 1e6 << "; positions per tick: polled "
+                  << rows * cols << ", delivered " << static_cast<double>(delivered) / ticks << std::endl;
+    }
+
+    // Панель над вводом: в столбце A входные числа, в B - их удвоения, в C
+    // - нарастающий итог по B, сверху итоги по столбцам. Правка меняет
+    // случайное входное число, затем панель читает итоги. В ленивом
+    // режиме пересчёт платит первое чтение, в жадном - правка.
+    void BenchEagerRecalculation() {
+        constexpr int rows = 2000;
+        constexpr int edits = 2000;
+        const std::vector<Position> dashboard = {Position::FromString("E1"), Position::FromString("E2"), Position::FromString("E3"), Position::FromString("E4")};
+        for (const auto mode : {Sheet::CalculationMode::Lazy, Sheet::CalculationMode::Eager}) {
+            Sheet sheet;
+            sheet.SetCalculationMode(mode);
+            for (int row = 0; row < rows; ++row) {
+                const std::string index = std::to_string(row + 1);
+                sheet.SetCell(Position{row, 0}, std::to_string(row % 10));
+                sheet.SetCell(Position{row, 1}, "=A" + index + "*2");
+                sheet.SetCell(Position{row, 2}, row == 0 ? "=B1" : "=C" + std::to_string(row) + "+B" + index);
+            }
+            const std::string last = std::to_string(rows);
+            sheet.SetCell(Position::FromString("E1"), "=SUM(B1:B" + last + ")");
+            sheet.SetCell(Position::FromString("E2"), "=C" + last);
+            sheet.SetCell(Position::FromString("E3"), "=MAX(B1:B" + last + ")");
+            sheet.SetCell(Position::FromString("E4"), "=E1/E2");
+            for (const Position pos : dashboard) {
+                DoNotOptimize(std::get<double>(sheet.GetCell(pos)->GetValue()));
+            }
+
+            std::mt19937 random(42);
+            std::vector<double> edit_latencies;
+            std::vector<double> read_latencies;
+            Stopwatch watch;
+            for (int i = 0; i < edits; ++i) {
+                const Position pos{static_cast<int>(random() % rows), 0};
+                const std::string text = std::to_string(random() % 100);
+                watch.Restart();
+                sheet.SetCell(pos, text);
+                edit_latencies.push_back(watch.Seconds());
+                watch.Restart();
+                for (const Position read : dashboard) {
+                    DoNotOptimize(std::get<double>(sheet.GetCell(read)->GetValue()));
+                }
+                read_latencies.push_back(watch.Seconds());
+            }
+            std::sort(edit_latencies.begin(), edit_latencies.end());
+            std::sort(read_latencies.begin(), read_latencies.end());
+            std::cout << std::setprecision(3) << "  " << (mode == Sheet::CalculationMode::Lazy ? "lazy" : "eager")
+                      << ": read latency, us: p50 " << read_latencies[edits / 2] * 1e6 << ", p99 "
+                      << read_latencies[edits * 99 / 100] * 1e6 << "; edit latency, us: p50 "
+                      << edit_latencies[edits / 2] * 1e6 << ", p99 " << edit_latencies[edits * 99 / 100] * 1e6
+                      << std::endl;
+        }
+    }
+
+    // Миллион ячеек с двумя тысячами повторяющихся меток: память листа на
+    // ячейку и выделения памяти при печати значений и текстов.
+    void BenchRepeatedLabels() {
+        constexpr int rows = 1000;
+        constexpr int cols = 1000;
+        constexpr int labels = 2000;
+        constexpr std::size_t cells = std::size_t{rows} * cols;
+        const AllocationStats before = GetAllocationStats();
+        Sheet sheet;
+        {
+            std::vector<std::pair<Position, std::string>> texts;
+            texts.reserve(cells);
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    const int label = (row * cols + col) * 7919 % labels;
+                    texts.emplace_back(Position{row, col}, "product category #" + std::to_string(label));
+                }
+            }
+            Stopwatch watch;
+            sheet.SetCells(std::move(texts));
+            ReportThroughput("SetCells, labels", cells, watch.Seconds());
+        }
+        const AllocationStats filled = GetAllocationStats();
+        std::cout << "  bytes per cell: " << std::fixed << std::setprecision(1)
+                  << static_cast<double>(filled.live_bytes - before.live_bytes) / cells << std::endl;
+
+        NullBuffer null_buffer;
+        std::ostream output(&null_buffer);
+        for (const bool values : {true, false}) {
+            const AllocationStats start = GetAllocationStats();
+            Stopwatch watch;
+            if (values) {
+                sheet.PrintValues(output);
+            } else {
+                sheet.PrintTexts(output);
+            }
+            const double seconds = watch.Seconds();
+            const AllocationStats end = GetAllocationStats();
+            ReportThroughput(values ? "PrintValues, cells" : "PrintTexts, cells", cells, seconds);
+            std::cout << "  allocations per 1000 cells: " << std::setprecision(2)
+                      << (end.count - start.count) * 1000.0 / cells << std::endl;
+        }
+    }
+
+    // Книга из независимых листов с длинной цепочкой формул в каждом и
+    // итоговый лист над ними: цепочку листа параллельно не посчитать,
+    // листы - можно. Правки листа книги, из которого ссылки ведут в
+    // другие листы, - против правок отдельного листа.
+    void BenchWorkbookRecalculation() {
+        constexpr int sheets = 16;
+        constexpr int chain_length = 16'000;
+        Workbook book;
+        std::string total = "=0";
+        for (int index = 0; index < sheets; ++index) {
+            const std::string name = "Part" + std::to_string(index);
+            Sheet& sheet = book.AddSheet(name);
+            std::vector<std::pair<Position, std::string>> cells;
+            cells.reserve(chain_length);
+            cells.emplace_back(Position{0, 0}, std::to_string(index));
+            for (int row = 1; row < chain_length; ++row) {
+                const std::string prev = Position{row - 1, 0}.ToString();
+                cells.emplace_back(Position{row, 0}, "=" + prev + "*0.5+" + prev + "/4+1");
+            }
+            sheet.SetCells(std::move(cells));
+            total += "+" + name + "!" + Position{chain_length - 1, 0}.ToString();
+        }
+        Sheet& summary = book.AddSheet("Total");
+        summary.SetCell(Position{0, 0}, total);
+
+        for (size_t threads : {1, 2, 4, 8, 16}) {
+            for (int index = 0; index < sheets; ++index) {
+                book.GetSheet("Part" + std::to_string(index))->SetCell(Position{0, 0}, std::to_string(index + threads));
+            }
+            Stopwatch watch;
+            book.Recalculate(threads);
+            ReportThroughput(std::to_string(threads) + " threads, formulas", std::size_t{sheets} * (chain_length - 1),
+                             watch.Seconds());
+        }
+        DoNotOptimize(std::get<double>(summary.GetCell(Position{0, 0})->GetNumericValue()));
+
+        constexpr int edits = 100'000;
+        auto run_edits = [](const std::string& name, Sheet& sheet) {
+            Stopwatch watch;
+            for (int i = 0; i < edits; ++i) {
+                sheet.SetCell(Position{i % 1000, 2}, "=Part0!A" + std::to_string(i % 1000 + 1) + "+B1");
+            }
+            ReportThroughput(name, edits, watch.Seconds());
+        };
+        run_edits("SetCell in a workbook sheet, edits", book.AddSheet("Edits"));
+        Sheet standalone;
+        run_edits("SetCell in a standalone sheet, edits", standalone);
+    }
+
+    // Вариант расчёта на большом листе: точка сохранения, пять изменённых
+    // входов и возврат к точке - против пересборки листа из текстов.
+    void BenchCheckpoints() {
+        constexpr int rows = 10'000;
+        constexpr int cols = 8;
+        std::vector<std::pair<Position, std::string>> texts;
+        texts.reserve(std::size_t{rows} * cols);
+        for (int row = 0; row < rows; ++row) {
+            const std::string r = std::to_string(row + 1);
+            for (int col = 0; col < cols - 1; ++col) {
+                texts.emplace_back(Position{row, col}, std::to_string((row * 31 + col * 7) % 1000));
+            }
+            texts.emplace_back(Position{row, cols - 1}, "=A" + r + "*B" + r + "+SUM(C" + r + ":G" + r + ")");
+        }
+        Sheet sheet;
+        sheet.SetCells(texts);
+        sheet.Recalculate();
+
+        {
+            Stopwatch watch;
+            const Sheet::Checkpoint first = sheet.MakeCheckpoint();
+            ReportThroughput("first checkpoint, cells", texts.size(), watch.Seconds());
+        }
+        constexpr int scenarios = 200;
+        const AllocationStats before = GetAllocationStats();
+        std::vector<Sheet::Checkpoint> checkpoints;
+        Stopwatch make_watch;
+        for (int i = 0; i < scenarios; ++i) {
+            checkpoints.push_back(sheet.MakeCheckpoint());
+        }
+        ReportThroughput("checkpoints", scenarios, make_watch.Seconds());
+        std::cout << "  bytes per checkpoint: "
+                  << (GetAllocationStats().live_bytes - before.live_bytes) / scenarios << std::endl;
+        checkpoints.clear();
+
+        const Sheet::Checkpoint base = sheet.MakeCheckpoint();
+        Stopwatch watch;
+        double total = 0;
+        for (int i = 0; i < scenarios; ++i) {
+            for (int input = 0; input < 5; ++input) {
+                sheet.SetCell(Position{(i * 997 + input * 1931) % rows, 0}, std::to_string(i + input));
+            }
+            total += std::get<double>(sheet.GetNumericValue(Position{(i * 997) % rows, cols - 1}));
+            sheet.Restore(base);
+        }
+        DoNotOptimize(total);
+        ReportThroughput("edit five inputs and restore, scenarios", scenarios, watch.Seconds());
+
+        Stopwatch rebuild_watch;
+        for (int i = 0; i < 3; ++i) {
+            Sheet copy;
+            copy.SetCells(texts);
+            DoNotOptimize(std::get<double>(copy.GetNumericValue(Position{0, cols - 1})));
+        }
+        ReportThroughput("rebuild from texts, scenarios", 3, rebuild_watch.Seconds());
+    }
+
+}  // namespace
+
+int main() {
+    BenchRunner br;
+    RUN_BENCH(br, BenchDenseSetGetCell);
+    RUN_BENCH(br, BenchFormulaTreeVsBytecode);
+    RUN_BENCH(br, BenchFormulaReadsNumericText);
+    RUN_BENCH(br, BenchParallelRecalculation);
+    RUN_BENCH(br, BenchFormulaParsing);
+    RUN_BENCH(br, BenchFillDownFormulas);
+    RUN_BENCH(br, BenchFormulaAllocations);
+    RUN_BENCH(br, BenchInteractiveEdits);
+    RUN_BENCH(br, BenchBatchImport);
+    RUN_BENCH(br, BenchImportTexts);
+    RUN_BENCH(br, BenchSnapshotStartup);
+    RUN_BENCH(br, BenchPrintSheet);
+    RUN_BENCH(br, BenchRangeAggregates);
+    RUN_BENCH(br, BenchColumnarScans);
+    RUN_BENCH(br, BenchLargeRangeDependencies);
+    RUN_BENCH(br, BenchLiveFeedAggregates);
+    RUN_BENCH(br, BenchCellMemory);
+    RUN_BENCH(br, BenchRepeatedLabels);
+    RUN_BENCH(br, BenchEagerRecalculation);
+    RUN_BENCH(br, BenchChangeNotifications);
+    RUN_BENCH(br, BenchPublishedReaders);
+    RUN_BENCH(br, BenchWorkbookRecalculation);
+    RUN_BENCH(br, BenchCheckpoints);
+    return 0;
+}
@@ -1,129 +1,453 @@
 #include "cell.h"
 #include "sheet.h"
+#include <algorithm>
 #include <string>
 #include <optional>
+#include <type_traits>
+#include <utility>
 
-Cell::Cell(Sheet& sheet) : impl_(std::make_unique<EmptyImpl>()), sheet_(sheet) {}
+// У новой ячейки нет аргументов, поэтому она может стоять в начале порядка.
+Cell::Cell(Sheet& sheet, Position pos)
+    : pos_(pos), order_(sheet.NewFrontOrder()) {}
 Cell::~Cell() = default;
 
-void Cell::Set(std::string text) {
-    std::unique_ptr<Impl> impl;
-    if (text.empty()) {
-        impl = std::make_unique<EmptyImpl>();
-    } else if (text.size() >= 2 && text[0] == FORMULA_SIGN) {
-        impl = std::make_unique<FormulaImpl>(std::move(text), sheet_);
+Cell::Draft Cell::MakeDraft(Sheet& sheet, Position pos, std::string text) {
+    Draft draft;
+    if (text.size() >= 2 && text[0] == FORMULA_SIGN) {
+        std::shared_ptr<const FormulaAST> ast;
+        try {
+            ast = sheet.GetFormulaTable().Intern(std::string_view(text).substr(1), pos);
+        } catch (...) {
+            throw FormulaException("Formula expected");
+        }
+        ast->GetDependencies(pos, draft.referenced_cells_, draft.referenced_ranges_);
+        draft.content_ = Formula{std::move(ast), &sheet};
+    } else if (!text.empty()) {
+        draft.content_ = std::move(text);
+    }
+    return draft;
+}
+
+Cell::Draft Cell::MakeTextDraft(std::string text, NumericValue number) {
+    Draft draft;
+    draft.content_ = std::move(text);
+    draft.value_ = number;
+    return draft;
+}
+
+Cell::Draft Cell::MakeFormulaDraft(Sheet& sheet, Position pos, std::shared_ptr<const FormulaAST> ast,
+                                   std::optional<FormulaInterface::Value> cache) {
+    Draft draft;
+    ast->ForEachRange(pos, [&draft](Range range) {
+        draft.referenced_ranges_.push_back(range);
+    });
+    // значение, прочитанное из других листов, могло устареть вместе с ними
+    if (ast->GetSheetCount() == 0) {
+        draft.value_ = std::move(cache);
+    }
+    draft.content_ = Formula{std::move(ast), &sheet};
+    return draft;
+}
+
+Cell::Draft Cell::MakeRestoreDraft(Sheet& sheet, Position pos, const ContentStore::Content* content) {
+    Draft draft;
+    if (content == nullptr) {
+        return draft;
+    }
+    if (content->formula != nullptr) {
+        content->formula->GetDependencies(pos, draft.referenced_cells_, draft.referenced_ranges_);
+        draft.content_ = Formula{content->formula, &sheet};
     } else {
-        impl= std::make_unique<TextImpl>(std::move(text));
+        draft.content_ = std::string(content->text->text);
+        draft.value_ = content->text->number;
     }
-    if (CheckCircularDependencies(*impl)) {
+    return draft;
+}
+
+const std::vector<Position>& Cell::Draft::GetReferencedCells() const {
+    return referenced_cells_;
+}
+
+const std::vector<Range>& Cell::Draft::GetReferencedRanges() const {
+    return referenced_ranges_;
+}
+
+const FormulaAST* Cell::Draft::GetFormulaAST() const {
+    const auto* formula = std::get_if<Formula>(&content_);
+    return formula != nullptr ? formula->ast.get() : nullptr;
+}
+
+void Cell::Set(Sheet& sheet, std::string text) {
+    Draft draft = MakeDraft(sheet, pos_, std::move(text));
+    if (CheckCircularDependencies(sheet, draft) || sheet.ClosesSheetCycle(pos_, draft.GetFormulaAST())) {
         throw CircularDependencyException("Circular dependency exception");
     }
+    Apply(sheet, std::move(draft));
+    CacheInvalidate(sheet, true);
+}
+
+void Cell::Apply(Sheet& sheet, Draft draft) {
     for (Cell* cell : used_cells_) {
-        cell->calculated_cells_.erase(this);
-    }
-    used_cells_.clear();
-    for (const auto& pos : impl_->GetReferencedCells()) {
-        Cell* used = sheet_.GetCell(pos);
-        if (!used){
-            sheet_.SetCell(pos, "");
-            used = sheet_.GetCell(pos);
+        cell->calculated_cells_.Erase(this);
+    }
+    used_cells_.Clear();
+    if (const FormulaAST* ast = GetFormulaAST()) {
+        ast->ForEachRange(pos_, [this, &sheet](Range range) {
+            sheet.RemoveRangeDependency(range, this);
+        });
+        ast->ForEachSheetReference(pos_, [this, &sheet](std::string_view name, Range range) {
+            sheet.RemoveSheetDependency(name, range, this);
+        });
+    }
+    for (const auto& pos : draft.referenced_cells_) {
+        Cell* used = &sheet.GetOrCreateCell(pos);
+        used_cells_.Insert(used);
+        used->calculated_cells_.Insert(this);
+    }
+    for (const Range range : draft.referenced_ranges_) {
+        sheet.AddRangeDependency(range, this);
+    }
+    if (const FormulaAST* ast = draft.GetFormulaAST()) {
+        ast->ForEachSheetReference(pos_, [this, &sheet](std::string_view name, Range range) {
+            sheet.AddSheetDependency(name, range, this);
+        });
+    }
+    // новый текст берётся из пула раньше, чем освобождается старый: если
+    // они равны, запись не удаляется и не создаётся заново
+    TextPool& texts = sheet.GetTexts();
+    const auto* new_text = std::get_if<std::string>(&draft.content_);
+    const TextPool::Entry* entry = new_text != nullptr ? texts.Intern(*new_text, draft.value_) : nullptr;
+    const auto* old_text = std::get_if<const TextPool::Entry*>(&content_);
+
+    // сводки диапазонов с этой ячейкой поправляются на разность, если оба
+    // значения уже известны, то есть ни старое, ни новое - не формула
+    const bool is_formula = std::holds_alternative<Formula>(draft.content_);
+    if (GetFormulaAST() == nullptr && !is_formula) {
+        auto range_number = [](const TextPool::Entry* text) -> std::optional<double> {
+            const double* number = text != nullptr ? std::get_if<double>(&text->number) : nullptr;
+            return number != nullptr ? std::optional(*number) : std::nullopt;
+        };
+        sheet.UpdateRangeSummaries(pos_, range_number(old_text != nullptr ? *old_text : nullptr), range_number(entry));
+    } else {
+        sheet.InvalidateRangeSummaries(pos_);
+    }
+    if (old_text != nullptr) {
+        texts.Release(*old_text);
+    }
+
+    ValueStore& values = sheet.GetValues();
+    if (is_formula) {
+        content_ = std::move(std::get<Formula>(draft.content_));
+        values.SetStale(pos_);
+        if (draft.value_) {
+            values.SetResult(pos_, *draft.value_);
+        }
+    } else if (entry != nullptr) {
+        content_ = entry;
+        values.SetText(pos_, entry->number);
+    } else {
+        content_ = std::monostate{};
+        values.SetEmpty(pos_);
+    }
+    sheet.RecordContent(*this);
+}
+
+void Cell::StoreContent(ContentStore& contents) const {
+    const auto* formula = std::get_if<Formula>(&content_);
+    const auto* text = std::get_if<const TextPool::Entry*>(&content_);
+    contents.Set(pos_, formula != nullptr ? formula->ast : nullptr, text != nullptr ? *text : nullptr);
+}
+
+void Cell::AddUsedCell(Cell* used) {
+    used_cells_.Insert(used);
+    used->calculated_cells_.Insert(this);
+}
+
+// Ячейку без зависимых можно поставить в конец порядка, тогда любая её
+// ссылка согласована с порядком. Иначе исправляется каждая ссылка на
+// ячейку, которая стоит позже этой.
+bool Cell::CheckCircularDependencies(Sheet& sheet, const Draft& draft) {
+    const auto& referenced_cells = draft.referenced_cells_;
+    const auto& referenced_ranges = draft.referenced_ranges_;
+    for (const auto& position : referenced_cells) {
+        if (sheet.GetCell(position) == this) {
+            return true;
+        }
+    }
+    for (const Range range : referenced_ranges) {
+        if (range.Contains(pos_)) {
+            return true;
+        }
+    }
+    if (!HasDependents(sheet)) {
+        if (!referenced_cells.empty() || !referenced_ranges.empty()) {
+            MoveToBack(sheet);
+        }
+        return false;
+    }
+    for (const auto& position : referenced_cells) {
+        Cell* source = sheet.GetCell(position);
+        if (source != nullptr && source->order_ > order_ && Reorder(sheet, source)) {
+            return true;
         }
-        used_cells_.insert(used);
-        used ->calculated_cells_.insert(this);
-    }
-    impl_ = std::move(impl);
-    CacheInvalidate();
-}
-
-bool Cell::CheckCircularDependencies(const Impl& new_impl) const {
-    const auto& referenced_cells = new_impl.GetReferencedCells();
-    if (!referenced_cells.empty()) {
-        std::set<const Cell*> calculated, used;
-        std::vector<const Cell*> progress;
-        for (const auto& position : referenced_cells) {
-            const Cell* ref_cell = sheet_.GetCell(position);
-            if (ref_cell) {
-                used.insert(ref_cell);
-            } else {
-                sheet_.SetCell(position, "");
-                used.insert(sheet_.GetCell(position));
+    }
+    // из диапазона проверяются только ячейки, которые уже есть: пустой
+    // позиции нечего вычислять
+    bool circular = false;
+    for (const Range range : referenced_ranges) {
+        sheet.ForEachCellIn(range, [this, &sheet, &circular](Cell* source) {
+            if (!circular && source->order_ > order_) {
+                circular = Reorder(sheet, source);
             }
+        });
+    }
+    return circular;
+}
+
+bool Cell::Reorder(Sheet& sheet, Cell* source) {
+    const std::int64_t lower = order_;
+    const std::int64_t upper = source->order_;
+    std::vector<Cell*> forward;
+    std::vector<Cell*> backward;
+    auto clear_marks = [&forward, &backward] {
+        for (Cell* cell : forward) {
+            cell->visited_ = false;
+        }
+        for (Cell* cell : backward) {
+            cell->visited_ = false;
         }
-        progress.push_back(this);
-        while (!progress.empty()) {
-            const auto current = progress.back();
-            if(current != nullptr){
-                calculated.insert(current);
-                for (const Cell* dependent : current->calculated_cells_) {
-                    if (calculated.find(dependent) == calculated.end()) {
-                        progress.push_back(dependent);
-                    } else {
-                        return true;
-                    }
-                } progress.pop_back();
+    };
+
+    // зависимые ячейки, которые стоят раньше source
+    visited_ = true;
+    forward.push_back(this);
+    bool circular = false;
+    for (size_t i = 0; i < forward.size() && !circular; ++i) {
+        sheet.ForEachDependent(*forward[i], [source, upper, &forward, &circular](Cell* dependent) {
+            if (dependent == source) {
+                circular = true;
+            } else if (!dependent->visited_ && dependent->order_ < upper) {
+                dependent->visited_ = true;
+                forward.push_back(dependent);
             }
+        });
+    }
+    if (circular) {
+        clear_marks();
+        return true;
+    }
+    // аргументы source, которые стоят позже этой ячейки
+    source->visited_ = true;
+    backward.push_back(source);
+    for (size_t i = 0; i < backward.size(); ++i) {
+        sheet.ForEachDependency(*backward[i], [lower, &backward](Cell* used) {
+            if (!used->visited_ && used->order_ > lower) {
+                used->visited_ = true;
+                backward.push_back(used);
+            }
+        });
+    }
+    clear_marks();
+
+    // те же ключи раздаются заново: сначала аргументам source, затем
+    // зависимым этой ячейки, внутри каждой группы порядок сохраняется
+    auto by_order = [](const Cell* lhs, const Cell* rhs) {
+        return lhs->order_ < rhs->order_;
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::vector<std::int64_t> orders;
+    orders.reserve(forward.size() + backward.size());
+    for (const Cell* cell : backward) {
+        orders.push_back(cell->order_);
+    }
+    for (const Cell* cell : forward) {
+        orders.push_back(cell->order_);
+    }
+    std::sort(orders.begin(), orders.end());
+    auto next = orders.begin();
+    for (Cell* cell : backward) {
+        cell->order_ = *next++;
+    }
+    for (Cell* cell : forward) {
+        cell->order_ = *next++;
+    }
+    return false;
+}
+
+void Cell::Calculate() const {
+    if (IsCalculated()) {
+        return;
+    }
+    // Обход в глубину по ссылкам формул: ячейка вычисляется, когда вычислены
+    // все её аргументы. Значение вычисленной ячейки записывается в хранилище
+    // значений листа, поэтому в ромбовидных зависимостях общие аргументы
+    // вычисляются один раз. Невычисленные аргументы кадра лежат в конце
+    // arguments, начиная с его first_argument. Аргументы с других листов
+    // книги обходятся в том же стеке, чтобы цепочка листов не вычислялась
+    // рекурсивно через их GetNumericValue.
+    struct Frame {
+        const Cell* cell;
+        size_t first_argument;
+    };
+    std::vector<Frame> stack;
+    std::vector<const Cell*> arguments;
+    auto push = [&stack, &arguments](const Cell* cell) {
+        stack.push_back({cell, arguments.size()});
+        auto add = [&arguments](const Cell* used) {
+            if (!used->IsCalculated()) {
+                arguments.push_back(used);
+            }
+        };
+        Sheet& owner = *std::get<Formula>(cell->content_).sheet;
+        owner.ForEachStaleDependency(*cell, add);
+        owner.ForEachStaleSheetDependency(*cell, add);
+    };
+    push(this);
+    while (!stack.empty()) {
+        const Frame frame = stack.back();
+        if (arguments.size() > frame.first_argument) {
+            const Cell* used = arguments.back();
+            arguments.pop_back();
+            if (!used->IsCalculated()) {
+                push(used);
+            }
+        } else {
+            const Cell& cell = *frame.cell;
+            const Formula& formula = std::get<Formula>(cell.content_);
+            formula.sheet->GetValues().SetResult(cell.pos_, cell.Evaluate(formula));
+            stack.pop_back();
         }
-    } return false;
+    }
 }
 
-void Cell::Clear() {
-    impl_ = std::make_unique<EmptyImpl>();
+Cell::NumericValue Cell::Evaluate(const Formula& formula) const {
+    try {
+        return formula.ast->Execute(*formula.sheet, pos_);
+    } catch (const FormulaError& error) {
+        return error;
+    }
 }
 
-Cell::Value Cell::GetValue() const {return impl_->GetValue();}
-std::string Cell::GetText() const {return impl_->GetText();}
-std::vector<Position> Cell::GetReferencedCells() const {return impl_->GetReferencedCells();}
+void Cell::Clear(Sheet& sheet) {
+    Set(sheet, "");
+}
 
-void Cell::CacheInvalidate(bool status) {
-    if (impl_->HasCache() || status) {
-        impl_->ResetCache();
+Position Cell::GetPosition() const {return pos_;}
+bool Cell::IsEmpty() const {return std::holds_alternative<std::monostate>(content_);}
+bool Cell::IsReferenced() const {return !calculated_cells_.Empty();}
+bool Cell::HasDependents(const Sheet& sheet) const {return IsReferenced() || sheet.IsInReferencedRange(pos_);}
+std::int64_t Cell::GetOrder() const {return order_;}
+const SmallPtrSet<Cell*>& Cell::GetUsedCells() const {return used_cells_;}
+const SmallPtrSet<Cell*>& Cell::GetCalculatedCells() const {return calculated_cells_;}
 
-        for (Cell* dependent : calculated_cells_) {
-            dependent->CacheInvalidate();
-        }
-    }
+bool Cell::IsCalculated() const {
+    const auto* formula = std::get_if<Formula>(&content_);
+    return formula == nullptr || !formula->sheet->GetValues().IsStale(pos_);
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-    return FORMULA_SIGN + formula_->GetExpression();
+const FormulaAST* Cell::GetFormulaAST() const {
+    const auto* formula = std::get_if<Formula>(&content_);
+    return formula != nullptr ? formula->ast.get() : nullptr;
 }
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+
+Cell::Value Cell::GetValue() const {
+    return std::visit([](const auto& value) {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, std::string_view>) {
+            return Value(std::string(value));
+        } else {
+            return Value(value);
+        }
+    }, GetValueView());
 }
-bool Cell::FormulaImpl::HasCache() {
-    return cache_.has_value();
+
+Cell::ValueView Cell::GetValueView() const {
+    if (const auto* text = std::get_if<const TextPool::Entry*>(&content_)) {
+        std::string_view value = (*text)->text;
+        if (value.front() == ESCAPE_SIGN) {
+            value.remove_prefix(1);
+        }
+        return value;
+    }
+    if (std::holds_alternative<Formula>(content_)) {
+        return std::visit([](const auto& value) {
+            return ValueView(value);
+        }, GetNumericValue());
+    }
+    return std::string_view();
 }
-void Cell::FormulaImpl::ResetCache() {
-    cache_.reset();
+
+std::string Cell::GetText() const {
+    std::string buffer;
+    const std::string_view text = GetTextView(buffer);
+    // текст формулы уже собран в buffer
+    return text.data() == buffer.data() ? std::move(buffer) : std::string(text);
+}
+
+std::string_view Cell::GetTextView(std::string& buffer) const {
+    if (const auto* text = std::get_if<const TextPool::Entry*>(&content_)) {
+        return (*text)->text;
+    }
+    if (const auto* formula = std::get_if<Formula>(&content_)) {
+        buffer.assign(1, FORMULA_SIGN);
+        formula->ast->PrintFormula(buffer, pos_);
+        return buffer;
+    }
+    return {};
 }
 
-void Cell::Impl::ResetCache() {}
-std::vector<Position> Cell::Impl::GetReferencedCells() const { return {};}
-bool Cell::Impl::HasCache() { return true;}
-Cell::Value Cell::EmptyImpl::GetValue() const { return "";}
-std::string Cell::EmptyImpl::GetText() const { return "";}
-Cell::TextImpl::TextImpl(std::string text) : text_(std::move(text)) {}
+std::vector<Position> Cell::GetReferencedCells() const {
+    std::vector<Position> cells;
+    if (const FormulaAST* ast = GetFormulaAST()) {
+        ast->GetReferencedCells(pos_, cells);
+    }
+    return cells;
+}
 
-Cell::Value Cell::TextImpl::GetValue() const {
-    if (text_.empty()) {
-        throw FormulaException("Text expected");
-    } else if (text_.at(0) == ESCAPE_SIGN) {
-        return text_.substr(1);
-    } else {
-        return text_;
+Cell::NumericValue Cell::GetNumericValue() const {
+    if (const auto* text = std::get_if<const TextPool::Entry*>(&content_)) {
+        return (*text)->number;
+    }
+    if (const auto* formula = std::get_if<Formula>(&content_)) {
+        Calculate();
+        return *formula->sheet->GetValues().Find(pos_);
     }
+    return 0.0;
 }
 
-std::string Cell::TextImpl::GetText() const { return text_;}
+void Cell::MoveToBack(Sheet& sheet) {
+    order_ = sheet.NewBackOrder();
+}
 
-Cell::FormulaImpl::FormulaImpl(const std::string& text, SheetInterface& sheet) : formula_(ParseFormula(text.substr(1)))
-        , sheet_(sheet) {}
+void Cell::SetOrder(std::int64_t order) {
+    order_ = order;
+}
 
-Cell::Value Cell::FormulaImpl::GetValue() const {
-    if (!cache_) {
-        cache_ = formula_->Evaluate(sheet_);
+void Cell::CacheInvalidate(Sheet& sheet, bool status) {
+    if (!IsCalculated() && !status) {
+        return;
+    }
+    if (GetFormulaAST() != nullptr) {
+        sheet.MarkStale(*this);
+    }
+    std::vector<std::pair<Sheet*, Cell*>> progress;
+    auto push_dependents = [&progress](Sheet& owner, const Cell& cell) {
+        owner.ForEachDependent(cell, [&progress, &owner](Cell* dependent) {
+            progress.emplace_back(&owner, dependent);
+        });
+        owner.ForEachSheetDependent(cell.pos_, [&progress](Sheet* dependent_sheet, Cell* dependent) {
+            progress.emplace_back(dependent_sheet, dependent);
+        });
+    };
+    push_dependents(sheet, *this);
+    while (!progress.empty()) {
+        const auto [owner, current] = progress.back();
+        progress.pop_back();
+        if (!current->IsCalculated()) {
+            continue;
+        }
+        owner->MarkStale(*current);
+        push_dependents(*owner, *current);
     }
-    return std::visit([](auto& helper){
-        return Value(helper);
-        }, *cache_);
 }
@@ -1,67 +1,147 @@
 #pragma once
 #include "common.h"
+#include "content_store.h"
 #include "formula.h"
-#include <functional>
-#include <unordered_set>
-#include <stack>
-#include <set>
+#include "small_ptr_set.h"
+#include "text_pool.h"
+#include <cstdint>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 class Sheet;
+// Ячейка листа. Содержимое - размеченное объединение: пусто, текст или
+// формула; текст лежит в пуле текстов листа. Связи по ссылкам хранятся в
+// маленьких множествах прямо в ячейке.
+// Ссылку на лист держит только формула, которой он нужен для вычисления;
+// методы, которые меняют лист, получают его аргументом.
 class Cell : public CellInterface {
+private:
+    // Формула ячейки: общее дерево со ссылками относительно ячейки и лист,
+    // по которому она вычисляется.
+    struct Formula {
+        std::shared_ptr<const FormulaAST> ast;
+        Sheet* sheet;
+    };
+    using Content = std::variant<std::monostate, const TextPool::Entry*, Formula>;
+
 public:
-    explicit Cell(Sheet& sheet);
+    // Разобранный текст ячейки, который ещё не записан в лист. Позволяет
+    // проверить правку целиком до того, как лист изменится.
+    class Draft {
+    public:
+        // Ячейки, на которые формула ссылается по одной, кроме тех, что
+        // лежат в её диапазонах.
+        [[nodiscard]] const std::vector<Position>& GetReferencedCells() const;
+        [[nodiscard]] const std::vector<Range>& GetReferencedRanges() const;
+        // Дерево формулы или nullptr, если черновик не формула.
+        [[nodiscard]] const FormulaAST* GetFormulaAST() const;
+    private:
+        friend class Cell;
+        std::variant<std::monostate, std::string, Formula> content_;
+        std::vector<Position> referenced_cells_;
+        std::vector<Range> referenced_ranges_;
+        // числовое прочтение текста или значение формулы из снимка, если
+        // оно было вычислено
+        std::optional<NumericValue> value_;
+    };
+
+    Cell(Sheet& sheet, Position pos);
     ~Cell() override;
 
-    void Set(std::string text);
-    void Clear();
+    // Разбирает текст для ячейки pos листа sheet. Бросает FormulaException,
+    // если формула некорректна; лист при этом не меняется.
+    static Draft MakeDraft(Sheet& sheet, Position pos, std::string text);
+    // Черновики для восстановления ячейки из снимка листа: текст с уже
+    // известным числовым прочтением и формула над готовым деревом со
+    // значением, если оно было вычислено. Ничего не разбирают; ссылки
+    // формулы на отдельные ячейки не заполняются, их связывает AddUsedCell.
+    static Draft MakeTextDraft(std::string text, NumericValue number);
+    static Draft MakeFormulaDraft(Sheet& sheet, Position pos, std::shared_ptr<const FormulaAST> ast,
+                                  std::optional<FormulaInterface::Value> cache);
+    // Черновик содержимого точки сохранения листа: формула над готовым
+    // деревом со всеми ссылками, как у MakeDraft, или текст; nullptr -
+    // пустая ячейка. Ничего не разбирает.
+    static Draft MakeRestoreDraft(Sheet& sheet, Position pos, const ContentStore::Content* content);
+    void Set(Sheet& sheet, std::string text);
+    // Записывает черновик и его значение в хранилище значений листа и
+    // связывает ячейку с её аргументами, создавая недостающие, и с
+    // диапазонами в индексе листа. Не проверяет циклы и не сбрасывает кэш
+    // зависимых: это делает вызывающий.
+    void Apply(Sheet& sheet, Draft draft);
+    // Записывает содержимое ячейки в contents.
+    void StoreContent(ContentStore& contents) const;
+    // Связывает формулу этой ячейки с ячейкой used, на которую она ссылается.
+    void AddUsedCell(Cell* used);
+    void Clear(Sheet& sheet);
+    [[nodiscard]] Position GetPosition() const;
+    [[nodiscard]] bool IsEmpty() const;
+    // Есть ли формулы, которые ссылаются на эту ячейку по отдельности.
+    // Ссылки диапазонами ячейку в листе не держат.
+    [[nodiscard]] bool IsReferenced() const;
+    // Ложно только для формулы, значение которой устарело.
+    [[nodiscard]] bool IsCalculated() const;
+    // Дерево формулы ячейки или nullptr, если в ячейке не формула.
+    [[nodiscard]] const FormulaAST* GetFormulaAST() const;
+    // Ключ ячейки в топологическом порядке листа.
+    [[nodiscard]] std::int64_t GetOrder() const;
+    // Ячейки, на которые формула этой ячейки ссылается по отдельности.
+    // Связи через диапазоны хранит лист, см. Sheet::ForEachDependency.
+    [[nodiscard]] const SmallPtrSet<Cell*>& GetUsedCells() const;
+    // Ячейки с формулами, которые ссылаются на эту ячейку по отдельности.
+    [[nodiscard]] const SmallPtrSet<Cell*>& GetCalculatedCells() const;
 
     [[nodiscard]] Value GetValue() const override;
     [[nodiscard]] std::string GetText() const override;
     [[nodiscard]] std::vector<Position> GetReferencedCells() const override;
-    void CacheInvalidate(bool status = false);
-private:
-    class Impl {
-    public:
-        [[nodiscard]] virtual Value GetValue() const = 0;
-        [[nodiscard]] virtual std::string GetText() const = 0;
-        [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const;
-        virtual bool HasCache();
-        virtual void ResetCache();
-        virtual ~Impl() = default;
-    };
-    [[nodiscard]] bool CheckCircularDependencies(const Impl& new_impl) const;
-    class EmptyImpl : public Impl {
-    public:
-        [[nodiscard]] Value GetValue() const override;
-        [[nodiscard]] std::string GetText() const override;
-    };
-
-    class TextImpl : public Impl {
-    public:
-        explicit TextImpl(std::string text);
-        [[nodiscard]] Value GetValue() const override;
-        [[nodiscard]] std::string GetText() const override;
-    private:
-        std::string text_;
-    };
+    [[nodiscard]] NumericValue GetNumericValue() const override;
 
-    class FormulaImpl : public Impl {
-    public:
-        explicit FormulaImpl(const std::string& text, SheetInterface& sheet);
-        Value GetValue() const override;
-        std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
-        bool HasCache() override;
-        void ResetCache() override;
-    private:
-        mutable std::optional<FormulaInterface::Value> cache_;
-        std::unique_ptr<FormulaInterface> formula_;
-        SheetInterface& sheet_;
-    };
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+    // То же, что GetValue, но текст не копируется: представление указывает
+    // в пул текстов листа и действительно, пока лист не изменится.
+    [[nodiscard]] ValueView GetValueView() const;
+    // То же, что GetText, без копирования текста ячейки. Текст формулы
+    // собирается заново в buffer, и представление указывает на него.
+    [[nodiscard]] std::string_view GetTextView(std::string& buffer) const;
+    // Сбрасывает кэш ячейки и всех зависящих от неё формул, в том числе
+    // формул других листов книги. Обход идёт по явному стеку и не заходит
+    // в ячейки, кэш которых уже сброшен: у такой ячейки устаревшими уже
+    // помечены и все зависимые.
+    void CacheInvalidate(Sheet& sheet, bool status = false);
+    // Задаёт ключ ячейки в топологическом порядке. Вызывающий отвечает за
+    // то, что порядок остаётся согласованным со ссылками.
+    void SetOrder(std::int64_t order);
+private:
+    // Ставит ячейку в конец топологического порядка.
+    void MoveToBack(Sheet& sheet);
+    // Есть ли формулы, которые ссылаются на эту ячейку как угодно.
+    [[nodiscard]] bool HasDependents(const Sheet& sheet) const;
+    // Проверяет, замкнут ли цикл ссылки новой формулы. Если цикла нет,
+    // переставляет ячейки в топологическом порядке так, чтобы каждая
+    // ячейка, на которую ссылается черновик, стояла раньше этой.
+    [[nodiscard]] bool CheckCircularDependencies(Sheet& sheet, const Draft& draft);
+    // Восстанавливает порядок для новой ссылки source -> this, где source
+    // сейчас позже этой ячейки (алгоритм Пирса-Келли). Просматриваются
+    // только ячейки между ними в порядке. Возвращает true, если source
+    // зависит от этой ячейки, то есть ссылка замкнёт цикл.
+    [[nodiscard]] bool Reorder(Sheet& sheet, Cell* source);
+    // Вычисляет устаревшие формулы, от которых зависит ячейка, в том числе
+    // на других листах книги, и её саму в топологическом порядке. Глубина
+    // стека вызовов не зависит от длины цепочек.
+    void Calculate() const;
+    // Вычисляет формулу ячейки заново, не читая и не записывая её значение.
+    [[nodiscard]] NumericValue Evaluate(const Formula& formula) const;
 
-    std::unique_ptr<Impl> impl_;
-    Sheet& sheet_;
-    std::set<Cell*> calculated_cells_;
-    std::set<Cell*> used_cells_;
+    Content content_;
+    Position pos_;
+    // метка обхода в Reorder, вне его всегда false
+    bool visited_ = false;
+    // Ключ в топологическом порядке листа: у ячейки, на которую ссылается
+    // формула, он меньше, чем у ячейки с формулой. Ключи уникальны.
+    std::int64_t order_;
+    SmallPtrSet<Cell*> calculated_cells_;
+    SmallPtrSet<Cell*> used_cells_;
 };
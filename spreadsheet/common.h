@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -33,6 +35,27 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек first:last, обе границы входят в него.
+// У нормализованного диапазона first не правее и не ниже last.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+
+    [[nodiscard]] bool Contains(Position pos) const;
+};
+
+// Числа диапазона так, как их видят функции формул: сумма, количество,
+// наименьшее и наибольшее. У пустого набора min и max - бесконечности
+// с противоположными знаками.
+struct RangeSummary {
+    double sum = 0;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::size_t count = 0;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -92,8 +115,14 @@ public:
     [[nodiscard]] virtual std::string GetText() const = 0;
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
+    // ячеек. В случае текстовой ячейки список пуст. Ячейки других листов в
+    // список не входят.
     [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    using NumericValue = std::variant<double, FormulaError>;
+    // Возвращает значение ячейки так, как его видит формула: число либо ошибку.
+    // Пустой текст - это ноль, текст, не представляющий число, - ошибка #VALUE!.
+    [[nodiscard]] virtual NumericValue GetNumericValue() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -122,6 +151,26 @@ public:
     [[nodiscard]] virtual Size GetPrintableSize() const = 0;
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+    // Значение ячейки pos так, как его видит ссылка формулы: пустая и
+    // отсутствующая ячейка - ноль. Реализация по умолчанию читает ячейку
+    // через GetCell.
+    [[nodiscard]] virtual CellInterface::NumericValue GetNumericValue(Position pos) const;
+    // Дописывает в values числа нормализованного диапазона range так, как
+    // их видят функции формул (SUM, MIN, ...), пропуская пустые ячейки и
+    // текст, который не представляет число. Порядок чисел выбирает лист,
+    // реализация по умолчанию перебирает ячейки через GetCell построчно.
+    // Если в диапазоне есть формула с ошибкой, бросает эту FormulaError.
+    virtual void GetNumericValues(Range range, std::vector<double>& values) const;
+    // Сводка чисел того же диапазона; min и max заполняются, только если
+    // with_extrema. Лист может хранить сводки между вызовами и обновлять
+    // их при правках ячеек. Реализация по умолчанию читает числа через
+    // GetNumericValues.
+    [[nodiscard]] virtual RangeSummary GetRangeSummary(Range range, bool with_extrema) const;
+    // Лист с именем name, на ячейки которого формулы этого листа ссылаются
+    // как name!A1, или nullptr, если такого листа нет; тогда ссылка -
+    // ошибка #REF!. Отдельный лист других листов не знает, реализация по
+    // умолчанию возвращает nullptr.
+    [[nodiscard]] virtual const SheetInterface* FindSheet(std::string_view name) const;
 };
 
 std::unique_ptr<SheetInterface> CreateSheet();
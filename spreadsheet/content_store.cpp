@@ -0,0 +1,80 @@
+#include "content_store.h"
+#include "FormulaAST.h"
+#include <utility>
+
+ContentStore::ContentStore(TextPool& texts)
+    : texts_(&texts) {}
+ContentStore::ContentStore(const ContentStore& other) = default;
+ContentStore::~ContentStore() = default;
+
+ContentStore::Tile::Tile(TextPool& texts)
+    : texts(&texts) {}
+
+ContentStore::Tile::Tile(const Tile& other)
+    : texts(other.texts), slots(other.slots), count(other.count) {
+    for (const Content& content : slots) {
+        if (content.text != nullptr) {
+            texts->Retain(content.text);
+        }
+    }
+}
+
+ContentStore::Tile::~Tile() {
+    for (const Content& content : slots) {
+        if (content.text != nullptr) {
+            texts->Release(content.text);
+        }
+    }
+}
+
+void ContentStore::Set(Position pos, std::shared_ptr<const FormulaAST> formula, const TextPool::Entry* text) {
+    if (formula == nullptr && text == nullptr && Find(pos) == nullptr) {
+        return;
+    }
+    Tile& tile = GetOwnTile(pos);
+    Content& content = tile.slots[(pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS];
+    const bool was_empty = content.IsEmpty();
+    // новая запись берётся раньше, чем отпускается старая: если они
+    // равны, текст не пропадает из пула
+    if (text != nullptr) {
+        texts_->Retain(text);
+    }
+    if (content.text != nullptr) {
+        texts_->Release(content.text);
+    }
+    content.formula = std::move(formula);
+    content.text = text;
+    if (was_empty && !content.IsEmpty()) {
+        ++tile.count;
+    } else if (!was_empty && content.IsEmpty() && --tile.count == 0) {
+        tiles_[pos.row / TILE_ROWS][pos.col / TILE_COLS].reset();
+    }
+}
+
+const ContentStore::Content* ContentStore::Find(Position pos) const {
+    const Tile* tile = FindTile(pos.row / TILE_ROWS, pos.col / TILE_COLS);
+    if (tile == nullptr) {
+        return nullptr;
+    }
+    const Content& content = tile->slots[(pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS];
+    return content.IsEmpty() ? nullptr : &content;
+}
+
+ContentStore::Tile& ContentStore::GetOwnTile(Position pos) {
+    const size_t tile_row = pos.row / TILE_ROWS;
+    const size_t tile_col = pos.col / TILE_COLS;
+    if (tile_row >= tiles_.size()) {
+        tiles_.resize(tile_row + 1);
+    }
+    auto& row_tiles = tiles_[tile_row];
+    if (tile_col >= row_tiles.size()) {
+        row_tiles.resize(tile_col + 1);
+    }
+    auto& tile = row_tiles[tile_col];
+    if (!tile) {
+        tile = std::make_shared<Tile>(*texts_);
+    } else if (tile.use_count() > 1) {
+        tile = std::make_shared<Tile>(*tile);
+    }
+    return *tile;
+}
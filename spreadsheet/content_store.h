@@ -0,0 +1,109 @@
+#pragma once
+#include "common.h"
+#include "text_pool.h"
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+class FormulaAST;
+
+// Содержимое ячеек листа для точек сохранения: дерево формулы или запись
+// пула текстов по позиции. Лист разбит на плитки по 64 строки и 16
+// столбцов, как у хранилища значений. Копия хранилища делит плитки с
+// оригиналом; плитка копируется, когда одну из её общих копий меняют,
+// поэтому копия стоит таблицу плиток, а правка после неё - одну плитку.
+// Каждая копия записи текста держит ссылку в пуле, из которого текст
+// взят. Все копии используются тем же потоком, что и правки листа, и
+// должны быть разрушены раньше его пула текстов.
+class ContentStore {
+public:
+    struct Content {
+        std::shared_ptr<const FormulaAST> formula;
+        const TextPool::Entry* text = nullptr;
+
+        [[nodiscard]] bool IsEmpty() const {
+            return formula == nullptr && text == nullptr;
+        }
+        bool operator==(const Content& other) const {
+            return formula == other.formula && text == other.text;
+        }
+    };
+
+    explicit ContentStore(TextPool& texts);
+    // Копирует только таблицу плиток.
+    ContentStore(const ContentStore& other);
+    ContentStore& operator=(const ContentStore&) = delete;
+    ~ContentStore();
+
+    // Записывает содержимое pos: формулу, текст или пустоту, если оба
+    // аргумента пусты. Текст должен быть из пула этого хранилища.
+    void Set(Position pos, std::shared_ptr<const FormulaAST> formula, const TextPool::Entry* text);
+    // Содержимое pos или nullptr, если позиция пуста.
+    [[nodiscard]] const Content* Find(Position pos) const;
+
+    // Вызывает func(pos, target) для каждой позиции, содержимое которой в
+    // этом хранилище и в other различается; target - содержимое other или
+    // nullptr, если там пусто. Плитки, общие у обоих хранилищ, не
+    // просматриваются.
+    template <typename Func>
+    void ForEachDifference(const ContentStore& other, Func func) const {
+        const size_t tile_rows = std::max(tiles_.size(), other.tiles_.size());
+        for (size_t tile_row = 0; tile_row < tile_rows; ++tile_row) {
+            const size_t tile_cols = std::max(GetRowSize(tile_row), other.GetRowSize(tile_row));
+            for (size_t tile_col = 0; tile_col < tile_cols; ++tile_col) {
+                const Tile* mine = FindTile(tile_row, tile_col);
+                const Tile* theirs = other.FindTile(tile_row, tile_col);
+                if (mine == theirs) {
+                    continue;
+                }
+                for (int slot = 0; slot < TILE_ROWS * TILE_COLS; ++slot) {
+                    const Content* current = mine != nullptr ? &mine->slots[slot] : nullptr;
+                    const Content* target = theirs != nullptr ? &theirs->slots[slot] : nullptr;
+                    const bool current_empty = current == nullptr || current->IsEmpty();
+                    const bool target_empty = target == nullptr || target->IsEmpty();
+                    if (current_empty && target_empty) {
+                        continue;
+                    }
+                    if (current_empty || target_empty || !(*current == *target)) {
+                        func(Position{static_cast<int>(tile_row) * TILE_ROWS + slot / TILE_COLS,
+                                      static_cast<int>(tile_col) * TILE_COLS + slot % TILE_COLS},
+                             target_empty ? nullptr : target);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr int TILE_ROWS = 64;
+    static constexpr int TILE_COLS = 16;
+    static_assert(Position::MAX_ROWS % TILE_ROWS == 0 && Position::MAX_COLS % TILE_COLS == 0);
+
+    // Плитка держит по ссылке на каждую свою запись текста и отпускает
+    // их, когда разрушается последняя её копия.
+    struct Tile {
+        explicit Tile(TextPool& texts);
+        Tile(const Tile& other);
+        Tile& operator=(const Tile&) = delete;
+        ~Tile();
+
+        TextPool* texts;
+        std::array<Content, TILE_ROWS * TILE_COLS> slots;
+        // непустых позиций плитки
+        int count = 0;
+    };
+
+    [[nodiscard]] size_t GetRowSize(size_t tile_row) const {
+        return tile_row < tiles_.size() ? tiles_[tile_row].size() : 0;
+    }
+    [[nodiscard]] const Tile* FindTile(size_t tile_row, size_t tile_col) const {
+        return tile_col < GetRowSize(tile_row) ? tiles_[tile_row][tile_col].get() : nullptr;
+    }
+    // Плитка pos, которая есть только у этого хранилища: недостающая
+    // создаётся, общая с копиями - копируется.
+    Tile& GetOwnTile(Position pos);
+
+    TextPool* texts_;
+    std::vector<std::vector<std::shared_ptr<Tile>>> tiles_;
+};
@@ -1,81 +1,112 @@
 #include "formula.h"
 #include "FormulaAST.h"
-#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <ostream>
+#include <utility>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
     class Formula : public FormulaInterface {
     public:
-        explicit Formula(const std::string& expression) try : ast_(ParseFormulaAST(expression)) {}
+        explicit Formula(const std::string& expression) try
+            : ast_(std::make_shared<const FormulaAST>(ParseFormulaAST(expression))), origin_{0, 0} {}
         catch (...) {
             throw FormulaException("Formula expected");
         }
 
+        Formula(const std::string& expression, Position anchor, FormulaTable& formulas) try
+            : ast_(formulas.Intern(expression, anchor)), origin_(anchor) {}
+        catch (...) {
+            throw FormulaException("Formula expected");
+        }
+
+        Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+            : ast_(std::move(ast)), origin_(anchor) {}
+
         [[nodiscard]] Value Evaluate(const SheetInterface& sheet) const override{
             try {
-                std::function<double(Position)> params = [&sheet](const Position pos)->double{
-                    if (pos.IsValid()) {
-                        double zero = 0.0;
-                        const auto* cell = sheet.GetCell(pos);
-                        if (cell) {
-                            const auto& cell_value = cell->GetValue();
-                            if (std::holds_alternative<double>(cell_value)) {
-                                return std::get<double>(cell_value);
-                            } else if (std::holds_alternative<std::string>(cell_value)) {
-                                const auto& text = std::get<std::string>(cell_value);
-                                if (!text.empty()) {
-                                    std::istringstream input(text);
-                                    if (input >> zero && input.eof()) {
-                                        return zero;
-                                    } else {
-                                        throw FormulaError(FormulaError::Category::Value);
-                                    }
-                                } else {
-                                    return zero;
-                                }
-                            } else {
-                                throw FormulaError(std::get<FormulaError>(cell_value));
-                            }
-                        } else {
-                            return zero;
-                        }
-                    } else {
-                        throw FormulaError(FormulaError::Category::Ref);
-                    }
-                };
-                return ast_.Execute(params);
+                return ast_->Execute(sheet, origin_);
             } catch (const FormulaError& er) {
                 return er;
             }
         }
 
         [[nodiscard]] std::string GetExpression() const override {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-            return out.str();
+            std::string expression;
+            ast_->PrintFormula(expression, origin_);
+            return expression;
         }
 
         [[nodiscard]] std::vector<Position> GetReferencedCells() const override {
             std::vector<Position> cells;
-            for (const auto& cell : ast_.GetCells()) {
-                if (cell.IsValid()) {
-                    cells.push_back(cell);
-                } else {
-                    continue;
-                }
-            }
+            ast_->GetReferencedCells(origin_, cells);
             return cells;
         }
+
+        [[nodiscard]] const FormulaAST& GetAST() const override {
+            return *ast_;
+        }
     private:
-        FormulaAST ast_;
+        std::shared_ptr<const FormulaAST> ast_;
+        Position origin_;
     };
 }// namespace
 
+std::shared_ptr<const FormulaAST> FormulaTable::Intern(std::string_view expression, Position anchor) {
+    // без ключа формула не разберётся, но сообщение об ошибке даст парсер
+    const bool shared = MakeRelativeKey(expression, anchor, key_);
+    if (shared) {
+        if (const auto it = formulas_.find(key_); it != formulas_.end()) {
+            if (auto ast = it->second.lock()) {
+                return ast;
+            }
+        }
+    }
+    ++parse_count_;
+    auto ast = std::make_shared<FormulaAST>(ParseFormulaAST(expression, ParserBackend::Native));
+    ast->Rebase(anchor);
+    if (!shared) {
+        return ast;
+    }
+    formulas_[key_] = ast;
+    if (formulas_.size() >= sweep_size_) {
+        for (auto it = formulas_.begin(); it != formulas_.end();) {
+            it = it->second.expired() ? formulas_.erase(it) : std::next(it);
+        }
+        sweep_size_ = std::max(sweep_size_, formulas_.size() * 2);
+    }
+    return ast;
+}
+
+size_t FormulaTable::GetFormulaCount() const {
+    return std::count_if(formulas_.begin(), formulas_.end(), [](const auto& entry) {
+        return !entry.second.expired();
+    });
+}
+
+size_t FormulaTable::GetParseCount() const {
+    return parse_count_;
+}
+
+void FormulaTable::Insert(std::string key, std::shared_ptr<const FormulaAST> ast) {
+    formulas_[std::move(key)] = std::move(ast);
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(const std::string& expression) {
     return std::make_unique<Formula>(expression);
 }
+
+std::unique_ptr<FormulaInterface> ParseFormula(const std::string& expression, Position anchor,
+                                               FormulaTable& formulas) {
+    return std::make_unique<Formula>(expression, anchor, formulas);
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position anchor) {
+    return std::make_unique<Formula>(std::move(ast), anchor);
+}
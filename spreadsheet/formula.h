@@ -1,6 +1,8 @@
 #pragma once
 #include "common.h"
 #include <memory>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include "FormulaAST.h"
 
@@ -8,6 +10,11 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, AVERAGE, MIN, MAX и COUNT от чисел, выражений и диапазонов
+//   ячеек: SUM(A1:B10,C1*2). В диапазоне учитываются только числа, пустые
+//   ячейки и текст, который не представляет число, пропускаются.
+// * Ссылки на ячейки и диапазоны других листов книги: Sheet2!A1,
+//   SUM(Sheet2!A1:B10). Лист по имени ищет SheetInterface::FindSheet.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -27,9 +34,56 @@ public:
     [[nodiscard]] virtual std::string GetExpression() const = 0;
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки других листов в список не входят.
     [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Разобранное дерево формулы. Ссылки в нём заданы относительно ячейки,
+    // для которой формула создана.
+    [[nodiscard]] virtual const FormulaAST& GetAST() const = 0;
 };
+
+// Таблица скомпилированных формул листа. Формулы хранятся в относительном
+// виде, поэтому копии одной формулы, протянутые по столбцу или строке
+// (=A1*B1 в C1, =A2*B2 в C2, ...), разбираются один раз и делят одно
+// дерево. Таблица не владеет деревьями: дерево живёт, пока на него
+// ссылается хотя бы одна формула.
+class FormulaTable {
+public:
+    // Возвращает дерево формулы, записанной в ячейке anchor, с ссылками
+    // относительно anchor. Бросает то же, что и ParseFormulaAST.
+    std::shared_ptr<const FormulaAST> Intern(std::string_view expression, Position anchor);
+    // Число различных формул, на которые сейчас кто-то ссылается.
+    [[nodiscard]] size_t GetFormulaCount() const;
+    // Сколько раз за всё время формулы разбирались парсером.
+    [[nodiscard]] size_t GetParseCount() const;
+    // Кладёт в таблицу готовое дерево под ключом, который для него вернула
+    // бы MakeRelativeKey. Нужно, чтобы формулы, загруженные без разбора,
+    // делились с формулами, которые будут заданы потом.
+    void Insert(std::string key, std::shared_ptr<const FormulaAST> ast);
+    // Вызывает func(key, ast) для каждого дерева, которое ещё живо.
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const auto& [key, weak_ast] : formulas_) {
+            if (const auto ast = weak_ast.lock()) {
+                func(std::string_view(key), ast);
+            }
+        }
+    }
+private:
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> formulas_;
+    // буфер ключа, чтобы не выделять память на каждый поиск
+    std::string key_;
+    size_t parse_count_ = 0;
+    // при таком размере таблица вычищается от умерших деревьев
+    size_t sweep_size_ = 1024;
+};
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(const std::string& expression);
+// То же для формулы ячейки anchor: разобранное дерево берётся из таблицы
+// formulas и делится с другими копиями этой формулы.
+std::unique_ptr<FormulaInterface> ParseFormula(const std::string& expression, Position anchor,
+                                               FormulaTable& formulas);
+// Формула ячейки anchor над готовым деревом, ссылки которого заданы
+// относительно anchor. Ничего не разбирает.
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position anchor);
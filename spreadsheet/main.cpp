@@ -1,7 +1,25 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#if defined(__unix__)
+#include <pthread.h>
+#endif
 #include "common.h"
 #include "formula.h"
+#include "published.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "tiled_storage.h"
+#include "tsv_import.h"
+#include "workbook.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -26,6 +44,32 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
 
 namespace {
 
+    // Выполняет func в отдельном потоке со стеком stack_size байт, чтобы
+    // глубокая рекурсия падала и на небольших входных данных. Без потоков
+    // POSIX выполняет func в текущем потоке.
+    template <typename Func>
+    void RunWithStack(size_t stack_size, Func func) {
+#if defined(__unix__)
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setstacksize(&attributes, stack_size);
+        pthread_t thread;
+        auto run = [](void* argument) -> void* {
+            (*static_cast<Func*>(argument))();
+            return nullptr;
+        };
+        if (pthread_create(&thread, &attributes, run, &func) == 0) {
+            pthread_join(thread, nullptr);
+        } else {
+            func();
+        }
+        pthread_attr_destroy(&attributes);
+#else
+        (void)stack_size;
+        func();
+#endif
+    }
+
     void TestPositionAndStringConversion() {
         auto testSingle = [](Position pos, std::string_view str) {
             ASSERT_EQUAL(pos.ToString(), str);
@@ -95,6 +139,78 @@ namespace {
         }
     }
 
+    void TestTiledStorage() {
+        using Entries = std::vector<std::string>;
+        auto collect = [](const TiledStorage<int>& storage, Position first, Position last) {
+            Entries entries;
+            storage.ForEachIn(first, last, [&entries](Position pos, int value) {
+                entries.push_back(pos.ToString() + "=" + std::to_string(value));
+            });
+            return entries;
+        };
+        const Position first{0, 0};
+        const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+        // плитка - 16 строк на 64 столбца: четыре позиции у стыка плиток
+        // лежат в четырёх разных плитках
+        TiledStorage<int> storage;
+        storage.Emplace(Position{16, 64}, 4);
+        storage.Emplace(Position{15, 63}, 1);
+        storage.Emplace(Position{16, 63}, 3);
+        storage.Emplace(Position{15, 64}, 2);
+        ASSERT_EQUAL(storage.Emplace(Position{15, 63}, 100), 1);
+        ASSERT_EQUAL(storage.Size(), 4u);
+        ASSERT_EQUAL(collect(storage, first, last),
+                     (Entries{"BL16=1", "BM16=2", "BL17=3", "BM17=4"}));
+        ASSERT_EQUAL(collect(storage, Position{15, 64}, Position{16, 127}),
+                     (Entries{"BM16=2", "BM17=4"}));
+        ASSERT(storage.Find(Position{15, 62}) == nullptr);
+        ASSERT(storage.Find(Position{17, 64}) == nullptr);
+
+        // удаление не задевает соседние плитки, повторное ничего не делает
+        ASSERT(storage.Erase(Position{16, 63}));
+        ASSERT(!storage.Erase(Position{16, 63}));
+        ASSERT(!storage.Erase(Position{16, 62}));
+        ASSERT_EQUAL(storage.Size(), 3u);
+        ASSERT(storage.Find(Position{16, 63}) == nullptr);
+        ASSERT_EQUAL(*storage.Find(Position{15, 63}), 1);
+        ASSERT_EQUAL(*storage.Find(Position{16, 64}), 4);
+
+        // опустевшая плитка освобождается и создаётся заново
+        storage.Emplace(Position{0, 0}, 5);
+        storage.Emplace(Position{0, 1}, 6);
+        ASSERT_EQUAL(storage.Size(), 5u);
+        ASSERT(storage.Erase(Position{15, 63}));
+        ASSERT(storage.Erase(Position{0, 0}));
+        ASSERT_EQUAL(storage.Size(), 3u);
+        ASSERT(storage.Erase(Position{0, 1}));
+        ASSERT_EQUAL(storage.Size(), 2u);
+        ASSERT(storage.Find(Position{0, 1}) == nullptr);
+        storage.Emplace(Position{0, 1}, 7);
+        ASSERT_EQUAL(storage.Size(), 3u);
+        ASSERT_EQUAL(collect(storage, first, last),
+                     (Entries{"B1=7", "BM16=2", "BM17=4"}));
+        for (const Position pos : {Position{0, 1}, Position{15, 64}, Position{16, 64}}) {
+            ASSERT(storage.Erase(pos));
+        }
+        ASSERT(storage.Empty());
+        ASSERT(collect(storage, first, last).empty());
+
+        // дальний край таблицы
+        storage.Emplace(last, 8);
+        storage.Emplace(Position{Position::MAX_ROWS - 1, 0}, 9);
+        storage.Emplace(Position{0, Position::MAX_COLS - 1}, 10);
+        ASSERT_EQUAL(storage.Size(), 3u);
+        ASSERT_EQUAL(*storage.Find(last), 8);
+        ASSERT_EQUAL(collect(storage, Position{Position::MAX_ROWS - 16, Position::MAX_COLS - 64}, last),
+                     (Entries{"XFD16384=8"}));
+        ASSERT_EQUAL(collect(storage, first, last),
+                     (Entries{"XFD1=10", "A16384=9", "XFD16384=8"}));
+        ASSERT(storage.Erase(last));
+        ASSERT(storage.Find(last) == nullptr);
+        ASSERT_EQUAL(storage.Size(), 2u);
+    }
+
     void TestSetCellPlainText() {
         auto sheet = CreateSheet();
 
@@ -146,6 +262,38 @@ namespace {
         ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
     }
 
+    void TestFormulaBytecodeMatchesTree() {
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 5; ++row) {
+            for (int col = 0; col < 5; ++col) {
+                sheet->SetCell(Position{row, col}, std::to_string(row * 10 + col));
+            }
+        }
+        auto execute = [&](const FormulaAST& ast, bool compiled) -> CellInterface::Value {
+            try {
+                return compiled ? ast.Execute(*sheet) : ast.ExecuteTree(*sheet);
+            } catch (const FormulaError& error) {
+                return error;
+            }
+        };
+
+        for (std::string expr : {"1", "-A1", "+-+B2", "A1-B2-C3", "A1/(B2/C3)", "-(A2+B3)*C4",
+                                 "(A1+B2)*C3-4/(D4+1)+-E5*2.5", "1/A1", "B1/(A2-B1-9)",
+                                 "1e200*1e200", "((((((((1+A2)*2)-B3)/4)+C4)*5)-D5)/6)", "Z9+1",
+                                 "SUM(A1:E5)", "AVERAGE(A1:C3,1,D4)*2", "MIN(A1:E5)-MAX(B2,C3:D4)",
+                                 "COUNT(A1:Z9)", "SUM(SUM(A1:B2),-MAX(A1:A5)/2)", "AVERAGE(F1:F9)"}) {
+            const FormulaAST ast = ParseFormulaAST(expr);
+            ASSERT_EQUAL(execute(ast, true), execute(ast, false));
+        }
+
+        std::string deep = "1";
+        for (int i = 0; i < 200; ++i) {
+            deep = "A2-(" + deep + ")";
+        }
+        const FormulaAST deep_ast = ParseFormulaAST(deep);
+        ASSERT_EQUAL(execute(deep_ast, true), execute(deep_ast, false));
+    }
+
     void TestFormulaReferences() {
         auto sheet = CreateSheet();
         auto evaluate = [&](std::string expr) {
@@ -191,6 +339,73 @@ namespace {
         ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
     }
 
+    void TestFormulaFunctions() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](std::string expr) {
+            return std::visit([](auto value) {
+                return CellInterface::Value(value);
+            }, ParseFormula(std::move(expr))->Evaluate(*sheet));
+        };
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1*4");
+        sheet->SetCell("B1"_pos, "2.5");
+        sheet->SetCell("B2"_pos, "text");
+        sheet->SetCell("C1"_pos, "'7");
+        ASSERT_EQUAL(evaluate("SUM(A1:B2)"), CellInterface::Value(7.5));
+        ASSERT_EQUAL(evaluate("SUM(B2:A1)"), CellInterface::Value(7.5));
+        ASSERT_EQUAL(evaluate("COUNT(A1:D9)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(evaluate("AVERAGE(A1:B2, 0.5)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(evaluate("MIN(A1:B2)*MAX(A1:B2,-1)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(evaluate("SUM(SUM(A1:A2),A1+1,B2)"), CellInterface::Value(7.0));
+        // пустые диапазоны
+        ASSERT_EQUAL(evaluate("SUM(D1:D9)+MIN(D1:D9)+MAX(D1:D9)+COUNT(D1:D9)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(evaluate("AVERAGE(D1:D9)"), CellInterface::Value(FormulaError::Category::Div0));
+        // ошибки в диапазоне и в аргументах не пропускаются
+        sheet->SetCell("D5"_pos, "=1/0");
+        ASSERT_EQUAL(evaluate("COUNT(D1:D9)"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(evaluate("MAX(1,B2+1)"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(evaluate("MIN(1e200*1e200,1)"), CellInterface::Value(FormulaError::Category::Div0));
+
+        ASSERT_EQUAL(reformat(" SUM( A1 : B2 , 3 ) "), "SUM(A1:B2,3)");
+        ASSERT_EQUAL(reformat("SUM(C3:A1)"), "SUM(A1:C3)");
+        ASSERT_EQUAL(reformat("-(SUM(A1))*(2+MIN(1,(2+3)))"), "-SUM(A1)*(2+MIN(1,2+3))");
+        ASSERT_EQUAL(ParseFormula("SUM(B1:A2,A1,C3)")->GetReferencedCells(),
+                     (std::vector{"A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos, "C3"_pos}));
+
+        auto is_incorrect = [](std::string expr) {
+            try {
+                ParseFormula(std::move(expr));
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        for (std::string expr : {"A1:B2", "(A1:B2)", "SUM()", "SUM(1", "SUM(A1:)", "SUM(A1:1)", "FOO(1)",
+                                 "SUM", "SUM(1,)", "sum(1)", "SUM(A1:B2+1)", "1+A1:B2"}) {
+            ASSERT(is_incorrect(expr));
+        }
+
+        // формула зависит от каждой ячейки диапазона
+        sheet->SetCell("E1"_pos, "=SUM(A1:B3)");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(7.5));
+        sheet->SetCell("B3"_pos, "10");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(17.5));
+        auto is_circular = [&](Position pos, std::string text) {
+            try {
+                sheet->SetCell(pos, std::move(text));
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(is_circular("B3"_pos, "=E1"));
+        ASSERT(is_circular("A3"_pos, "=COUNT(A1:A9)"));
+    }
+
     void TestErrorValue() {
         auto sheet = CreateSheet();
         sheet->SetCell("E2"_pos, "A1");
@@ -203,6 +418,28 @@ namespace {
                      CellInterface::Value(FormulaError::Category::Value));
     }
 
+    void TestTextReadAsNumber() {
+        auto sheet = CreateSheet();
+        auto read = [&](const std::string& text) {
+            sheet->SetCell("A1"_pos, text);
+            return ParseFormula("A1")->Evaluate(*sheet);
+        };
+        const FormulaInterface::Value not_a_number = FormulaError(FormulaError::Category::Value);
+
+        ASSERT(read("15") == FormulaInterface::Value(15.0));
+        ASSERT(read("1.5e1") == FormulaInterface::Value(15.0));
+        ASSERT(read("-.5") == FormulaInterface::Value(-0.5));
+        ASSERT(read("+2") == FormulaInterface::Value(2.0));
+        ASSERT(read(" 4") == FormulaInterface::Value(4.0));
+        ASSERT(read("'7") == FormulaInterface::Value(7.0));
+        ASSERT(read("'") == FormulaInterface::Value(0.0));
+        ASSERT(read("4 ") == not_a_number);
+        ASSERT(read("+-4") == not_a_number);
+        ASSERT(read("inf") == not_a_number);
+        ASSERT(read("0x10") == not_a_number);
+        ASSERT(read("meow") == not_a_number);
+    }
+
     void TestErrorDiv0() {
         auto sheet = CreateSheet();
 
@@ -287,6 +524,120 @@ namespace {
         ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
     }
 
+    void TestPrintFormatting() {
+        Sheet sheet;
+        const std::vector<double> numbers = {0.0, -0.0, 1.0 / 3, 2.5e-7, 123456789.0, -1e300, 42.0, 1e21, 0.1 + 0.2};
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            sheet.SetCell(Position{static_cast<int>(i), 0}, "=" + std::to_string(numbers[i]));
+        }
+        std::ostringstream expected;
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            expected << std::get<double>(sheet.GetCell(Position{static_cast<int>(i), 0})->GetValue()) << '\n';
+        }
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), expected.str());
+
+        sheet.SetCell("B1"_pos, "=1/3");
+        std::ostringstream precise;
+        precise.precision(12);
+        sheet.PrintValues(precise, "B1"_pos, Size{1, 1});
+        ASSERT_EQUAL(precise.str(), "0.333333333333\n");
+
+        Sheet errors;
+        errors.SetCell("A1"_pos, "=1/0");
+        errors.SetCell("B1"_pos, "=C1");
+        errors.SetCell("C1"_pos, "text");
+        std::ostringstream error_values;
+        errors.PrintValues(error_values);
+        ASSERT_EQUAL(error_values.str(), "#DIV/0!\t#VALUE!\ttext\n");
+        std::ostringstream streamed;
+        streamed << FormulaError(FormulaError::Category::Ref) << FormulaError(FormulaError::Category::Value);
+        ASSERT_EQUAL(streamed.str(), "#REF!#VALUE!");
+    }
+
+    void TestPrintViewport() {
+        Sheet sheet;
+        sheet.SetCell("B2"_pos, "=1+1");
+        sheet.SetCell("C2"_pos, "x");
+        sheet.SetCell("D4"_pos, "'=y");
+        sheet.SetCell(Position{100, 100}, "far");
+
+        std::ostringstream values;
+        sheet.PrintValues(values, "B2"_pos, Size{3, 3});
+        ASSERT_EQUAL(values.str(), "2\tx\t\n\t\t\n\t\t=y\n");
+        std::ostringstream texts;
+        sheet.PrintTexts(texts, "C2"_pos, Size{4, 2});
+        ASSERT_EQUAL(texts.str(), "x\t\n\t\n\t'=y\n\t\n");
+
+        // за печатной областью - пустые ячейки, пустой размер - пустой вывод
+        std::ostringstream outside;
+        sheet.PrintValues(outside, Position{200, 200}, Size{2, 2});
+        ASSERT_EQUAL(outside.str(), "\t\n\t\n");
+        std::ostringstream empty;
+        sheet.PrintValues(empty, "A1"_pos, Size{0, 5});
+        ASSERT_EQUAL(empty.str(), "");
+
+        // большой лист целиком совпадает с печатью по ячейкам
+        Sheet big;
+        for (int row = 0; row < 300; row += 7) {
+            for (int col = 0; col < 150; col += 3) {
+                big.SetCell(Position{row, col}, std::to_string(row * col));
+            }
+        }
+        std::ostringstream whole;
+        big.PrintTexts(whole);
+        std::ostringstream by_cell;
+        const Size size = big.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    by_cell << '\t';
+                }
+                if (const Cell* cell = big.GetCell(Position{row, col})) {
+                    by_cell << cell->GetText();
+                }
+            }
+            by_cell << '\n';
+        }
+        ASSERT_EQUAL(whole.str(), by_cell.str());
+
+        auto throws = [&sheet](Position top_left, Size size) {
+            std::ostringstream output;
+            try {
+                sheet.PrintValues(output, top_left, size);
+            } catch (const InvalidPositionException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(throws(Position{-1, 0}, Size{1, 1}));
+        ASSERT(throws("A1"_pos, Size{-1, 1}));
+        ASSERT(throws(Position{Position::MAX_ROWS - 1, 0}, Size{2, 1}));
+        ASSERT(!throws(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, Size{1, 1}));
+    }
+
+    void TestPrintableSizeShrinks() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "top");
+        sheet->SetCell("C2"_pos, "right");
+        sheet->SetCell("B5"_pos, "bottom");
+        sheet->SetCell("C5"_pos, "corner");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+        sheet->ClearCell("C5"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 3}));
+
+        sheet->ClearCell("B5"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 3}));
+
+        sheet->ClearCell("C2"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+    }
+
     void TestCellReferences() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "1");
@@ -311,6 +662,1238 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
     }
 
+    void TestLongDependencyChain() {
+        constexpr int length = 100'000;
+        constexpr int column_height = 10'000;
+        auto at = [](int index) {
+            return Position{index % column_height, index / column_height};
+        };
+        auto sheet = CreateSheet();
+        sheet->SetCell(at(0), "1");
+        for (int i = 1; i < length; ++i) {
+            sheet->SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+        }
+        ASSERT_EQUAL(sheet->GetCell(at(length - 1))->GetValue(), CellInterface::Value(double(length)));
+
+        sheet->SetCell(at(0), "10");
+        ASSERT_EQUAL(sheet->GetCell(at(length - 1))->GetValue(),
+                     CellInterface::Value(double(length + 9)));
+        ASSERT_EQUAL(sheet->GetCell(at(length / 2))->GetValue(),
+                     CellInterface::Value(double(length / 2 + 10)));
+    }
+
+    void TestDiamondDependencies() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1*2");
+        sheet->SetCell("C1"_pos, "=A1*3");
+        sheet->SetCell("D1"_pos, "=B1+C1");
+        sheet->SetCell("E1"_pos, "=D1+B1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+        sheet->SetCell("B1"_pos, "=C1");
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(18.0));
+
+        sheet->ClearCell("C1"_pos);
+        ASSERT(sheet->GetCell("C1"_pos) != nullptr);
+        ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(0.0));
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 5}));
+    }
+
+    void TestEagerRecalculation() {
+        Sheet sheet;
+        ASSERT(sheet.GetCalculationMode() == Sheet::CalculationMode::Lazy);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=SUM(A1:B1)+B1");
+        ASSERT(!sheet.GetCell("C1"_pos)->IsCalculated());
+
+        // переход в жадный режим вычисляет то, что устарело раньше
+        sheet.SetCalculationMode(Sheet::CalculationMode::Eager);
+        ASSERT(sheet.GetCell("B1"_pos)->IsCalculated());
+        ASSERT(sheet.GetCell("C1"_pos)->IsCalculated());
+
+        auto all_calculated = [&sheet] {
+            bool calculated = true;
+            for (const Position pos : {"B1"_pos, "C1"_pos, "D1"_pos, "E1"_pos}) {
+                const Cell* cell = sheet.GetCell(pos);
+                calculated = calculated && (cell == nullptr || cell->IsCalculated());
+            }
+            return calculated;
+        };
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT(all_calculated());
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(25.0));
+
+        // новая ячейка, на которую ссылается формула, не сбрасывает
+        // значения диапазонов, в которые попадает
+        sheet.SetCell("D1"_pos, "=SUM(F1:F3)");
+        sheet.SetCell("E1"_pos, "=F2+C1");
+        ASSERT(all_calculated());
+        ASSERT(sheet.GetCell("F2"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(25.0));
+
+        sheet.SetCells({{"F1"_pos, "2"}, {"F2"_pos, "3"}, {"A1"_pos, "=F1"}});
+        ASSERT(all_calculated());
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(13.0));
+
+        sheet.ClearCell("F1"_pos);
+        ASSERT(all_calculated());
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // отклонённая правка ничего не вычисляет и не оставляет в очереди
+        try {
+            sheet.SetCell("F1"_pos, "=E1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT(all_calculated());
+
+        sheet.SetCalculationMode(Sheet::CalculationMode::Lazy);
+        sheet.SetCell("F2"_pos, "4");
+        ASSERT(!sheet.GetCell("E1"_pos)->IsCalculated());
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        sheet.SetCell("F2"_pos, "6");
+        std::ostringstream snapshot;
+        SaveSnapshot(sheet, snapshot);
+        Sheet loaded;
+        loaded.SetCalculationMode(Sheet::CalculationMode::Eager);
+        LoadSnapshot(loaded, snapshot.str());
+        ASSERT(loaded.GetCell("E1"_pos)->IsCalculated());
+        ASSERT_EQUAL(loaded.GetCell("E1"_pos)->GetValue(), CellInterface::Value(6.0));
+    }
+
+    void TestChangeNotifications() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1*0");
+        sheet.SetCell("D1"_pos, "=SUM(A1:A3)");
+        sheet.SetCell("E1"_pos, "x");
+        std::vector<std::vector<Position>> notifications;
+        const size_t id = sheet.Subscribe([&notifications](const std::vector<Position>& changed) {
+            notifications.push_back(changed);
+        });
+        auto take = [&notifications] {
+            ASSERT_EQUAL(notifications.size(), 1u);
+            std::vector<Position> changed = std::move(notifications.front());
+            notifications.clear();
+            return changed;
+        };
+
+        // ноль в C1 не меняется
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(take(), (std::vector{"A1"_pos, "B1"_pos, "D1"_pos}));
+        // видимые значения те же
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("E1"_pos, "'x");
+        sheet.SetCell("F1"_pos, "");
+        ASSERT(notifications.empty());
+
+        sheet.SetCells({{"A3"_pos, "=A2"}, {"A2"_pos, "5"}});
+        ASSERT_EQUAL(take(), (std::vector{"D1"_pos, "A2"_pos, "A3"_pos}));
+        sheet.SetCell("B1"_pos, "=1/0");
+        ASSERT_EQUAL(take(), (std::vector{"B1"_pos, "C1"_pos}));
+        sheet.ClearCell("A2"_pos);
+        ASSERT_EQUAL(take(), (std::vector{"D1"_pos, "A2"_pos, "A3"_pos}));
+        try {
+            sheet.SetCell("A2"_pos, "=D1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT(notifications.empty());
+
+        // -0 печатается иначе, чем 0, поэтому это разные значения
+        sheet.SetCell("G1"_pos, "=-H1");
+        ASSERT_EQUAL(take(), (std::vector{"G1"_pos}));
+        sheet.SetCell("H1"_pos, "-0");
+        ASSERT_EQUAL(take(), (std::vector{"G1"_pos, "H1"_pos}));
+        sheet.SetCell("G1"_pos, "=H1");
+        ASSERT_EQUAL(take(), (std::vector{"G1"_pos}));
+        std::ostringstream printed;
+        sheet.PrintValues(printed, "G1"_pos, Size{1, 1});
+        ASSERT_EQUAL(printed.str(), "-0\n");
+
+        sheet.Unsubscribe(id);
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(notifications.empty());
+        ASSERT(!sheet.GetCell("D1"_pos)->IsCalculated());
+
+        std::ostringstream snapshot;
+        SaveSnapshot(sheet, snapshot);
+        Sheet loaded;
+        loaded.Subscribe([&notifications](const std::vector<Position>& changed) {
+            notifications.push_back(changed);
+        });
+        LoadSnapshot(loaded, snapshot.str());
+        ASSERT_EQUAL(take().size(), 8u);
+        ASSERT(loaded.GetCell("D1"_pos)->IsCalculated());
+    }
+
+    void TestConcurrentReaders() {
+        // цепочки и диапазоны, которые читатели вычисляют одновременно
+        constexpr int rows = 300;
+        Sheet sheet;
+        Sheet expected;
+        for (Sheet* target : {&sheet, &expected}) {
+            for (int row = 0; row < rows; ++row) {
+                const std::string index = std::to_string(row + 1);
+                target->SetCell(Position{row, 0}, std::to_string(row % 7));
+                target->SetCell(Position{row, 1}, row == 0 ? "=A1" : "=B" + std::to_string(row) + "+A" + index);
+                target->SetCell(Position{row, 2}, "=SUM(A1:B" + index + ")/C" + std::to_string(rows + 1));
+            }
+            target->SetCell(Position{rows, 2}, "=MAX(A1:A" + std::to_string(rows) + ")");
+        }
+        expected.Recalculate();
+
+        std::vector<std::thread> readers;
+        std::vector<char> matches(4, true);
+        for (size_t reader = 0; reader < matches.size(); ++reader) {
+            readers.emplace_back([&sheet, &expected, &matches, reader] {
+                // каждый читатель идёт в своём порядке
+                for (int i = 0; i < rows * 3; ++i) {
+                    const int index = reader % 2 == 0 ? i : rows * 3 - 1 - i;
+                    const Position pos{index % rows, index / rows};
+                    if (!(sheet.GetCell(pos)->GetValue() == expected.GetCell(pos)->GetValue())) {
+                        matches[reader] = false;
+                    }
+                }
+            });
+        }
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        for (const char match : matches) {
+            ASSERT(match);
+        }
+    }
+
+    void TestPublishedVersions() {
+        Sheet sheet;
+        ASSERT(!sheet.GetPublishedVersion());
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=SUM(A1:B1)");
+        sheet.SetCell("D1"_pos, "text");
+        sheet.Publish();
+        const Sheet::VersionReference first = sheet.GetPublishedVersion();
+        ASSERT_EQUAL(first->GetNumber(), 1u);
+        ASSERT_EQUAL(first->GetPrintableSize(), (Size{1, 4}));
+        ASSERT(first->GetNumericValue("C1"_pos) == CellInterface::NumericValue(3.0));
+        ASSERT(first->GetNumericValue("D1"_pos) == CellInterface::NumericValue(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(first->GetRangeSummary(Range{"A1"_pos, "C1"_pos}, true).max, 3.0);
+
+        // читатели проверяют, что каждая версия согласована: в версии n
+        // A1 = n, B1 = 2n, C1 = 3n, а номера не убывают
+        constexpr std::uint64_t publications = 300;
+        std::atomic<bool> done = false;
+        std::vector<std::thread> readers;
+        std::vector<char> consistent(3, true);
+        for (size_t reader = 0; reader < consistent.size(); ++reader) {
+            readers.emplace_back([&sheet, &done, &consistent, reader] {
+                std::uint64_t last = 0;
+                while (!done.load()) {
+                    const Sheet::VersionReference version = sheet.GetPublishedVersion();
+                    const auto number = static_cast<double>(version->GetNumber());
+                    const bool ok = version->GetNumber() >= last
+                                    && version->GetNumericValue("A1"_pos) == CellInterface::NumericValue(number)
+                                    && version->GetNumericValue("B1"_pos) == CellInterface::NumericValue(2 * number)
+                                    && version->GetRangeSummary(Range{"A1"_pos, "B1"_pos}, false).sum == 3 * number
+                                    && version->GetNumericValue("C1"_pos) == CellInterface::NumericValue(3 * number);
+                    consistent[reader] = consistent[reader] && ok;
+                    last = version->GetNumber();
+                }
+            });
+        }
+        for (std::uint64_t number = 2; number <= publications; ++number) {
+            sheet.SetCell("A1"_pos, std::to_string(number));
+            // плитки, которые правка задевает, теперь свои у листа
+            sheet.SetCell(Position{static_cast<int>(number * 7 % 1000), static_cast<int>(number % 40)}, "=A1");
+            sheet.Publish();
+        }
+        done = true;
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        for (const char ok : consistent) {
+            ASSERT(ok);
+        }
+        ASSERT_EQUAL(sheet.GetPublishedVersion()->GetNumber(), publications);
+        // первая версия не изменилась
+        ASSERT(first->GetNumericValue("C1"_pos) == CellInterface::NumericValue(3.0));
+        ASSERT(first->GetNumericValue(Position{14, 2}) == CellInterface::NumericValue(0.0));
+        ASSERT(sheet.GetPublishedVersion()->GetNumericValue(Position{14, 2}) == CellInterface::NumericValue(double(publications)));
+    }
+
+    void TestPublishedReclaim() {
+        // читатели берут ссылки без остановки, и их Acquire перекрываются;
+        // замещённые значения всё равно удаляются
+        Published<std::uint64_t> published;
+        published.Publish(0u);
+        std::atomic<bool> done = false;
+        std::vector<std::thread> readers;
+        std::vector<char> monotonic(3, true);
+        for (size_t reader = 0; reader < monotonic.size(); ++reader) {
+            readers.emplace_back([&published, &done, &monotonic, reader] {
+                std::uint64_t last = 0;
+                while (!done.load()) {
+                    const auto value = published.Acquire();
+                    monotonic[reader] = monotonic[reader] && *value >= last;
+                    last = *value;
+                }
+            });
+        }
+        // писатель уступает процессор после каждой публикации, чтобы
+        // читатели успевали закончить начатые Acquire
+        constexpr std::uint64_t publications = 4000;
+        size_t max_retired = 0;
+        for (std::uint64_t value = 1; value <= publications; ++value) {
+            published.Publish(value);
+            max_retired = std::max(max_retired, published.GetRetiredCount());
+            std::this_thread::yield();
+        }
+        // пока читатели работают, список замещённых сокращается до значений,
+        // на которые ещё могут быть ссылки
+        std::uint64_t value = publications;
+        while (published.GetRetiredCount() > 4 && value < 2 * publications) {
+            published.Publish(++value);
+            std::this_thread::yield();
+        }
+        const size_t retired = published.GetRetiredCount();
+        done = true;
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        for (const char ok : monotonic) {
+            ASSERT(ok);
+        }
+        ASSERT(retired <= 4);
+        ASSERT(max_retired <= 64);
+    }
+
+    void TestTextInterning() {
+        Sheet sheet;
+        for (int row = 0; row < 1000; ++row) {
+            sheet.SetCell(Position{row, 0}, "label " + std::to_string(row % 10));
+        }
+        sheet.SetCell("B1"_pos, "'=escaped");
+        sheet.SetCell("B2"_pos, "=1+2");
+        ASSERT_EQUAL(sheet.GetTexts().Size(), 11u);
+
+        const Cell* escaped = sheet.GetCell("B1"_pos);
+        ASSERT(escaped->GetValueView() == Cell::ValueView(std::string_view("=escaped")));
+        ASSERT_EQUAL(escaped->GetValue(), CellInterface::Value(std::string("=escaped")));
+        std::string buffer;
+        ASSERT_EQUAL(escaped->GetTextView(buffer), std::string_view("'=escaped"));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetTextView(buffer), std::string_view("=1+2"));
+        ASSERT(sheet.GetCell("B2"_pos)->GetValueView() == Cell::ValueView(3.0));
+
+        // длинные тексты, которые сразу стираются, заставляют пул уплотниться
+        const std::string filler(1000, 'x');
+        for (int i = 0; i < 300; ++i) {
+            sheet.SetCell("C1"_pos, filler + std::to_string(i));
+        }
+        sheet.ClearCell("C1"_pos);
+        for (int row = 0; row < 1000; ++row) {
+            ASSERT_EQUAL(sheet.GetCell(Position{row, 0})->GetText(), "label " + std::to_string(row % 10));
+        }
+        ASSERT_EQUAL(sheet.GetTexts().Size(), 11u);
+
+        sheet.SetCell("D1"_pos, " 12.5");
+        sheet.SetCell("D2"_pos, " 12.5");
+        sheet.SetCell("D3"_pos, "=D1+D2");
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(25.0));
+        for (int row = 0; row < 1000; ++row) {
+            sheet.ClearCell(Position{row, 0});
+        }
+        ASSERT_EQUAL(sheet.GetTexts().Size(), 2u);
+    }
+
+    void TestHighFanOutReferences() {
+        // связи ячейки A1 переходят из самой ячейки в кучу и обратно
+        Sheet sheet;
+        constexpr int formulas = 100;
+        sheet.SetCell("A1"_pos, "2");
+        for (int row = 0; row < formulas; ++row) {
+            sheet.SetCell(Position{row, 1}, "=A1*" + std::to_string(row));
+        }
+        sheet.SetCell("C1"_pos, "=A1+B2+B3");
+        ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(198.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(297.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        for (int row = 0; row < formulas; ++row) {
+            sheet.SetCell(Position{row, 1}, std::to_string(row));
+        }
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+        sheet.SetCell("C1"_pos, "=B3");
+        sheet.ClearCell("A1"_pos);
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+        sheet.ClearCell("B3"_pos);
+        ASSERT(sheet.GetCell("B3"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+
+    void TestRangeDependencies() {
+        auto is_circular = [](const std::function<void()>& action) {
+            try {
+                action();
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=SUM(A1:A10000)");
+        // ячейки диапазона не создаются ради ссылки на него
+        ASSERT(sheet.GetCell("A5000"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet.SetCell("A5000"_pos, "3");
+        sheet.SetCell("A10000"_pos, "=A5000*2");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+        sheet.ClearCell("A5000"_pos);
+        ASSERT(sheet.GetCell("A5000"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+        sheet.ClearCell("A10000"_pos);
+        sheet.ClearCell("A5000"_pos);
+        ASSERT(sheet.GetCell("A5000"_pos) == nullptr);
+
+        // пересекающиеся диапазоны и цепочка через диапазоны
+        sheet.SetCell("C1"_pos, "=SUM(A1:A3,A2:A4)+B1");
+        sheet.SetCell("D1"_pos, "=MAX(B1:C1)");
+        sheet.SetCell("A2"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(15.0));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(15.0));
+        sheet.SetCell("B1"_pos, "100");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(110.0));
+        sheet.SetCell("A3"_pos, "1");
+        sheet.Recalculate(4);
+        ASSERT(sheet.GetCell("D1"_pos)->IsCalculated());
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(112.0));
+
+        // цикл через позицию диапазона, где ячейки ещё нет
+        ASSERT(is_circular([&sheet] { sheet.SetCell("A4"_pos, "=D1"); }));
+        ASSERT(sheet.GetCell("A4"_pos) == nullptr);
+        ASSERT(is_circular([&sheet] { sheet.SetCell("E1"_pos, "=COUNT(D1:F1)"); }));
+        ASSERT(is_circular([&sheet] {
+            sheet.SetCells({{"E5"_pos, "=SUM(F1:F9)"}, {"F5"_pos, "=E5"}});
+        }));
+        ASSERT(sheet.GetCell("E5"_pos) == nullptr);
+        // формула без диапазона больше не зависит от его ячеек
+        sheet.SetCell("C1"_pos, "=B1");
+        sheet.SetCell("A4"_pos, "=D1");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(100.0));
+
+        sheet.SetCells({{"F2"_pos, "=SUM(G1:G3)"}, {"G2"_pos, "7"}, {"G3"_pos, "=G2"}});
+        ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), CellInterface::Value(14.0));
+        sheet.SetCells({{"G1"_pos, "1"}});
+        ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), CellInterface::Value(15.0));
+    }
+
+    void TestIncrementalRangeSummaries() {
+        Sheet sheet;
+        const Range range{"A1"_pos, "A200"_pos};
+        const std::vector<std::string> functions{"SUM", "AVERAGE", "COUNT", "MIN", "MAX"};
+        for (int row = 0; row < 200; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 17 * 1.25));
+        }
+        for (size_t i = 0; i < functions.size(); ++i) {
+            sheet.SetCell(Position{0, 2 + static_cast<int>(i)}, "=" + functions[i] + "(A1:A200)");
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A200)+MAX(A1:A200)");
+
+        // значения, посчитанные заново по всем числам диапазона
+        auto check = [&] {
+            std::vector<double> values;
+            try {
+                sheet.GetNumericValues(range, values);
+            } catch (const FormulaError&) {
+                // формула в диапазоне ссылается на текст
+                for (size_t i = 0; i < functions.size(); ++i) {
+                    const auto value = sheet.GetCell(Position{0, 2 + static_cast<int>(i)})->GetValue();
+                    ASSERT(std::holds_alternative<FormulaError>(value));
+                }
+                return;
+            }
+            double sum = 0;
+            double min = values.empty() ? 0 : values[0];
+            double max = min;
+            for (const double value : values) {
+                sum += value;
+                min = std::min(min, value);
+                max = std::max(max, value);
+            }
+            const auto count = static_cast<double>(values.size());
+            const std::vector<double> expected{sum, sum / count, count, min, max};
+            for (size_t i = 0; i < functions.size(); ++i) {
+                const auto value = sheet.GetCell(Position{0, 2 + static_cast<int>(i)})->GetValue();
+                ASSERT(std::abs(std::get<double>(value) - expected[i]) <= 1e-9 * std::max(1.0, std::abs(expected[i])));
+            }
+            const double combined = std::get<double>(sheet.GetCell("B1"_pos)->GetValue());
+            ASSERT(std::abs(combined - (sum + max)) <= 1e-9 * std::max(1.0, std::abs(sum + max)));
+        };
+        check();
+
+        std::mt19937 random(7);
+        std::uniform_int_distribution<int> row_of(0, 199);
+        std::uniform_int_distribution<int> kind_of(0, 9);
+        std::uniform_real_distribution<double> number_of(-1e6, 1e6);
+        for (int i = 0; i < 2000; ++i) {
+            const Position pos{row_of(random), 0};
+            switch (kind_of(random)) {
+                case 0:
+                    sheet.ClearCell(pos);
+                    break;
+                case 1:
+                    sheet.SetCell(pos, "text");
+                    break;
+                case 2:
+                    // формула в диапазоне, которая зависит от другой его ячейки
+                    if (pos.row > 0) {
+                        sheet.SetCell(pos, "=A" + std::to_string(pos.row) + "*2");
+                    }
+                    break;
+                default: {
+                    std::ostringstream text;
+                    text.precision(17);
+                    text << number_of(random);
+                    sheet.SetCell(pos, text.str());
+                }
+            }
+            if (i % 7 == 0) {
+                check();
+            }
+        }
+        check();
+    }
+
+    void TestColumnarValues() {
+        // значения из столбцов листа совпадают с прочитанными по ячейкам
+        // реализацией SheetInterface по умолчанию
+        Sheet sheet;
+        std::mt19937 random(11);
+        std::uniform_int_distribution<int> row_of(0, 149);
+        std::uniform_int_distribution<int> col_of(0, 39);
+        std::uniform_int_distribution<int> kind_of(0, 9);
+        for (int i = 0; i < 3000; ++i) {
+            const Position pos{row_of(random), col_of(random)};
+            const std::string target = Position{row_of(random), col_of(random)}.ToString();
+            try {
+                switch (kind_of(random)) {
+                    case 0:
+                        sheet.ClearCell(pos);
+                        break;
+                    case 1:
+                        sheet.SetCell(pos, "text");
+                        break;
+                    case 2:
+                        sheet.SetCell(pos, "'" + std::to_string(i));
+                        break;
+                    case 3:
+                        sheet.SetCell(pos, "=" + target + "+1");
+                        break;
+                    case 4:
+                        // ошибка #DIV/0!, если target - ноль
+                        sheet.SetCell(pos, "=1/" + target);
+                        break;
+                    default:
+                        sheet.SetCell(pos, std::to_string(i % 23 - 11));
+                }
+            } catch (const CircularDependencyException&) {
+            }
+        }
+
+        for (int row = 0; row < 150; ++row) {
+            for (int col = 0; col < 40; ++col) {
+                const Position pos{row, col};
+                ASSERT(sheet.GetNumericValue(pos) == sheet.SheetInterface::GetNumericValue(pos));
+            }
+        }
+
+        std::uniform_int_distribution<int> size_of(0, 90);
+        for (int i = 0; i < 300; ++i) {
+            const Position first{row_of(random), col_of(random)};
+            const Position last{std::min(first.row + size_of(random), 149), std::min(first.col + size_of(random) / 4, 39)};
+            const Range range{first, last};
+            std::vector<double> values;
+            std::vector<double> expected;
+            bool has_error = false;
+            try {
+                sheet.SheetInterface::GetNumericValues(range, expected);
+            } catch (const FormulaError&) {
+                has_error = true;
+            }
+            try {
+                sheet.GetNumericValues(range, values);
+                ASSERT(!has_error);
+            } catch (const FormulaError&) {
+                ASSERT(has_error);
+                continue;
+            }
+            std::sort(values.begin(), values.end());
+            std::sort(expected.begin(), expected.end());
+            ASSERT(values == expected);
+            const RangeSummary summary = sheet.GetRangeSummary(range, false);
+            const RangeSummary expected_summary = sheet.SheetInterface::GetRangeSummary(range, false);
+            ASSERT_EQUAL(summary.count, expected_summary.count);
+            ASSERT(std::abs(summary.sum - expected_summary.sum) <= 1e-9 * std::max(1.0, std::abs(expected_summary.sum)));
+        }
+    }
+
+    void TestParallelRecalculation() {
+        auto fill = [](Sheet& sheet) {
+            for (int col = 0; col < 40; ++col) {
+                sheet.SetCell(Position{0, col}, std::to_string(col + 1));
+                for (int row = 1; row < 50; ++row) {
+                    const std::string up = Position{row - 1, col}.ToString();
+                    const std::string left = (col > 0 ? Position{row, col - 1} : Position{row - 1, col}).ToString();
+                    sheet.SetCell(Position{row, col}, "=" + up + "*1.5-" + left + "/" + std::to_string(row));
+                }
+            }
+        };
+        Sheet serial;
+        Sheet parallel;
+        fill(serial);
+        fill(parallel);
+        serial.Recalculate();
+        parallel.Recalculate(4);
+
+        for (int row = 0; row < 50; ++row) {
+            for (int col = 0; col < 40; ++col) {
+                ASSERT(parallel.GetCell(Position{row, col})->IsCalculated());
+                ASSERT_EQUAL(parallel.GetCell(Position{row, col})->GetValue(),
+                             serial.GetCell(Position{row, col})->GetValue());
+            }
+        }
+
+        parallel.SetCell("C1"_pos, "0");
+        serial.SetCell("C1"_pos, "0");
+        parallel.Recalculate(3);
+        ASSERT_EQUAL(parallel.GetCell(Position{49, 39})->GetValue(),
+                     serial.GetCell(Position{49, 39})->GetValue());
+    }
+
+    void TestBatchSetCells() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("C1"_pos, "=B1*10");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        sheet.SetCells({{"B1"_pos, "=A1+A2"}, {"A2"_pos, "2"}, {"B2"_pos, "=B1+C1"}, {"A2"_pos, "3"}});
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "3");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(40.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(44.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 3}));
+
+        // неудачный пакет не оставляет следов
+        auto fails = [&sheet](std::vector<std::pair<Position, std::string>> cells) {
+            try {
+                sheet.SetCells(std::move(cells));
+            } catch (const CircularDependencyException&) {
+                return true;
+            } catch (const FormulaException&) {
+                return true;
+            } catch (const InvalidPositionException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(fails({{"D1"_pos, "5"}, {"A1"_pos, "=C1"}}));
+        ASSERT(fails({{"D1"_pos, "5"}, {"E1"_pos, "=1+"}}));
+        ASSERT(fails({{"D1"_pos, "5"}, {Position{-1, 0}, "1"}}));
+        ASSERT(fails({{"D1"_pos, "=D2"}, {"D2"_pos, "=D1"}}));
+        ASSERT(fails({{"D1"_pos, "=D1"}}));
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 3}));
+
+        // порядок, построенный пакетом, годится для следующих правок
+        std::vector<std::pair<Position, std::string>> chain;
+        for (int row = 99; row > 0; --row) {
+            chain.emplace_back(Position{row, 4}, "=" + Position{row - 1, 4}.ToString() + "+1");
+        }
+        chain.emplace_back("E1"_pos, "=B2");
+        sheet.SetCells(std::move(chain));
+        ASSERT_EQUAL(sheet.GetCell("E100"_pos)->GetValue(), CellInterface::Value(143.0));
+        ASSERT(fails({{"A1"_pos, "=E50"}}));
+        bool caught = false;
+        try {
+            sheet.SetCell("A2"_pos, "=E100");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        sheet.SetCell("A2"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("E100"_pos)->GetValue(), CellInterface::Value(154.0));
+    }
+
+    void TestImportTexts() {
+        Sheet source;
+        source.SetCell("A1"_pos, "=B3*2");
+        source.SetCell("B1"_pos, "'=quoted");
+        source.SetCell("D1"_pos, "text with spaces");
+        source.SetCell("B3"_pos, "=(1+2)*C3");
+        source.SetCell("C3"_pos, "4");
+        source.SetCell("A4"_pos, "=");
+        source.SetCell("E5"_pos, "=A1/0");
+        source.SetCell("E5"_pos, "");
+        std::ostringstream texts;
+        source.PrintTexts(texts);
+
+        Sheet imported;
+        ImportTexts(imported, texts.str());
+        std::ostringstream reprinted;
+        imported.PrintTexts(reprinted);
+        ASSERT_EQUAL(reprinted.str(), texts.str());
+        ASSERT_EQUAL(imported.GetPrintableSize(), source.GetPrintableSize());
+        ASSERT_EQUAL(imported.GetCell("A1"_pos)->GetValue(), CellInterface::Value(24.0));
+        ASSERT_EQUAL(imported.GetCell("B1"_pos)->GetValue(), CellInterface::Value("=quoted"));
+        ASSERT(imported.GetCell("C1"_pos) == nullptr);
+
+        // последняя строка может быть без перевода строки
+        Sheet unterminated;
+        ImportTexts(unterminated, "1\t\t=A1+1\n\n\t=C1*A1");
+        ASSERT_EQUAL(unterminated.GetPrintableSize(), (Size{3, 3}));
+        ASSERT_EQUAL(unterminated.GetCell("B3"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        const auto path = std::filesystem::temp_directory_path() / "spreadsheet_import_test.tsv";
+        std::ofstream(path, std::ios::binary) << texts.str();
+        Sheet from_file;
+        ImportTextsFile(from_file, path.string());
+        std::remove(path.string().c_str());
+        std::ostringstream file_texts;
+        from_file.PrintTexts(file_texts);
+        ASSERT_EQUAL(file_texts.str(), texts.str());
+
+        bool caught = false;
+        try {
+            ImportTextsFile(from_file, path.string());
+        } catch (const std::system_error&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    void TestSnapshot() {
+        Sheet source;
+        source.SetCell("A1"_pos, "2");
+        source.SetCell("B1"_pos, "'=text");
+        source.SetCell("C1"_pos, "abc");
+        for (int row = 1; row < 20; ++row) {
+            source.SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "*2+E1");
+        }
+        source.SetCell("D1"_pos, "=1/0");
+        source.SetCell("D2"_pos, "=C1+1");
+        source.SetCell("D3"_pos, "=A20+A20-D5");
+        source.SetCell("D4"_pos, "=SUM(A1:A20)+COUNT(B1:C1)");
+        ASSERT_EQUAL(source.GetCell("A20"_pos)->GetValue(), CellInterface::Value(std::pow(2.0, 20)));
+        ASSERT_EQUAL(source.GetCell("D2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        std::ostringstream snapshot;
+        SaveSnapshot(source, snapshot);
+
+        Sheet loaded;
+        LoadSnapshot(loaded, snapshot.str());
+        std::ostringstream source_texts;
+        std::ostringstream loaded_texts;
+        source.PrintTexts(source_texts);
+        loaded.PrintTexts(loaded_texts);
+        ASSERT_EQUAL(loaded_texts.str(), source_texts.str());
+        ASSERT_EQUAL(loaded.GetPrintableSize(), source.GetPrintableSize());
+        // значения взяты из снимка, формулы не разбирались и не вычислялись
+        ASSERT_EQUAL(loaded.GetFormulaTable().GetParseCount(), 0u);
+        ASSERT(loaded.GetCell("A20"_pos)->IsCalculated());
+        ASSERT(!loaded.GetCell("D1"_pos)->IsCalculated());
+        ASSERT_EQUAL(loaded.GetCell("A20"_pos)->GetValue(), CellInterface::Value(std::pow(2.0, 20)));
+        ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetValue(), CellInterface::Value("=text"));
+        ASSERT_EQUAL(loaded.GetCell("D2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(loaded.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+        ASSERT(loaded.GetCell("E1"_pos) != nullptr && loaded.GetCell("E1"_pos)->IsReferenced());
+        ASSERT_EQUAL(loaded.GetCell("D4"_pos)->GetValue(), CellInterface::Value(2097150.0));
+
+        // связи и порядок восстановлены: правки пересчитывают зависимые и
+        // находят циклы, протянутые формулы делят загруженные деревья
+        loaded.SetCell("E1"_pos, "1");
+        ASSERT_EQUAL(loaded.GetCell("A3"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(loaded.GetCell("D4"_pos)->GetValue(), CellInterface::Value(3145705.0));
+        loaded.SetCell("E3"_pos, "=D2+1");
+        ASSERT_EQUAL(loaded.GetFormulaTable().GetParseCount(), 0u);
+        bool caught = false;
+        try {
+            loaded.SetCell("A1"_pos, "=D3");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        auto rejects = [](std::string data) {
+            Sheet sheet;
+            try {
+                LoadSnapshot(sheet, data);
+            } catch (const SnapshotException&) {
+                return sheet.GetPrintableSize() == Size{0, 0} && sheet.GetCell("A1"_pos) == nullptr;
+            }
+            return false;
+        };
+        const std::string data = snapshot.str();
+        ASSERT(rejects(""));
+        ASSERT(rejects("not a snapshot"));
+        ASSERT(rejects(data.substr(0, data.size() - 1)));
+        ASSERT(rejects(data + '\0'));
+        std::string wrong_version = data;
+        ++wrong_version[8];
+        ASSERT(rejects(wrong_version));
+        // порча байта либо отвергается, либо даёт согласованный лист; шаг
+        // взаимно прост с размерами полей, так что задеты все их байты
+        for (size_t i = 0; i < data.size(); i += 3) {
+            std::string corrupted = data;
+            corrupted[i] ^= 0x5a;
+            Sheet sheet;
+            try {
+                LoadSnapshot(sheet, corrupted);
+            } catch (const SnapshotException&) {
+                continue;
+            }
+            for (int row = 0; row < 20; ++row) {
+                for (int col = 0; col < 5; ++col) {
+                    if (const Cell* cell = sheet.GetCell(Position{row, col})) {
+                        cell->GetValue();
+                    }
+                }
+            }
+        }
+
+        // ключ таблицы формул проверяется: с подменённым ключом формулы,
+        // заданные после загрузки, получили бы чужое дерево
+        Sheet keyed;
+        keyed.SetCell("A1"_pos, "10");
+        keyed.SetCell("D1"_pos, "=A1+1");
+        std::ostringstream keyed_snapshot;
+        SaveSnapshot(keyed, keyed_snapshot);
+        std::string tampered = keyed_snapshot.str();
+        const size_t key = tampered.find("R[0]C[-3] + 1 ");
+        ASSERT(key != std::string::npos);
+        tampered[tampered.find('+', key)] = '*';
+        ASSERT(rejects(tampered));
+        Sheet keyed_loaded;
+        LoadSnapshot(keyed_loaded, keyed_snapshot.str());
+        keyed_loaded.SetCell("E1"_pos, "=D1*1");
+        keyed_loaded.SetCell("E2"_pos, "=B2+1");
+        ASSERT_EQUAL(keyed_loaded.GetCell("E1"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(keyed_loaded.GetCell("E1"_pos)->GetText(), "=D1*1");
+        ASSERT_EQUAL(keyed_loaded.GetFormulaTable().GetParseCount(), 1u);
+
+        caught = false;
+        try {
+            LoadSnapshot(loaded, data);
+        } catch (const SnapshotException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        const auto path = std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin";
+        std::ofstream(path, std::ios::binary) << data;
+        Sheet from_file;
+        LoadSnapshotFile(from_file, path.string());
+        std::remove(path.string().c_str());
+        ASSERT_EQUAL(from_file.GetCell("A20"_pos)->GetValue(), CellInterface::Value(std::pow(2.0, 20)));
+    }
+
+    void TestSharedRelativeFormulas() {
+        Sheet sheet;
+        for (int row = 0; row < 1000; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell(Position{row, 0}, r);
+            sheet.SetCell(Position{row, 1}, "2");
+            sheet.SetCell(Position{row, 3}, "=A" + r + "*B" + r + "+C" + r);
+        }
+        const FormulaTable& formulas = sheet.GetFormulaTable();
+        ASSERT_EQUAL(formulas.GetFormulaCount(), 1u);
+        ASSERT_EQUAL(formulas.GetParseCount(), 1u);
+
+        const Cell* cell = sheet.GetCell("D500"_pos);
+        ASSERT_EQUAL(cell->GetText(), "=A500*B500+C500");
+        ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(1000.0));
+        ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector{"A500"_pos, "B500"_pos, "C500"_pos}));
+        sheet.SetCell("A500"_pos, "10");
+        ASSERT_EQUAL(cell->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(sheet.GetCell("D499"_pos)->GetValue(), CellInterface::Value(998.0));
+
+        // пробелы не меняют формулу, а тот же текст в другой строке - это
+        // другая относительная формула
+        sheet.SetCell("D1"_pos, "= A1 * B1 + C1");
+        ASSERT_EQUAL(formulas.GetParseCount(), 1u);
+        sheet.SetCell("D2"_pos, "=A1*B1+C1");
+        ASSERT_EQUAL(formulas.GetFormulaCount(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=A1*B1+C1");
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        sheet.SetCell("E2"_pos, "=E1+A1");
+        sheet.SetCell("E3"_pos, "=E2+A2");
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetReferencedCells(), (std::vector{"A2"_pos, "E2"_pos}));
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(formulas.GetFormulaCount(), 3u);
+
+        for (int row = 0; row < 1000; ++row) {
+            sheet.ClearCell(Position{row, 3});
+            sheet.ClearCell(Position{row, 4});
+        }
+        ASSERT_EQUAL(formulas.GetFormulaCount(), 0u);
+    }
+
+    void TestWorkbook() {
+        Workbook book;
+        Sheet& first = book.AddSheet("Sheet1");
+        first.SetCell("A1"_pos, "=Data!A1*2");
+        first.SetCell("A2"_pos, "=SUM(Data!A1:B2)+A1");
+        first.SetCell("A3"_pos, "=Sheet1!A1+1");
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "=Data!A1*2");
+        ASSERT_EQUAL(first.GetCell("A2"_pos)->GetText(), "=SUM(Data!A1:B2)+A1");
+        // листа ещё нет: ссылки на него - ошибка, пока его не добавят
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+        ASSERT_EQUAL(first.GetCell("A3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+        Sheet& data = book.AddSheet("Data");
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+        data.SetCell("A1"_pos, "3");
+        data.SetCell("B2"_pos, "4");
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(first.GetCell("A2"_pos)->GetValue(), CellInterface::Value(13.0));
+        ASSERT_EQUAL(first.GetCell("A3"_pos)->GetValue(), CellInterface::Value(7.0));
+        data.ClearCell("A1"_pos);
+        ASSERT_EQUAL(first.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(book.GetSheetNames(), (std::vector<std::string_view>{"Sheet1", "Data"}));
+        ASSERT(book.GetSheet("Missing") == nullptr);
+
+        auto rejects_name = [&book](std::string name) {
+            try {
+                book.AddSheet(std::move(name));
+            } catch (const std::invalid_argument&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(rejects_name("Data"));
+        ASSERT(rejects_name("1st"));
+        ASSERT(rejects_name("My sheet"));
+        ASSERT(rejects_name(""));
+
+        // циклы через листы отвергаются и при SetCell, и пакетом
+        data.SetCell("C1"_pos, "=Sheet1!A2");
+        auto closes_cycle = [](auto edit) {
+            try {
+                edit();
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(closes_cycle([&data] {
+            data.SetCell("A1"_pos, "=C1");
+        }));
+        ASSERT(closes_cycle([&first] {
+            first.SetCell("A1"_pos, "=Data!C1");
+        }));
+        ASSERT(closes_cycle([&data] {
+            data.SetCells({{"D1"_pos, "=C1"}, {"B1"_pos, "=D1"}});
+        }));
+        ASSERT(data.GetCell("D1"_pos) == nullptr);
+        ASSERT_EQUAL(first.GetCell("A2"_pos)->GetValue(), CellInterface::Value(4.0));
+        data.SetCell("D1"_pos, "=C1+Sheet1!A3");
+        ASSERT_EQUAL(data.GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // жадный лист пересчитывается в конце правки другого листа
+        first.SetCalculationMode(Sheet::CalculationMode::Eager);
+        std::vector<Position> changed;
+        first.Subscribe([&changed](const std::vector<Position>& positions) {
+            changed = positions;
+        });
+        data.SetCell("B2"_pos, "10");
+        ASSERT(first.GetCell("A2"_pos)->IsCalculated());
+        ASSERT_EQUAL(changed, (std::vector{"A2"_pos}));
+        ASSERT_EQUAL(data.GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+        // снимок листа книги восстанавливает ссылки на другие листы
+        std::ostringstream snapshot;
+        SaveSnapshot(data, snapshot);
+        Sheet& copy = book.AddSheet("Copy");
+        LoadSnapshot(copy, snapshot.str());
+        ASSERT_EQUAL(copy.GetCell("C1"_pos)->GetText(), "=Sheet1!A2");
+        ASSERT(!copy.GetCell("C1"_pos)->IsCalculated());
+        ASSERT_EQUAL(copy.GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+        first.SetCell("B1"_pos, "=Copy!D1");
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+        data.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(16.0));
+        copy.SetCell("C1"_pos, "=B2");
+        ASSERT_EQUAL(first.GetCell("B1"_pos)->GetValue(), CellInterface::Value(13.0));
+        first.SetCell("A3"_pos, "=Echo!D1+1");
+        Sheet& echo = book.AddSheet("Echo");
+        bool caught = false;
+        try {
+            LoadSnapshot(echo, snapshot.str());
+        } catch (const SnapshotException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(echo.GetCell("D1"_pos) == nullptr);
+
+        // формулы, которые зависят от формул, читающих другие листы,
+        // тоже не берут значения из снимка
+        Workbook chained;
+        Sheet& source = chained.AddSheet("Src");
+        Sheet& reader = chained.AddSheet("Data");
+        source.SetCell("A1"_pos, "1");
+        reader.SetCell("A1"_pos, "=Src!A1");
+        reader.SetCell("B1"_pos, "=A1+1");
+        reader.SetCell("C1"_pos, "=SUM(A1:B1)");
+        ASSERT_EQUAL(reader.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+        std::ostringstream chained_snapshot;
+        SaveSnapshot(reader, chained_snapshot);
+        Sheet& chained_copy = chained.AddSheet("Copy");
+        LoadSnapshot(chained_copy, chained_snapshot.str());
+        ASSERT(!chained_copy.GetCell("B1"_pos)->IsCalculated());
+        ASSERT(!chained_copy.GetCell("C1"_pos)->IsCalculated());
+        source.SetCell("A1"_pos, "100");
+        ASSERT_EQUAL(chained_copy.GetCell("B1"_pos)->GetValue(), CellInterface::Value(101.0));
+        ASSERT_EQUAL(chained_copy.GetCell("C1"_pos)->GetValue(), CellInterface::Value(201.0));
+        source.SetCell("A1"_pos, "2");
+        chained.Recalculate();
+        ASSERT_EQUAL(chained_copy.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+        Sheet& chained_eager = chained.AddSheet("Eager");
+        chained_eager.SetCalculationMode(Sheet::CalculationMode::Eager);
+        LoadSnapshot(chained_eager, chained_snapshot.str());
+        ASSERT(chained_eager.GetCell("C1"_pos)->IsCalculated());
+        ASSERT_EQUAL(chained_eager.GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    void TestWorkbookRecalculation() {
+        Workbook book;
+        constexpr int rows = 200;
+        // независимые листы, над ними итог, который читает их все, и пара
+        // листов, которые ссылаются друг на друга
+        for (int part = 0; part < 4; ++part) {
+            Sheet& sheet = book.AddSheet("Part" + std::to_string(part));
+            sheet.SetCell("A1"_pos, std::to_string(part + 1));
+            for (int row = 1; row < rows; ++row) {
+                sheet.SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+            }
+        }
+        Sheet& total = book.AddSheet("Total");
+        total.SetCell("A1"_pos, "=Part0!A200+Part1!A200+Part2!A200+Part3!A200");
+        total.SetCell("A2"_pos, "=Mirror!A1");
+        total.SetCell("B1"_pos, "=SUM(Part3!A1:A200)");
+        Sheet& mirror = book.AddSheet("Mirror");
+        mirror.SetCell("A1"_pos, "=Total!A1*2");
+
+        auto expected_total = [](int offset) {
+            double sum = 0;
+            for (int part = 0; part < 4; ++part) {
+                sum += part + offset + rows - 1;
+            }
+            return sum;
+        };
+        for (const size_t threads : {1u, 4u}) {
+            const int offset = static_cast<int>(threads);
+            for (int part = 0; part < 4; ++part) {
+                book.GetSheet("Part" + std::to_string(part))->SetCell("A1"_pos, std::to_string(part + offset));
+            }
+            ASSERT(!total.GetCell("A2"_pos)->IsCalculated());
+            book.Recalculate(threads);
+            for (const std::string_view name : book.GetSheetNames()) {
+                std::vector<Position> stale;
+                book.GetSheet(name)->GetValues().GetStale(stale);
+                ASSERT(stale.empty());
+            }
+            ASSERT_EQUAL(total.GetCell("A1"_pos)->GetValue(), CellInterface::Value(expected_total(offset)));
+            ASSERT_EQUAL(total.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2 * expected_total(offset)));
+            ASSERT_EQUAL(total.GetCell("B1"_pos)->GetValue(), CellInterface::Value(200.0 * (3 + offset) + 19900.0));
+        }
+
+        // цепочка листов вычисляется по одному листу за волну, и все они
+        // считаются в пуле книги, а не каждый в своём
+        const std::filesystem::path tasks = "/proc/self/task";
+        auto thread_count = [&tasks] {
+            return std::distance(std::filesystem::directory_iterator(tasks), std::filesystem::directory_iterator());
+        };
+        if (std::filesystem::exists(tasks)) {
+            Workbook chain;
+            chain.AddSheet("S0").SetCell("A1"_pos, "1");
+            for (int i = 1; i < 50; ++i) {
+                chain.AddSheet("S" + std::to_string(i))
+                        .SetCell("A1"_pos, "=S" + std::to_string(i - 1) + "!A1+1");
+            }
+            const auto threads_before = thread_count();
+            chain.Recalculate(4);
+            ASSERT(thread_count() <= threads_before + 4);
+            ASSERT_EQUAL(chain.GetSheet("S49")->GetCell("A1"_pos)->GetValue(), CellInterface::Value(50.0));
+        }
+
+        // ленивое чтение длинной цепочки листов не уходит в рекурсию по
+        // листам: цепочка читается в потоке с маленьким стеком
+        Workbook lazy;
+        const int length = 2000;
+        lazy.AddSheet("S0").SetCell("A1"_pos, "1");
+        for (int i = 1; i < length; ++i) {
+            lazy.AddSheet("S" + std::to_string(i)).SetCell("A1"_pos, "=S" + std::to_string(i - 1) + "!A1+1");
+        }
+        const auto* last = lazy.GetSheet("S" + std::to_string(length - 1))->GetCell("A1"_pos);
+        ASSERT(!last->IsCalculated());
+        CellInterface::Value value;
+        RunWithStack(256 * 1024, [&] {
+            value = last->GetValue();
+        });
+        ASSERT_EQUAL(value, CellInterface::Value(static_cast<double>(length)));
+        lazy.GetSheet("S0")->SetCell("A1"_pos, "2");
+        RunWithStack(256 * 1024, [&] {
+            value = lazy.GetSheet("S1000")->GetCell("A1"_pos)->GetValue();
+        });
+        ASSERT_EQUAL(value, CellInterface::Value(1002.0));
+        ASSERT_EQUAL(last->GetValue(), CellInterface::Value(length + 1.0));
+    }
+
+    void TestCheckpoints() {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+            sheet.SetCell(Position{row, 1}, "=A" + std::to_string(row + 1) + "*2");
+        }
+        sheet.SetCell("C1"_pos, "=SUM(B1:B100)");
+        sheet.SetCell("D1"_pos, "label");
+        sheet.SetCell(Position{5000, 200}, "far away");
+        const Sheet::Checkpoint base = sheet.MakeCheckpoint();
+        std::ostringstream base_texts;
+        sheet.PrintTexts(base_texts);
+
+        // вариант: пять входов изменены, точка помнит прежние значения
+        for (int row = 0; row < 5; ++row) {
+            sheet.SetCell(Position{row, 0}, "100");
+        }
+        sheet.ClearCell("D1"_pos);
+        sheet.SetCell("E1"_pos, "=C1-1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10880.0));
+        ASSERT_EQUAL(std::get<double>(base.GetNumericValue("C1"_pos)), 9900.0);
+        ASSERT_EQUAL(base.GetText("B2"_pos), "=A2*2");
+        ASSERT_EQUAL(base.GetText("D1"_pos), "label");
+        ASSERT_EQUAL(base.GetText("E1"_pos), "");
+        // текст точки держит запись пула, пока жива точка
+        ASSERT_EQUAL(sheet.GetTexts().Size(), 103u);
+        const Sheet::Checkpoint scenario = sheet.MakeCheckpoint();
+
+        std::vector<Position> changed;
+        sheet.Subscribe([&changed](const std::vector<Position>& positions) {
+            changed = positions;
+        });
+        sheet.Restore(base);
+        std::ostringstream restored_texts;
+        sheet.PrintTexts(restored_texts);
+        ASSERT_EQUAL(restored_texts.str(), base_texts.str());
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        // значения взяты из точки без вычисления
+        ASSERT(sheet.GetCell("C1"_pos)->IsCalculated());
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(9900.0));
+        ASSERT_EQUAL(changed.size(), 13u);
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(9902.0));
+
+        // повтор, и точка другого листа делает лист её копией
+        sheet.Restore(scenario);
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(10879.0));
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+        Sheet branch;
+        branch.Restore(scenario);
+        std::ostringstream sheet_texts;
+        std::ostringstream branch_texts;
+        sheet.PrintTexts(sheet_texts);
+        branch.PrintTexts(branch_texts);
+        ASSERT_EQUAL(branch_texts.str(), sheet_texts.str());
+        branch.SetCell("A100"_pos, "0");
+        ASSERT_EQUAL(branch.GetCell("E1"_pos)->GetValue(), CellInterface::Value(10681.0));
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(10879.0));
+        Sheet empty;
+        branch.Restore(empty.MakeCheckpoint());
+        ASSERT_EQUAL(branch.GetPrintableSize(), (Size{0, 0}));
+        ASSERT_EQUAL(branch.GetTexts().Size(), 0u);
+        ASSERT_EQUAL(branch.GetFormulaTable().GetParseCount(), 0u);
+
+        // возврат, который замкнул бы цикл через листы, отвергается
+        Workbook book;
+        Sheet& first = book.AddSheet("First");
+        Sheet& second = book.AddSheet("Second");
+        first.SetCell("A1"_pos, "=Second!A1");
+        const Sheet::Checkpoint with_reference = first.MakeCheckpoint();
+        first.ClearCell("A1"_pos);
+        second.SetCell("A1"_pos, "=First!A1+1");
+        bool caught = false;
+        try {
+            first.Restore(with_reference);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(first.GetCell("A1"_pos) == nullptr);
+        second.SetCell("A1"_pos, "5");
+        first.Restore(with_reference);
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // значения, прочитанные с других листов, не переносятся туда, где
+        // эти листы другие: вне книги ссылка даёт #REF!, а в книге
+        // вычисляется по её листам
+        const Sheet::Checkpoint read_five = first.MakeCheckpoint();
+        Sheet standalone;
+        standalone.Restore(read_five);
+        const CellInterface::Value ref_error(FormulaError(FormulaError::Category::Ref));
+        ASSERT_EQUAL(standalone.GetCell("A1"_pos)->GetValue(), ref_error);
+        Sheet& third = book.AddSheet("Third");
+        third.Restore(standalone.MakeCheckpoint());
+        ASSERT_EQUAL(third.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+        Workbook other;
+        other.AddSheet("Second").SetCell("A1"_pos, "7");
+        Sheet& copy = other.AddSheet("Copy");
+        copy.Restore(read_five);
+        ASSERT_EQUAL(copy.GetCell("A1"_pos)->GetValue(), CellInterface::Value(7.0));
+    }
+
+#ifdef SPREADSHEET_WITH_ANTLR
+    void TestNativeParserMatchesAntlr() {
+        auto parse = [](std::string_view text, ParserBackend backend) -> std::string {
+            try {
+                const FormulaAST ast = ParseFormulaAST(text, backend);
+                std::ostringstream out;
+                ast.Print(out);
+                out << '|';
+                ast.PrintFormula(out);
+                out << '|';
+                ast.PrintCells(out);
+                return out.str();
+            } catch (...) {
+                return "error";
+            }
+        };
+
+        const std::vector<std::string> pieces = {"1",  "2.5", ".5", "1e3", "1E-2", "e+", "A1", "ZZ99", "ABCD1",
+                                                 "A0", "+",   "-",  "*",   "/",    "(",  ")",  " ",    "\t",
+                                                 "e",  ".",   "A",  "1.",  "3X",   "9",  "XFD16384", "1e999",
+                                                 "SUM", "MIN", "COUNT", ":", ","};
+        std::mt19937 random(42);
+        for (int i = 0; i < 20000; ++i) {
+            std::string text;
+            const int length = 1 + static_cast<int>(random() % 12);
+            for (int j = 0; j < length; ++j) {
+                text += pieces[random() % pieces.size()];
+            }
+            ASSERT_EQUAL(parse(text, ParserBackend::Native), parse(text, ParserBackend::Antlr));
+        }
+    }
+#endif
+
     void TestFormulaIncorrect() {
         auto isIncorrect = [](std::string expression) {
             try {
@@ -345,6 +1928,42 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
+
+    void TestCircularReferencesAfterReordering() {
+        auto sheet = CreateSheet();
+        auto is_circular = [&sheet](Position pos, const std::string& text) {
+            try {
+                sheet->SetCell(pos, text);
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+
+        // имя ячейки внутри формулы - ещё не ссылка на неё
+        ASSERT(!is_circular("A1"_pos, "=A10+A11"));
+        ASSERT(is_circular("A1"_pos, "=A1"));
+
+        // цепочка, собранная снизу вверх: каждая правка переставляет ячейки
+        for (int row = 4; row > 0; --row) {
+            ASSERT(!is_circular(Position{row, 1}, "=" + Position{row - 1, 1}.ToString() + "+1"));
+        }
+        ASSERT(!is_circular("B1"_pos, "1"));
+        ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT(is_circular("B1"_pos, "=B5"));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "1");
+
+        ASSERT(!is_circular("C1"_pos, "=B5*2"));
+        ASSERT(!is_circular("B3"_pos, "=B2+D1"));
+        ASSERT(is_circular("D1"_pos, "=C1"));
+        ASSERT(!is_circular("D1"_pos, "=E1+1"));
+        ASSERT(!is_circular("E1"_pos, "=B1"));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT(is_circular("B1"_pos, "=C1"));
+        ASSERT(is_circular("E1"_pos, "=B4"));
+        ASSERT(!is_circular("E1"_pos, "=A1"));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+    }
 }  // namespace
 
 int main() {
@@ -354,19 +1973,50 @@ int main() {
     RUN_TEST(tr, TestStringToPositionInvalid);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestTiledStorage);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
     RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaBytecodeMatchesTree);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaFunctions);
     RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestTextReadAsNumber);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintFormatting);
+    RUN_TEST(tr, TestPrintViewport);
+    RUN_TEST(tr, TestPrintableSizeShrinks);
     RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestDiamondDependencies);
+    RUN_TEST(tr, TestTextInterning);
+    RUN_TEST(tr, TestEagerRecalculation);
+    RUN_TEST(tr, TestChangeNotifications);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestPublishedVersions);
+    RUN_TEST(tr, TestPublishedReclaim);
+    RUN_TEST(tr, TestHighFanOutReferences);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestIncrementalRangeSummaries);
+    RUN_TEST(tr, TestColumnarValues);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestBatchSetCells);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestSharedRelativeFormulas);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestWorkbookRecalculation);
+    RUN_TEST(tr, TestCheckpoints);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestNativeParserMatchesAntlr);
+#endif
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularReferencesAfterReordering);
     return 0;
 }
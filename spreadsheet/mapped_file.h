@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Содержимое файла, отображённое в память только для чтения. Если
+// отображение недоступно (Windows), файл читается в буфер целиком.
+// Бросает std::system_error, если файл не удаётся открыть.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] std::string_view GetData() const {
+        return data_;
+    }
+
+private:
+    std::string_view data_;
+#ifdef _WIN32
+    std::string buffer_;
+#endif
+};
@@ -0,0 +1,151 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Значение, которое один поток-писатель публикует, а любые потоки читают
+// без блокировок. Опубликованное значение не меняется; новая публикация
+// заменяет его целиком. Читатель берёт ссылку на текущее значение
+// несколькими атомарными операциями и не ждёт писателя. Замещённые
+// значения писатель удаляет при следующих публикациях, когда на них не
+// остаётся ссылок и до них не может добраться ни один начатый Acquire.
+// Читатели, которые берут ссылки непрерывно, удалению не мешают.
+// Ссылки должны быть отпущены раньше, чем разрушается сам объект.
+template <typename T>
+class Published {
+    struct Node {
+        template <typename... Args>
+        explicit Node(Args&&... args) : value(std::forward<Args>(args)...) {}
+
+        T value;
+        std::atomic<size_t> references{0};
+        // эпоха, в которой значение заместили
+        std::uint64_t retired_epoch = 0;
+    };
+
+public:
+    // Ссылка на опубликованное значение. Пустая, если публикаций не было.
+    class Reference {
+    public:
+        Reference() = default;
+        Reference(const Reference&) = delete;
+        Reference& operator=(const Reference&) = delete;
+
+        Reference(Reference&& other) noexcept
+            : node_(std::exchange(other.node_, nullptr)) {}
+
+        Reference& operator=(Reference&& other) noexcept {
+            if (this != &other) {
+                Release();
+                node_ = std::exchange(other.node_, nullptr);
+            }
+            return *this;
+        }
+
+        ~Reference() {
+            Release();
+        }
+
+        explicit operator bool() const {
+            return node_ != nullptr;
+        }
+
+        const T& operator*() const {
+            return node_->value;
+        }
+
+        const T* operator->() const {
+            return &node_->value;
+        }
+
+    private:
+        friend class Published;
+
+        explicit Reference(Node* node) : node_(node) {}
+
+        void Release() {
+            if (node_ != nullptr) {
+                node_->references.fetch_sub(1, std::memory_order_release);
+                node_ = nullptr;
+            }
+        }
+
+        Node* node_ = nullptr;
+    };
+
+    Published() = default;
+    Published(const Published&) = delete;
+    Published& operator=(const Published&) = delete;
+    ~Published() = default;
+
+    // Публикует новое значение, построенное из args. Вызывается только
+    // писателем.
+    template <typename... Args>
+    void Publish(Args&&... args) {
+        auto node = std::make_unique<Node>(std::forward<Args>(args)...);
+        current_.store(node.get(), std::memory_order_seq_cst);
+        if (owned_) {
+            owned_->retired_epoch = epoch_.load(std::memory_order_relaxed);
+            retired_.push_back(std::move(owned_));
+        }
+        owned_ = std::move(node);
+        Reclaim();
+    }
+
+    // Ссылка на последнее опубликованное значение. Можно вызывать из любого
+    // потока одновременно с Publish.
+    Reference Acquire() const {
+        // Пока читатель не взял ссылку на узел, он числится в счётчике
+        // чётности своей эпохи; писатель не удаляет узлы, которые такой
+        // читатель мог прочитать из current_, см. Reclaim.
+        const std::uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+        auto& acquiring = acquiring_[epoch % 2];
+        acquiring.fetch_add(1, std::memory_order_seq_cst);
+        Node* node = current_.load(std::memory_order_seq_cst);
+        if (node != nullptr) {
+            node->references.fetch_add(1, std::memory_order_relaxed);
+        }
+        acquiring.fetch_sub(1, std::memory_order_seq_cst);
+        return Reference(node);
+    }
+
+    // Число замещённых значений, которые ещё не удалены. Вызывается только
+    // писателем.
+    [[nodiscard]] size_t GetRetiredCount() const {
+        return retired_.size();
+    }
+
+private:
+    // Переходит в следующую эпоху, если закончились все Acquire, начатые в
+    // эпохе перед текущей: новые Acquire считаются в счётчике другой
+    // чётности, поэтому он обнуляется, даже когда читатели не
+    // останавливаются. Узел, замещённый в эпохе e, достижим только для
+    // Acquire, которые прочитали эпоху не позже e; после перехода в эпоху
+    // e + 2 таких не остаётся, и узел удаляется, как только на него нет
+    // ссылок.
+    void Reclaim() {
+        std::uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+        if (acquiring_[(epoch + 1) % 2].load(std::memory_order_seq_cst) == 0) {
+            epoch_.store(++epoch, std::memory_order_seq_cst);
+        }
+        size_t kept = 0;
+        for (auto& node : retired_) {
+            if (node->retired_epoch + 2 > epoch || node->references.load(std::memory_order_acquire) != 0) {
+                retired_[kept++] = std::move(node);
+            }
+        }
+        retired_.resize(kept);
+    }
+
+    std::atomic<Node*> current_{nullptr};
+    std::atomic<std::uint64_t> epoch_{0};
+    // Acquire, которые ещё не взяли ссылку, по чётности прочитанной эпохи
+    mutable std::array<std::atomic<size_t>, 2> acquiring_{};
+    // текущее значение и замещённые, на которые ещё могут быть ссылки
+    std::unique_ptr<Node> owned_;
+    std::vector<std::unique_ptr<Node>> retired_;
+};
@@ -0,0 +1,123 @@
+#pragma once
+#include "common.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Индекс прямоугольников листа: по позиции находит значения всех
+// прямоугольников, которые её содержат. Строки и столбцы листа устроены как
+// деревья отрезков: прямоугольник раскладывается на канонические отрезки
+// столбцов и строк, и значение кладётся в каждую их пару. У прямоугольника
+// не больше 2 log C отрезков столбцов и 2 log R отрезков строк, поэтому
+// память растёт с числом прямоугольников, а не с их площадью. Позицию
+// содержат только пары её предков в обоих деревьях, их просматривает запрос.
+template <typename T>
+class RangeIndex {
+public:
+    // Добавляет прямоугольник range со значением value. Одинаковые записи
+    // хранятся по отдельности.
+    void Insert(Range range, T value) {
+        if (columns_.empty()) {
+            columns_.resize(2 * COLS);
+        }
+        ForEachBlock(range, [this, &value](std::uint32_t column, std::uint32_t row) {
+            auto& node = columns_[column];
+            if (!node) {
+                node = std::make_unique<Column>();
+            }
+            node->rows[row].push_back(value);
+        });
+        ++size_;
+    }
+
+    // Удаляет одну запись, добавленную Insert с теми же аргументами.
+    void Erase(Range range, T value) {
+        ForEachBlock(range, [this, &value](std::uint32_t column, std::uint32_t row) {
+            auto& node = columns_[column];
+            const auto it = node->rows.find(row);
+            auto& values = it->second;
+            *std::find(values.begin(), values.end(), value) = values.back();
+            values.pop_back();
+            if (values.empty()) {
+                node->rows.erase(it);
+                if (node->rows.empty()) {
+                    node.reset();
+                }
+            }
+        });
+        --size_;
+    }
+
+    // Вызывает func(value) для каждой записи, прямоугольник которой
+    // содержит pos.
+    template <typename Func>
+    void ForEachContaining(Position pos, Func func) const {
+        if (size_ == 0) {
+            return;
+        }
+        for (auto column = static_cast<std::uint32_t>(COLS + pos.col); column > 0; column >>= 1) {
+            const Column* node = columns_[column].get();
+            if (node == nullptr) {
+                continue;
+            }
+            for (auto row = static_cast<std::uint32_t>(ROWS + pos.row); row > 0; row >>= 1) {
+                const auto it = node->rows.find(row);
+                if (it != node->rows.end()) {
+                    for (const T& value : it->second) {
+                        func(value);
+                    }
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] size_t Size() const {
+        return size_;
+    }
+
+    [[nodiscard]] bool Empty() const {
+        return size_ == 0;
+    }
+
+private:
+    static constexpr std::uint32_t ROWS = Position::MAX_ROWS;
+    static constexpr std::uint32_t COLS = Position::MAX_COLS;
+
+    // Записи, отрезок столбцов которых - один узел дерева столбцов, по
+    // узлам дерева строк.
+    struct Column {
+        std::unordered_map<std::uint32_t, std::vector<T>> rows;
+    };
+
+    template <typename Func>
+    static void ForEachBlock(Range range, Func func) {
+        ForEachSegment(range.first.col, range.last.col, COLS, [&func, range](std::uint32_t column) {
+            ForEachSegment(range.first.row, range.last.row, ROWS, [&func, column](std::uint32_t row) {
+                func(column, row);
+            });
+        });
+    }
+
+    // Узлы дерева отрезков над size листьями, которые вместе покрывают
+    // отрезок [first, last]. Узел i - родитель узлов 2i и 2i + 1, лист
+    // позиции p - узел size + p.
+    template <typename Func>
+    static void ForEachSegment(int first, int last, std::uint32_t size, Func func) {
+        auto lhs = static_cast<std::uint32_t>(first) + size;
+        auto rhs = static_cast<std::uint32_t>(last) + size + 1;
+        for (; lhs < rhs; lhs >>= 1, rhs >>= 1) {
+            if (lhs & 1) {
+                func(lhs++);
+            }
+            if (rhs & 1) {
+                func(--rhs);
+            }
+        }
+    }
+
+    // узлы дерева столбцов, выделяются при первой записи
+    std::vector<std::unique_ptr<Column>> columns_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,127 @@
+#include "range_summaries.h"
+#include <cassert>
+#include <cmath>
+
+RangeSummaries::RangeSummaries() = default;
+RangeSummaries::~RangeSummaries() = default;
+
+RangeSummaries::Summary::Summary(Range range)
+    : range(range) {}
+
+size_t RangeSummaries::RangeHash::operator()(Range range) const {
+    // координаты укладываются в 14 бит каждая
+    const auto first = static_cast<std::uint64_t>(range.first.row) << 14 | static_cast<std::uint64_t>(range.first.col);
+    const auto last = static_cast<std::uint64_t>(range.last.row) << 14 | static_cast<std::uint64_t>(range.last.col);
+    return std::hash<std::uint64_t>{}(first << 28 | last);
+}
+
+void RangeSummaries::Add(Range range) {
+    auto& summary = summaries_[range];
+    if (!summary) {
+        summary = std::make_unique<Summary>(range);
+        index_.Insert(range, summary.get());
+    }
+    ++summary->formula_count;
+}
+
+void RangeSummaries::Remove(Range range) {
+    const auto it = summaries_.find(range);
+    if (--it->second->formula_count == 0) {
+        index_.Erase(range, it->second.get());
+        summaries_.erase(it);
+    }
+}
+
+RangeSummaries::Summary* RangeSummaries::FindSummary(Range range) const {
+    const auto it = summaries_.find(range);
+    return it != summaries_.end() ? it->second.get() : nullptr;
+}
+
+std::optional<RangeSummary> RangeSummaries::Find(Range range, bool with_extrema) const {
+    Summary* summary = FindSummary(range);
+    if (summary == nullptr) {
+        return std::nullopt;
+    }
+    std::lock_guard lock(summary->mutex);
+    if (!summary->valid || (with_extrema && !summary->has_extrema)) {
+        return std::nullopt;
+    }
+    RangeSummary result = summary->summary;
+    if (with_extrema && !summary->numbers.empty()) {
+        result.min = *summary->numbers.begin();
+        result.max = *summary->numbers.rbegin();
+    }
+    return result;
+}
+
+void RangeSummaries::Store(Range range, const RangeSummary& summary, const std::vector<double>& values,
+                           bool with_extrema) const {
+    Summary* stored = FindSummary(range);
+    if (stored == nullptr) {
+        return;
+    }
+    std::lock_guard lock(stored->mutex);
+    stored->valid = true;
+    stored->summary.sum = summary.sum;
+    stored->summary.count = summary.count;
+    stored->updates = 0;
+    stored->has_extrema = with_extrema;
+    stored->numbers.clear();
+    if (with_extrema) {
+        stored->numbers.insert(values.begin(), values.end());
+    }
+}
+
+bool RangeSummaries::IsValid(Range range) const {
+    Summary* summary = FindSummary(range);
+    if (summary == nullptr) {
+        return false;
+    }
+    std::lock_guard lock(summary->mutex);
+    return summary->valid;
+}
+
+void RangeSummaries::Update(Position pos, std::optional<double> old_value, std::optional<double> new_value) {
+    if (old_value == new_value) {
+        return;
+    }
+    index_.ForEachContaining(pos, [old_value, new_value](Summary* summary) {
+        if (!summary->valid) {
+            return;
+        }
+        RangeSummary& totals = summary->summary;
+        if (old_value) {
+            totals.sum -= *old_value;
+            --totals.count;
+        }
+        if (new_value) {
+            totals.sum += *new_value;
+            ++totals.count;
+        }
+        if (summary->has_extrema) {
+            if (old_value) {
+                const auto it = summary->numbers.find(*old_value);
+                assert(it != summary->numbers.end());
+                summary->numbers.erase(it);
+            }
+            if (new_value) {
+                summary->numbers.insert(*new_value);
+            }
+        }
+        // поправки копят ошибку округления, поэтому, когда их набирается
+        // столько же, сколько ячеек в диапазоне, сводка считается заново:
+        // в среднем правка всё равно обходится в O(1)
+        const Range range = summary->range;
+        const auto area = static_cast<size_t>(range.last.row - range.first.row + 1)
+                          * static_cast<size_t>(range.last.col - range.first.col + 1);
+        if (!std::isfinite(totals.sum) || ++summary->updates > area) {
+            summary->valid = false;
+        }
+    });
+}
+
+void RangeSummaries::Invalidate(Position pos) {
+    index_.ForEachContaining(pos, [](Summary* summary) {
+        summary->valid = false;
+    });
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "common.h"
+#include "range_index.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// Сводки диапазонов, на которые ссылаются формулы листа. Сводка считается
+// при первом чтении, а дальше правка числа в диапазоне меняет её на
+// разность: SUM, COUNT и AVERAGE не перечитывают диапазон. Минимум и
+// максимум держит упорядоченное мультимножество чисел диапазона, которое
+// строится при первом чтении MIN или MAX. Если меняется значение формулы
+// в диапазоне, нового значения ещё нет, и сводка сбрасывается целиком.
+// Актуальная сводка означает, что все формулы её диапазона вычислены.
+// Find и Store можно вызывать из нескольких потоков сразу, остальные
+// методы - только когда сводки никто не читает.
+class RangeSummaries {
+public:
+    RangeSummaries();
+    ~RangeSummaries();
+
+    // Формула начинает и перестаёт ссылаться на range. Сводка хранится,
+    // пока на диапазон ссылается хотя бы одна формула.
+    void Add(Range range);
+    void Remove(Range range);
+
+    // Актуальная сводка range, с минимумом и максимумом, если with_extrema,
+    // или nullopt, если её нет.
+    [[nodiscard]] std::optional<RangeSummary> Find(Range range, bool with_extrema) const;
+    // Запоминает сводку range, посчитанную заново по его числам values.
+    // Сводки диапазонов, на которые формулы не ссылаются, не хранятся.
+    void Store(Range range, const RangeSummary& summary, const std::vector<double>& values,
+               bool with_extrema) const;
+    [[nodiscard]] bool IsValid(Range range) const;
+
+    // Число в pos сменилось с old_value на new_value; nullopt - ячейка,
+    // которую функции пропускают.
+    void Update(Position pos, std::optional<double> old_value, std::optional<double> new_value);
+    // Значение в pos ещё не известно: сводки с этой позицией сбрасываются.
+    void Invalidate(Position pos);
+
+private:
+    struct Summary {
+        explicit Summary(Range range);
+
+        Range range;
+        size_t formula_count = 0;
+        std::mutex mutex;
+        bool valid = false;
+        bool has_extrema = false;
+        RangeSummary summary;
+        std::multiset<double> numbers;
+        // поправок на разность с последнего полного подсчёта
+        size_t updates = 0;
+    };
+
+    struct RangeHash {
+        size_t operator()(Range range) const;
+    };
+
+    Summary* FindSummary(Range range) const;
+
+    std::unordered_map<Range, std::unique_ptr<Summary>, RangeHash> summaries_;
+    RangeIndex<Summary*> index_;
+};
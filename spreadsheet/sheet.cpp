@@ -1,110 +1,889 @@
 #include "sheet.h"
 #include "cell.h"
 #include "common.h"
+#include "thread_pool.h"
+#include "workbook.h"
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
 #include <iostream>
 #include <optional>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 
 using namespace std::literals;
 
+namespace {
+
+    // Буфер вывода: текст копится в памяти потока и уходит в output крупными
+    // кусками. Память буфера переиспользуется между вызовами.
+    class OutputBuffer {
+    public:
+        explicit OutputBuffer(std::ostream& output)
+            : output_(output)
+            , buffer_(GetBuffer()) {
+            buffer_.clear();
+        }
+
+        void Write(std::string_view text) {
+            if (buffer_.size() + text.size() > CAPACITY) {
+                Flush();
+                if (text.size() > CAPACITY) {
+                    output_.write(text.data(), static_cast<std::streamsize>(text.size()));
+                    return;
+                }
+            }
+            buffer_.append(text);
+        }
+
+        void Fill(char c, size_t count) {
+            if (buffer_.size() + count > CAPACITY) {
+                Flush();
+            }
+            buffer_.append(count, c);
+        }
+
+        // Число в том же виде, что и std::ostream с precision знаками
+        // по умолчанию (%g).
+        void WriteNumber(double value, int precision) {
+            char chars[128];
+            const auto [end, error] = std::to_chars(chars, chars + sizeof(chars), value,
+                                                    std::chars_format::general, precision);
+            if (error == std::errc{}) {
+                Write(std::string_view(chars, end - chars));
+            } else {
+                std::ostringstream fallback;
+                fallback.precision(precision);
+                fallback << value;
+                Write(fallback.str());
+            }
+        }
+
+        void Flush() {
+            output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+            buffer_.clear();
+        }
+
+    private:
+        static constexpr size_t CAPACITY = size_t{1} << 16;
+
+        static std::string& GetBuffer() {
+            thread_local std::string buffer = [] {
+                std::string result;
+                result.reserve(CAPACITY);
+                return result;
+            }();
+            return buffer;
+        }
+
+        std::ostream& output_;
+        std::string& buffer_;
+    };
+
+    // Печатает прямоугольник size с левым верхним углом top_left: строки
+    // разделены '\n', ячейки - '\t'. Ячейки перебираются напрямую из
+    // хранилища, пустые места заполняются разделителями без поиска.
+    template <typename WriteCell>
+    void PrintArea(const TiledStorage<Cell>& cells, std::ostream& output, Position top_left, Size size,
+                   WriteCell write_cell) {
+        if (!top_left.IsValid() || size.rows < 0 || size.cols < 0
+            || size.rows > Position::MAX_ROWS - top_left.row || size.cols > Position::MAX_COLS - top_left.col) {
+            throw InvalidPositionException("Invalid position exception.");
+        }
+        if (size.rows == 0 || size.cols == 0) {
+            return;
+        }
+        OutputBuffer buffer(output);
+        int row = 0;   // строка, которая печатается сейчас
+        int tabs = 0;  // сколько разделителей в ней уже напечатано
+        auto finish_row = [&buffer, &tabs, size] {
+            buffer.Fill('\t', size.cols - 1 - tabs);
+            buffer.Fill('\n', 1);
+            tabs = 0;
+        };
+        const Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+        cells.ForEachIn(top_left, bottom_right, [&](Position pos, const Cell& cell) {
+            for (; row < pos.row - top_left.row; ++row) {
+                finish_row();
+            }
+            const int col = pos.col - top_left.col;
+            buffer.Fill('\t', col - tabs);
+            tabs = col;
+            write_cell(buffer, cell);
+        });
+        for (; row < size.rows; ++row) {
+            finish_row();
+        }
+        buffer.Flush();
+    }
+
+    // Совпадают ли значения так, как их видно при печати: -0 и 0 печатаются
+    // по-разному, поэтому и здесь различаются.
+    template <typename Value>
+    bool IsSameValue(const Value& lhs, const Value& rhs) {
+        if (const double* lhs_number = std::get_if<double>(&lhs)) {
+            const double* rhs_number = std::get_if<double>(&rhs);
+            return rhs_number != nullptr && *lhs_number == *rhs_number
+                && std::signbit(*lhs_number) == std::signbit(*rhs_number);
+        }
+        return lhs == rhs;
+    }
+
+}  // namespace
+
+Sheet::Sheet() = default;
 Sheet::~Sheet() = default;
 
 void Sheet::SetCell(Position pos, std::string text) {
     if(!pos.IsValid()) {
         throw InvalidPositionException("Invalid position exception.");
     }
-    bool isFound = text.substr(1).find(pos.ToString()) != std::string::npos;
-    if(isFound) {
-        throw CircularDependencyException("Circular dependency exception.");
+    std::optional<CellInterface::Value> old_value;
+    if (!listeners_.empty()) {
+        old_value = GetValueBeforeEdit(pos);
+    }
+    Cell* cell = cells_.Find(pos);
+    const bool created = cell == nullptr;
+    if (created) {
+        cell = &cells_.Emplace(pos, *this, pos);
+    }
+    const bool was_empty = cell->IsEmpty();
+    try {
+        cell->Set(*this, std::move(text));
+    } catch (...) {
+        if (created && !cell->IsReferenced()) {
+            cells_.Erase(pos);
+        }
+        throw;
+    }
+    UpdateOccupancy(pos, was_empty, cell->IsEmpty());
+    if (!listeners_.empty()) {
+        edited_.emplace_back(pos, std::move(old_value));
+    }
+    FinishEdit();
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position exception.");
+        }
     }
-    if (!cells_.count(pos)) {
-        cells_.emplace(pos, std::make_unique<Cell>(*this));
+    // по черновику на ячейку, из нескольких правок одной ячейки действует
+    // последняя, как при SetCell по очереди
+    BatchGraph graph;
+    std::vector<Cell::Draft> drafts;
+    drafts.reserve(cells.size());
+    graph.nodes.reserve(cells.size());
+    for (auto& [pos, text] : cells) {
+        Cell::Draft draft = Cell::MakeDraft(*this, pos, std::move(text));
+        if (const uint32_t* id = graph.ids.Find(pos)) {
+            drafts[*id] = std::move(draft);
+        } else {
+            graph.ids.Emplace(pos, static_cast<uint32_t>(graph.nodes.size()));
+            graph.nodes.push_back(pos);
+            drafts.push_back(std::move(draft));
+        }
     }
-    cells_.at(pos)->Set(std::move(text));
+    ApplyDrafts(graph, drafts);
+    FinishEdit();
+}
+
+void Sheet::ApplyDrafts(BatchGraph& graph, std::vector<Cell::Draft>& drafts) {
+    const std::vector<uint32_t> rank = RankBatch(graph, drafts);
+    if (workbook_ != nullptr) {
+        std::vector<std::pair<Position, const FormulaAST*>> edits;
+        edits.reserve(drafts.size());
+        for (size_t node = 0; node < drafts.size(); ++node) {
+            edits.emplace_back(graph.nodes[node], drafts[node].GetFormulaAST());
+        }
+        if (ClosesSheetCycle(edits)) {
+            throw CircularDependencyException("Circular dependency exception.");
+        }
+    }
+
+    // дальше лист меняется и исключений, кроме нехватки памяти, нет
+    if (!listeners_.empty()) {
+        for (size_t node = 0; node < drafts.size(); ++node) {
+            edited_.emplace_back(graph.nodes[node], GetValueBeforeEdit(graph.nodes[node]));
+        }
+    }
+    const std::int64_t first_order = back_order_ + 1;
+    back_order_ += static_cast<std::int64_t>(graph.nodes.size());
+    for (size_t node = 0; node < drafts.size(); ++node) {
+        const Position pos = graph.nodes[node];
+        Cell& cell = cells_.Emplace(pos, *this, pos);
+        const bool was_empty = cell.IsEmpty();
+        cell.Apply(*this, std::move(drafts[node]));
+        cell.SetOrder(first_order + rank[node]);
+        cell.CacheInvalidate(*this, true);
+        UpdateOccupancy(pos, was_empty, cell.IsEmpty());
+    }
+    for (size_t node = drafts.size(); node < graph.nodes.size(); ++node) {
+        cells_.Find(graph.nodes[node])->SetOrder(first_order + rank[node]);
+    }
+}
+
+// Цикл, замкнутый пакетом, проходит через изменённую ячейку, поэтому лежит
+// среди изменённых ячеек и их зависимых. По ним проходит алгоритм Кана:
+// ячейки, которые не удалось упорядочить, лежат на цикле.
+std::vector<uint32_t> Sheet::RankBatch(BatchGraph& graph, const std::vector<Cell::Draft>& drafts) const {
+    auto& [ids, nodes] = graph;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        auto add_dependent = [&ids, &nodes](const Cell* dependent) {
+            const Position pos = dependent->GetPosition();
+            if (ids.Find(pos) == nullptr) {
+                ids.Emplace(pos, static_cast<uint32_t>(nodes.size()));
+                nodes.push_back(pos);
+            }
+        };
+        // на позицию, где ячейки ещё нет, могут ссылаться диапазоны
+        if (const Cell* cell = cells_.Find(nodes[i])) {
+            for (const Cell* dependent : cell->GetCalculatedCells()) {
+                add_dependent(dependent);
+            }
+        }
+        range_dependents_.ForEachContaining(nodes[i], add_dependent);
+    }
+
+    // аргументы ячейки: из новой формулы, если она в пакете, иначе текущие;
+    // из диапазона - все ячейки пакета, которые в нём лежат
+    auto for_each_argument = [&](uint32_t node, auto func) {
+        auto visit_cell = [&ids, &func](Position pos) {
+            if (const uint32_t* id = ids.Find(pos)) {
+                func(*id);
+            }
+        };
+        auto visit_range = [&ids, &func](Range range) {
+            ids.ForEachIn(range.first, range.last, [&func](Position, uint32_t id) {
+                func(id);
+            });
+        };
+        if (node < drafts.size()) {
+            for (const Position pos : drafts[node].GetReferencedCells()) {
+                visit_cell(pos);
+            }
+            for (const Range range : drafts[node].GetReferencedRanges()) {
+                visit_range(range);
+            }
+        } else {
+            const Cell* cell = cells_.Find(nodes[node]);
+            for (const Cell* used : cell->GetUsedCells()) {
+                visit_cell(used->GetPosition());
+            }
+            if (const FormulaAST* ast = cell->GetFormulaAST()) {
+                ast->ForEachRange(cell->GetPosition(), visit_range);
+            }
+        }
+    };
+    // рёбра аргумент -> зависимая ячейка в виде смежных отрезков одного массива
+    const auto node_count = static_cast<uint32_t>(nodes.size());
+    std::vector<uint32_t> pending(node_count, 0);
+    std::vector<uint32_t> first_edge(node_count + 1, 0);
+    for (uint32_t node = 0; node < node_count; ++node) {
+        for_each_argument(node, [&](uint32_t argument) {
+            ++pending[node];
+            ++first_edge[argument + 1];
+        });
+    }
+    for (uint32_t node = 0; node < node_count; ++node) {
+        first_edge[node + 1] += first_edge[node];
+    }
+    std::vector<uint32_t> dependents(first_edge.back());
+    std::vector<uint32_t> next_edge(first_edge.begin(), first_edge.end() - 1);
+    for (uint32_t node = 0; node < node_count; ++node) {
+        for_each_argument(node, [&](uint32_t argument) {
+            dependents[next_edge[argument]++] = node;
+        });
+    }
+
+    std::vector<uint32_t> ready;
+    for (uint32_t node = 0; node < node_count; ++node) {
+        if (pending[node] == 0) {
+            ready.push_back(node);
+        }
+    }
+    std::vector<uint32_t> rank(node_count);
+    uint32_t ranked = 0;
+    while (!ready.empty()) {
+        const uint32_t node = ready.back();
+        ready.pop_back();
+        rank[node] = ranked++;
+        for (uint32_t edge = first_edge[node]; edge < first_edge[node + 1]; ++edge) {
+            if (--pending[dependents[edge]] == 0) {
+                ready.push_back(dependents[edge]);
+            }
+        }
+    }
+    if (ranked != node_count) {
+        throw CircularDependencyException("Circular dependency exception.");
+    }
+    return rank;
 }
 
 const Cell* Sheet::GetCell(Position pos) const {
     if(!pos.IsValid()) {
         throw InvalidPositionException("Invalid position exception.");
     }
-    return cells_.count(pos) ? cells_.at(pos).get() : nullptr;
+    return cells_.Find(pos);
 }
 
 Cell* Sheet::GetCell(Position pos) {
     if(!pos.IsValid()) {
         throw InvalidPositionException("Invalid position exception.");
     }
-    return cells_.count(pos) ? cells_.at(pos).get() : nullptr;
+    return cells_.Find(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     if(!pos.IsValid()) {
         throw InvalidPositionException("Invalid position exception.");
     }
-    cells_.erase(pos);
+    Cell* cell = cells_.Find(pos);
+    if (cell == nullptr) {
+        return;
+    }
+    if (!listeners_.empty()) {
+        edited_.emplace_back(pos, GetValueBeforeEdit(pos));
+    }
+    const bool was_empty = cell->IsEmpty();
+    cell->Clear(*this);
+    UpdateOccupancy(pos, was_empty, true);
+    // на ячейку ссылаются формулы - она остаётся в таблице пустой
+    if (!cell->IsReferenced()) {
+        cells_.Erase(pos);
+    }
+    FinishEdit();
 }
 
 Size Sheet::GetPrintableSize() const {
-    if(cells_.empty()) {
-        return Size{0, 0};
-    }
-    auto [left_top_point, right_bottom_point] = GetUseableArea();
-    return Size{right_bottom_point.row - left_top_point.row + 1, right_bottom_point.col - left_top_point.col + 1};
+    return Size{rows_.Extent(), cols_.Extent()};
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    if(cells_.empty()) {
+    PrintValues(output, Position{0, 0}, GetPrintableSize());
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintTexts(output, Position{0, 0}, GetPrintableSize());
+}
+
+CellInterface::NumericValue Sheet::GetNumericValue(Position pos) const {
+    if (const auto value = values_.Find(pos)) {
+        return *value;
+    }
+    // устаревшее значение есть только у формулы
+    return cells_.Find(pos)->GetNumericValue();
+}
+
+void Sheet::GetNumericValues(Range range, std::vector<double>& values) const {
+    CalculateStale(range);
+    values_.GetNumbers(range, values);
+}
+
+RangeSummary Sheet::GetRangeSummary(Range range, bool with_extrema) const {
+    if (const auto summary = range_summaries_.Find(range, with_extrema)) {
+        return *summary;
+    }
+    if (!with_extrema) {
+        CalculateStale(range);
+        const RangeSummary summary = values_.Summarize(range);
+        range_summaries_.Store(range, summary, {}, false);
+        return summary;
+    }
+    thread_local std::vector<double> buffer;
+    std::vector<double> values = std::move(buffer);
+    values.clear();
+    GetNumericValues(range, values);
+    const RangeSummary summary = Summarize(values, with_extrema);
+    range_summaries_.Store(range, summary, values, with_extrema);
+    buffer = std::move(values);
+    return summary;
+}
+
+void Sheet::CalculateStale(Range range) const {
+    if (!values_.HasStale(range)) {
         return;
     }
-    auto [left_top_point, right_bottom_point] = GetUseableArea();
-    for(int row = left_top_point.row; row <= right_bottom_point.row; ++row) {
-        for(int col = left_top_point.col; col <= right_bottom_point.col; ++col) {
-            if(col > 0) {
-                output << '\t';
-            }
-            auto cell = GetCell(Position{row, col});
-            if(cell != nullptr) {
-                std::visit([&output](const auto value) {
-                    output << value;
-                }, cell->GetValue());
+    cells_.ForEachIn(range.first, range.last, [](Position, const Cell& cell) {
+        if (!cell.IsCalculated()) {
+            cell.GetNumericValue();
+        }
+    });
+}
+
+void Sheet::FinishEdit() {
+    if (workbook_ != nullptr) {
+        workbook_->FinishEdit();
+    } else {
+        CalculateMarked();
+    }
+}
+
+void Sheet::CalculateMarked() {
+    // формула вычисляется вместе с устаревшими аргументами, поэтому
+    // те из них, что тоже помечены, к своей очереди уже вычислены
+    for (const Marked& marked : marked_) {
+        if (!marked.cell->IsCalculated()) {
+            marked.cell->GetNumericValue();
+        }
+    }
+    if (listeners_.empty()) {
+        marked_.clear();
+        return;
+    }
+    std::vector<Position> changed;
+    std::vector<Position> edited;
+    for (const auto& [pos, old_value] : edited_) {
+        const Cell* cell = cells_.Find(pos);
+        const CellInterface::Value value = cell != nullptr ? cell->GetValue() : CellInterface::Value(std::string());
+        if (!old_value || !IsSameValue(*old_value, value)) {
+            changed.push_back(pos);
+        }
+        edited.push_back(pos);
+    }
+    // изменённая ячейка с формулой помечена и сама, но её старое значение
+    // к тому времени уже стёрто; она сравнена выше
+    std::sort(edited.begin(), edited.end());
+    for (const auto& [cell, old_value] : marked_) {
+        const Position pos = cell->GetPosition();
+        if ((!old_value || !IsSameValue(*old_value, cell->GetNumericValue()))
+            && !std::binary_search(edited.begin(), edited.end(), pos)) {
+            changed.push_back(pos);
+        }
+    }
+    marked_.clear();
+    edited_.clear();
+    if (!changed.empty()) {
+        std::sort(changed.begin(), changed.end());
+        Notify(changed);
+    }
+}
+
+std::optional<CellInterface::Value> Sheet::GetValueBeforeEdit(Position pos) const {
+    const Cell* cell = cells_.Find(pos);
+    if (cell == nullptr) {
+        return CellInterface::Value(std::string());
+    }
+    if (!cell->IsCalculated()) {
+        return std::nullopt;
+    }
+    return cell->GetValue();
+}
+
+void Sheet::Notify(const std::vector<Position>& changed) const {
+    for (size_t i = 0; i < listeners_.size(); ++i) {
+        listeners_[i].second(changed);
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output, Position top_left, Size size) const {
+    const int precision = static_cast<int>(output.precision());
+    PrintArea(cells_, output, top_left, size, [precision](OutputBuffer& buffer, const Cell& cell) {
+        std::visit([&buffer, precision](const auto& value) {
+            using T = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<T, double>) {
+                buffer.WriteNumber(value, precision);
+            } else if constexpr (std::is_same_v<T, FormulaError>) {
+                buffer.Write(value.ToString());
+            } else {
+                buffer.Write(value);
             }
-        } output << '\n';
+        }, cell.GetValueView());
+    });
+}
+
+void Sheet::PrintTexts(std::ostream& output, Position top_left, Size size) const {
+    std::string formula;
+    PrintArea(cells_, output, top_left, size, [&formula](OutputBuffer& buffer, const Cell& cell) {
+        buffer.Write(cell.GetTextView(formula));
+    });
+}
+
+std::pair<Position, Position> Sheet::GetUseableArea() const {
+    Position LeftTopPos, RightBottomPos;
+    RightBottomPos.row = std::max(rows_.Extent() - 1, 0);
+    RightBottomPos.col = std::max(cols_.Extent() - 1, 0);
+    return std::make_pair(LeftTopPos, RightBottomPos);
+}
+
+FormulaTable& Sheet::GetFormulaTable() {
+    return formulas_;
+}
+
+const FormulaTable& Sheet::GetFormulaTable() const {
+    return formulas_;
+}
+
+std::int64_t Sheet::NewFrontOrder() {
+    return --front_order_;
+}
+
+std::int64_t Sheet::NewBackOrder() {
+    return ++back_order_;
+}
+
+Cell& Sheet::GetOrCreateCell(Position pos) {
+    return cells_.Emplace(pos, *this, pos);
+}
+
+void Sheet::MarkStale(const Cell& cell) {
+    const Position pos = cell.GetPosition();
+    if (calculation_mode_ == CalculationMode::Eager || !listeners_.empty()) {
+        marked_.push_back({&cell, values_.Find(pos)});
     }
+    values_.SetStale(pos);
+    range_summaries_.Invalidate(pos);
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    if(cells_.empty()) {
+void Sheet::AddRangeDependency(Range range, Cell* cell) {
+    range_dependents_.Insert(range, cell);
+    range_summaries_.Add(range);
+}
+
+void Sheet::RemoveRangeDependency(Range range, Cell* cell) {
+    range_dependents_.Erase(range, cell);
+    range_summaries_.Remove(range);
+}
+
+void Sheet::AddSheetDependency(std::string_view sheet_name, Range range, Cell* cell) {
+    if (workbook_ != nullptr) {
+        workbook_->AddDependency(*this, sheet_name, range, cell);
+    }
+}
+
+void Sheet::RemoveSheetDependency(std::string_view sheet_name, Range range, Cell* cell) {
+    if (workbook_ != nullptr) {
+        workbook_->RemoveDependency(*this, sheet_name, range, cell);
+    }
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ != nullptr ? workbook_->GetSheet(name) : nullptr;
+}
+
+Sheet* Sheet::FindWorkbookSheet(std::string_view name) {
+    return workbook_ != nullptr ? workbook_->GetSheet(name) : nullptr;
+}
+
+bool Sheet::ClosesSheetCycle(Position pos, const FormulaAST* ast) {
+    if (workbook_ == nullptr || ast == nullptr) {
+        return false;
+    }
+    return workbook_->ClosesCycle(*this, {{pos, ast}});
+}
+
+bool Sheet::ClosesSheetCycle(const std::vector<std::pair<Position, const FormulaAST*>>& edits) {
+    return workbook_ != nullptr && workbook_->ClosesCycle(*this, edits);
+}
+
+void Sheet::InvalidateSheetDependents() {
+    if (workbook_ != nullptr) {
+        workbook_->InvalidateReferencesTo(workbook_->GetEntry(*this).name);
+        workbook_->FinishEdit();
+    }
+}
+
+void Sheet::UpdateRangeSummaries(Position pos, std::optional<double> old_value, std::optional<double> new_value) {
+    range_summaries_.Update(pos, old_value, new_value);
+}
+
+void Sheet::InvalidateRangeSummaries(Position pos) {
+    range_summaries_.Invalidate(pos);
+}
+
+TextPool& Sheet::GetTexts() {
+    return texts_;
+}
+
+ValueStore& Sheet::GetValues() {
+    return values_;
+}
+
+const ValueStore& Sheet::GetValues() const {
+    return values_;
+}
+
+bool Sheet::IsInReferencedRange(Position pos) const {
+    bool found = false;
+    range_dependents_.ForEachContaining(pos, [&found](const Cell*) {
+        found = true;
+    });
+    return found;
+}
+
+void Sheet::Recalculate(size_t thread_count) {
+    if (thread_count <= 1) {
+        RecalculateIn(nullptr);
         return;
     }
-    auto [left_top_point, right_bottom_point] = GetUseableArea();
-    for(int row = left_top_point.row; row <= right_bottom_point.row; ++row) {
-        for(int col = left_top_point.col; col <= right_bottom_point.col; ++col) {
-            if(col > 0) {
-                output << '\t';
+    if (!pool_ || pool_->GetThreadCount() != thread_count) {
+        pool_ = std::make_unique<WorkStealingPool>(thread_count);
+    }
+    RecalculateIn(pool_.get());
+}
+
+void Sheet::Recalculate(WorkStealingPool& pool) {
+    RecalculateIn(&pool);
+}
+
+void Sheet::RecalculateIn(WorkStealingPool* pool) {
+    // устаревшие формулы и число их ещё не вычисленных аргументов; их
+    // позиции знает хранилище значений
+    std::vector<Position> positions;
+    values_.GetStale(positions);
+    if (positions.empty()) {
+        return;
+    }
+    std::vector<const Cell*> stale;
+    std::unordered_map<const Cell*, size_t> index;
+    stale.reserve(positions.size());
+    for (const Position pos : positions) {
+        const Cell* cell = cells_.Find(pos);
+        index.emplace(cell, stale.size());
+        stale.push_back(cell);
+    }
+    std::unique_ptr<std::atomic<size_t>[]> pending(new std::atomic<size_t>[stale.size()]);
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < stale.size(); ++i) {
+        size_t count = 0;
+        ForEachStaleDependency(*stale[i], [&index, &count](const Cell* used) {
+            count += !used->IsCalculated() && index.count(used) > 0;
+        });
+        pending[i].store(count, std::memory_order_relaxed);
+        if (count == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    // аргументы ячейки уже вычислены, поэтому GetNumericValue считает только
+    // её саму; после этого она освобождает зависящие от неё формулы
+    auto calculate = [this, &stale, &index, &pending](size_t i, auto&& on_ready) {
+        stale[i]->GetNumericValue();
+        ForEachDependent(*stale[i], [&index, &pending, &on_ready](const Cell* dependent) {
+            const size_t dependent_index = index.at(dependent);
+            if (pending[dependent_index].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                on_ready(dependent_index);
             }
-            auto cell = GetCell(Position{row, col});
-            if(cell != nullptr) {
-                output << cell->GetText();
+        });
+    };
+
+    if (pool == nullptr) {
+        while (!ready.empty()) {
+            const size_t i = ready.back();
+            ready.pop_back();
+            calculate(i, [&ready](size_t dependent) {
+                ready.push_back(dependent);
+            });
+        }
+        return;
+    }
+
+    // задача продолжает цепочку сама: первую освободившуюся формулу
+    // считает тот же поток, остальные уходят в пул
+    std::function<void(size_t)> submit = [pool, &calculate, &submit](size_t first) {
+        pool->Submit([&calculate, &submit, first] {
+            constexpr size_t none = static_cast<size_t>(-1);
+            size_t next = first;
+            while (next != none) {
+                const size_t i = std::exchange(next, none);
+                calculate(i, [&next, &submit](size_t dependent) {
+                    if (next != none) {
+                        submit(dependent);
+                    } else {
+                        next = dependent;
+                    }
+                });
             }
-        } output << '\n';
+        });
+    };
+    for (size_t i : ready) {
+        submit(i);
     }
+    pool->Wait();
 }
 
-std::pair<Position, Position> Sheet::GetUseableArea() const {
-    Position LeftTopPos, RightBottomPos;
-    if(!cells_.empty()) {
-        for (const auto& [pos, cell] : cells_) {
-            if (cell != nullptr) {
-                RightBottomPos.row = std::max(RightBottomPos.row, pos.row);
-                RightBottomPos.col = std::max(RightBottomPos.col, pos.col);
+void Sheet::Publish(size_t thread_count) {
+    Recalculate(thread_count);
+    published_.Publish(++published_count_, values_, GetPrintableSize());
+}
+
+Sheet::VersionReference Sheet::GetPublishedVersion() const {
+    return published_.Acquire();
+}
+
+Sheet::Version::Version(std::uint64_t number, const ValueStore& values, Size printable_size)
+    : number_(number), values_(values), printable_size_(printable_size) {}
+
+std::uint64_t Sheet::Version::GetNumber() const {
+    return number_;
+}
+
+Size Sheet::Version::GetPrintableSize() const {
+    return printable_size_;
+}
+
+CellInterface::NumericValue Sheet::Version::GetNumericValue(Position pos) const {
+    // устаревших значений в версии нет
+    return *values_.Find(pos);
+}
+
+void Sheet::Version::GetNumericValues(Range range, std::vector<double>& values) const {
+    values_.GetNumbers(range, values);
+}
+
+RangeSummary Sheet::Version::GetRangeSummary(Range range, bool with_extrema) const {
+    if (!with_extrema) {
+        return values_.Summarize(range);
+    }
+    std::vector<double> values;
+    values_.GetNumbers(range, values);
+    return Summarize(values, true);
+}
+
+Sheet::Checkpoint::Checkpoint(const ContentStore& contents, const ValueStore& values, Size printable_size,
+                              bool reads_sheets)
+    : contents_(contents), values_(values), printable_size_(printable_size), reads_sheets_(reads_sheets) {}
+
+Size Sheet::Checkpoint::GetPrintableSize() const {
+    return printable_size_;
+}
+
+CellInterface::NumericValue Sheet::Checkpoint::GetNumericValue(Position pos) const {
+    // устаревших значений в точке нет
+    return *values_.Find(pos);
+}
+
+std::string Sheet::Checkpoint::GetText(Position pos) const {
+    const ContentStore::Content* content = contents_.Find(pos);
+    if (content == nullptr) {
+        return {};
+    }
+    if (content->formula == nullptr) {
+        return std::string(content->text->text);
+    }
+    std::string text(1, FORMULA_SIGN);
+    content->formula->PrintFormula(text, pos);
+    return text;
+}
+
+Sheet::Checkpoint Sheet::MakeCheckpoint() {
+    Recalculate();
+    KeepContents();
+    return Checkpoint(contents_, values_, GetPrintableSize(), ReadsSheets());
+}
+
+void Sheet::Restore(const Checkpoint& checkpoint) {
+    KeepContents();
+    BatchGraph graph;
+    std::vector<Cell::Draft> drafts;
+    contents_.ForEachDifference(checkpoint.contents_, [&](Position pos, const ContentStore::Content* target) {
+        graph.ids.Emplace(pos, static_cast<uint32_t>(graph.nodes.size()));
+        graph.nodes.push_back(pos);
+        drafts.push_back(Cell::MakeRestoreDraft(*this, pos, target));
+    });
+    if (drafts.empty()) {
+        return;
+    }
+    const size_t edit_count = drafts.size();
+    ApplyDrafts(graph, drafts);
+    // содержимое листа совпало с точкой, поэтому совпали и значения
+    // формул, если они не читают другие листы ни в точке, ни здесь. Вне
+    // книги ссылки на листы не учитываются, но там они дают #REF!, и
+    // точка такого листа их не читает
+    if (!checkpoint.reads_sheets_ && !ReadsSheets()) {
+        std::vector<Position> stale;
+        values_.GetStale(stale);
+        for (const Position pos : stale) {
+            if (const auto value = checkpoint.values_.Find(pos)) {
+                values_.SetResult(pos, *value);
             }
         }
     }
-    return std::make_pair(LeftTopPos, RightBottomPos);
+    FinishEdit();
+    // помеченные за правку ячейки держатся по указателю до конца
+    // FinishEdit, поэтому опустевшие ячейки удаляются после него
+    for (size_t node = 0; node < edit_count; ++node) {
+        const Position pos = graph.nodes[node];
+        const Cell* cell = cells_.Find(pos);
+        if (cell->IsEmpty() && !cell->IsReferenced()) {
+            cells_.Erase(pos);
+        }
+    }
+}
+
+bool Sheet::ReadsSheets() const {
+    return workbook_ != nullptr && !workbook_->GetEntry(*this).references.empty();
+}
+
+void Sheet::KeepContents() {
+    if (!keeps_contents_) {
+        cells_.ForEach([this](Position, const Cell& cell) {
+            cell.StoreContent(contents_);
+        });
+        keeps_contents_ = true;
+    }
+}
+
+void Sheet::RecordContent(const Cell& cell) {
+    if (keeps_contents_) {
+        cell.StoreContent(contents_);
+    }
+}
+
+void Sheet::SetCalculationMode(CalculationMode mode) {
+    calculation_mode_ = mode;
+    if (mode == CalculationMode::Eager) {
+        Recalculate();
+    }
+}
+
+Sheet::CalculationMode Sheet::GetCalculationMode() const {
+    return calculation_mode_;
+}
+
+size_t Sheet::Subscribe(ChangeListener listener) {
+    Recalculate();
+    listeners_.emplace_back(next_listener_, std::move(listener));
+    return next_listener_++;
+}
+
+void Sheet::Unsubscribe(size_t id) {
+    listeners_.erase(std::remove_if(listeners_.begin(), listeners_.end(), [id](const auto& listener) {
+        return listener.first == id;
+    }), listeners_.end());
+}
+
+void Sheet::UpdateOccupancy(Position pos, bool was_empty, bool is_empty) {
+    if (was_empty && !is_empty) {
+        rows_.Add(pos.row);
+        cols_.Add(pos.col);
+    } else if (!was_empty && is_empty) {
+        rows_.Remove(pos.row);
+        cols_.Remove(pos.col);
+    }
+}
+
+void Sheet::Occupancy::Add(int index) {
+    if (index >= static_cast<int>(counts_.size())) {
+        counts_.resize(index + 1, 0);
+    }
+    ++counts_[index];
+}
+
+void Sheet::Occupancy::Remove(int index) {
+    --counts_[index];
+    while (!counts_.empty() && counts_.back() == 0) {
+        counts_.pop_back();
+    }
 }
 
-size_t Sheet::Hasher::operator() (const Position& pos) const {
-    return std::hash<int>()(pos.row) * 37 + std::hash<int>()(pos.col) * 37 * 37;
+int Sheet::Occupancy::Extent() const {
+    return static_cast<int>(counts_.size());
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
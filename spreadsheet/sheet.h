@@ -1,23 +1,395 @@
 #pragma once
 #include "cell.h"
 #include "common.h"
-#include <unordered_map>
+#include "content_store.h"
+#include "published.h"
+#include "range_index.h"
+#include "range_summaries.h"
+#include "text_pool.h"
+#include "tiled_storage.h"
+#include "value_store.h"
+#include <cstdint>
 #include <functional>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+class WorkStealingPool;
+class Workbook;
+
+// Лист. Методы, которые только читают (ячейки, их значения, печать,
+// сводки), можно вызывать из нескольких потоков сразу, пока лист никто не
+// правит: устаревшие формулы при этом вычисляются без блокировок. Читать
+// одновременно с правками можно опубликованные версии значений, см.
+// Publish.
 class Sheet : public SheetInterface {
 public:
+    // Когда вычисляются формулы, значения которых устарели после правки.
+    enum class CalculationMode {
+        // при первом чтении значения
+        Lazy,
+        // в конце правки: SetCell, ClearCell или пакета SetCells. Чтение
+        // значения после правки ничего не вычисляет
+        Eager,
+    };
+
+    // Получатель изменений: позиции ячеек, видимое значение которых
+    // изменилось за правку, в построчном порядке.
+    using ChangeListener = std::function<void(const std::vector<Position>& changed)>;
+
+    // Значения листа на момент Publish: все формулы вычислены, версия не
+    // меняется. С листом и другими версиями она делит плитки значений,
+    // которые с тех пор не менялись. Тексты ячеек в версию не входят.
+    class Version {
+    public:
+        Version(std::uint64_t number, const ValueStore& values, Size printable_size);
+
+        // Номер публикации, начиная с единицы.
+        [[nodiscard]] std::uint64_t GetNumber() const;
+        [[nodiscard]] Size GetPrintableSize() const;
+        // Значения по тем же правилам, что у SheetInterface: пустая ячейка
+        // - ноль, текст, который не представляет число, - #VALUE!.
+        [[nodiscard]] CellInterface::NumericValue GetNumericValue(Position pos) const;
+        void GetNumericValues(Range range, std::vector<double>& values) const;
+        [[nodiscard]] RangeSummary GetRangeSummary(Range range, bool with_extrema) const;
+
+    private:
+        std::uint64_t number_;
+        ValueStore values_;
+        Size printable_size_;
+    };
+    using VersionReference = Published<Version>::Reference;
+
+    // Точка сохранения: содержимое ячеек и их значения на момент
+    // MakeCheckpoint. Точка и её копии делят с листом плитки содержимого и
+    // значений, которые с тех пор не менялись, поэтому стоят таблицу
+    // плиток, а лист после точки платит копией только за плитки, которые
+    // правит. Точки создаются, копируются и разрушаются тем же потоком,
+    // что и правки листа, и должны быть разрушены раньше него.
+    class Checkpoint {
+    public:
+        [[nodiscard]] Size GetPrintableSize() const;
+        // Значение и текст ячейки pos на момент точки, по тем же правилам,
+        // что у листа.
+        [[nodiscard]] CellInterface::NumericValue GetNumericValue(Position pos) const;
+        [[nodiscard]] std::string GetText(Position pos) const;
+
+    private:
+        friend class Sheet;
+        Checkpoint(const ContentStore& contents, const ValueStore& values, Size printable_size, bool reads_sheets);
+
+        ContentStore contents_;
+        ValueStore values_;
+        Size printable_size_;
+        // Читают ли формулы точки другие листы книги: их значения верны
+        // только в той книге и на тот момент.
+        bool reads_sheets_;
+    };
+
+    // Формула другого листа книги, которая ссылается на ячейки этого.
+    struct SheetDependent {
+        Sheet* sheet;
+        Cell* cell;
+
+        bool operator==(const SheetDependent& other) const {
+            return sheet == other.sheet && cell == other.cell;
+        }
+    };
+
+    Sheet();
     ~Sheet() override;
     void SetCell(Position pos, std::string text) override;
+    // Записывает пакет правок так же, как SetCell по очереди, но связывает
+    // ячейки и ищет циклы один раз на весь пакет: время линейно по числу
+    // затронутых ячеек. Если позиция некорректна, формула не разбирается
+    // или правки замыкают цикл, бросает исключение и не меняет лист.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
     const Cell* GetCell(Position pos) const override;
     Cell* GetCell(Position pos) override;
     void ClearCell(Position pos) override;
     Size GetPrintableSize() const override;
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    // Читают значения из столбцов хранилища значений, не обращаясь к
+    // ячейкам. Устаревшие формулы сначала вычисляются.
+    CellInterface::NumericValue GetNumericValue(Position pos) const override;
+    // Числа идут столбец за столбцом внутри плиток хранилища значений;
+    // плитки, в которых нет значений, пропускаются целиком.
+    void GetNumericValues(Range range, std::vector<double>& values) const override;
+    // Сводки диапазонов, на которые ссылаются формулы листа, хранятся и
+    // обновляются при правках, остальные считаются заново: сумма и
+    // количество - прямо по столбцам хранилища значений.
+    RangeSummary GetRangeSummary(Range range, bool with_extrema) const override;
+    // Печатают прямоугольник размера size с левым верхним углом top_left в
+    // том же формате, что и вся печатная область. Ячейки вне печатной
+    // области печатаются пустыми. Если прямоугольник выходит за пределы
+    // таблицы, бросают InvalidPositionException.
+    void PrintValues(std::ostream& output, Position top_left, Size size) const;
+    void PrintTexts(std::ostream& output, Position top_left, Size size) const;
     std::pair<Position, Position> GetUseableArea() const;
+    // Лист книги с именем name; nullptr, если такого листа нет или лист
+    // не входит в книгу.
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    // Вычисляет все устаревшие формулы. При thread_count > 1 формулы, все
+    // аргументы которых уже вычислены, считаются параллельно в пуле потоков;
+    // результат совпадает с последовательным вычислением.
+    void Recalculate(size_t thread_count = 1);
+    // То же в пуле потоков pool, которым владеет вызывающий: книга
+    // вычисляет свои листы в одном пуле. Возвращается, когда пул пуст.
+    void Recalculate(WorkStealingPool& pool);
+    // Вычисляет устаревшие формулы, как Recalculate, и публикует значения
+    // листа новой версией. Вызывается тем же потоком, что и правки.
+    // Публикация копирует таблицу плиток значений, а не сами значения;
+    // плитка копируется, когда её впервые правят после публикации.
+    void Publish(size_t thread_count = 1);
+    // Последняя опубликованная версия или пустая ссылка, если публикаций не
+    // было. Можно вызывать из любого потока одновременно с правками и
+    // публикациями: читатель не берёт блокировок и видит версию целиком.
+    // Все ссылки должны быть отпущены до разрушения листа.
+    [[nodiscard]] VersionReference GetPublishedVersion() const;
+    // Вычисляет устаревшие формулы и запоминает лист точкой сохранения.
+    // Первая точка листа обходит все его ячейки, дальше лист сам ведёт
+    // содержимое для точек, и новая точка копирует только таблицы плиток.
+    Checkpoint MakeCheckpoint();
+    // Возвращает лист к содержимому checkpoint, например для отмены и
+    // повтора правок или переключения между вариантами расчёта. Это одна
+    // правка, как пакет SetCells, только из ячеек, содержимое которых
+    // отличается от точки: плитки, общие с точкой, не просматриваются.
+    // Значения формул берутся из точки, если ни точка, ни лист не читают
+    // другие листы книги, иначе вычисляются заново. Точка может быть взята и у другого
+    // листа, тогда лист становится его копией. Если лист в книге и
+    // возврат замкнул бы цикл через другие листы, бросает
+    // CircularDependencyException и не меняет лист.
+    void Restore(const Checkpoint& checkpoint);
+    // По умолчанию лист ленивый. Переход в жадный режим сразу вычисляет
+    // все устаревшие формулы.
+    void SetCalculationMode(CalculationMode mode);
+    [[nodiscard]] CalculationMode GetCalculationMode() const;
+    // Подписывает listener на изменения значений. Он вызывается в конце
+    // каждой правки (SetCell, ClearCell, пакета SetCells, загрузки снимка),
+    // если видимое значение хотя бы одной ячейки изменилось: новое
+    // значение сравнивается со старым. Чтобы старые значения были
+    // известны, подписка вычисляет все устаревшие формулы, и пока есть
+    // подписчики, формулы, устаревшие за правку, вычисляются в её конце,
+    // как в жадном режиме. Возвращает ключ для Unsubscribe.
+    size_t Subscribe(ChangeListener listener);
+    void Unsubscribe(size_t id);
+    // Общие деревья формул листа.
+    FormulaTable& GetFormulaTable();
+    const FormulaTable& GetFormulaTable() const;
+    // Ключи топологического порядка ячеек, меньше всех выданных ранее и
+    // больше всех выданных ранее соответственно.
+    std::int64_t NewFrontOrder();
+    std::int64_t NewBackOrder();
+    // Связывают формулу ячейки cell с диапазоном range, на который она
+    // ссылается, и разрывают эту связь. Ячейки диапазона не создаются:
+    // зависимые формулы находятся по позиции через индекс диапазонов.
+    void AddRangeDependency(Range range, Cell* cell);
+    void RemoveRangeDependency(Range range, Cell* cell);
+    // То же для ссылки на диапазон range листа sheet_name той же книги.
+    // Лист может ещё не существовать. Вне книги ничего не делают.
+    void AddSheetDependency(std::string_view sheet_name, Range range, Cell* cell);
+    void RemoveSheetDependency(std::string_view sheet_name, Range range, Cell* cell);
+    // Замыкают ли новые формулы ячеек листа цикл через другие листы
+    // книги: ast - новая формула ячейки pos (nullptr - не формула), edits
+    // - пакет таких правок. Циклы внутри листа не ищут. Вне книги ложны.
+    [[nodiscard]] bool ClosesSheetCycle(Position pos, const FormulaAST* ast);
+    [[nodiscard]] bool ClosesSheetCycle(const std::vector<std::pair<Position, const FormulaAST*>>& edits);
+    // Лист книги с именем name; nullptr, если его нет или лист вне книги.
+    [[nodiscard]] Sheet* FindWorkbookSheet(std::string_view name);
+    // Ячейка pos; если её нет, создаётся пустая. Пустая ячейка читается
+    // так же, как отсутствующая, поэтому значения формул не устаревают.
+    Cell& GetOrCreateCell(Position pos);
+    // Помечает значение формулы cell устаревшим вместе со сводками
+    // диапазонов, которые её содержат. В жадном режиме и при подписчиках
+    // формула вычисляется в конце текущей правки.
+    void MarkStale(const Cell& cell);
+    // Значения ячеек в том виде, в каком их читают формулы. Ячейки
+    // записывают туда свои значения сами.
+    ValueStore& GetValues();
+    const ValueStore& GetValues() const;
+    // Тексты ячеек листа.
+    TextPool& GetTexts();
+    // Запоминает содержимое ячейки для точек сохранения, если у листа они
+    // уже были. Ячейки вызывают его сами при каждой записи.
+    void RecordContent(const Cell& cell);
+    // Есть ли формулы, диапазоны которых содержат pos.
+    [[nodiscard]] bool IsInReferencedRange(Position pos) const;
+    // Сообщают сводкам диапазонов, что число в pos сменилось с old_value
+    // на new_value (nullopt - ячейка, которую функции пропускают) или что
+    // значение в pos ещё не известно.
+    void UpdateRangeSummaries(Position pos, std::optional<double> old_value, std::optional<double> new_value);
+    void InvalidateRangeSummaries(Position pos);
+
+    // Вызывает func(Cell*) для каждой формулы, которая ссылается на cell по
+    // отдельности или диапазоном. Формула, несколько диапазонов которой
+    // содержат cell, передаётся по разу на каждый.
+    template <typename Func>
+    void ForEachDependent(const Cell& cell, Func func) const {
+        for (Cell* dependent : cell.GetCalculatedCells()) {
+            func(dependent);
+        }
+        range_dependents_.ForEachContaining(cell.GetPosition(), func);
+    }
+
+    // Вызывает func(Sheet*, Cell*) для каждой формулы других листов книги,
+    // которая ссылается на позицию pos этого листа, с листом этой формулы.
+    template <typename Func>
+    void ForEachSheetDependent(Position pos, Func func) const {
+        if (sheet_dependents_ != nullptr) {
+            sheet_dependents_->ForEachContaining(pos, [&func](const SheetDependent& dependent) {
+                func(dependent.sheet, dependent.cell);
+            });
+        }
+    }
+
+    // Вызывает func(Cell*) для каждой ячейки, на которую ссылается формула
+    // cell по отдельности, и для каждой существующей ячейки её диапазонов,
+    // по разу на каждый содержащий её диапазон.
+    template <typename Func>
+    void ForEachDependency(const Cell& cell, Func func) {
+        for (Cell* used : cell.GetUsedCells()) {
+            func(used);
+        }
+        if (const FormulaAST* ast = cell.GetFormulaAST()) {
+            ast->ForEachRange(cell.GetPosition(), [this, &func](Range range) {
+                ForEachCellIn(range, func);
+            });
+        }
+    }
+
+    // То же только для ячеек, которые могут быть не вычислены. Диапазон с
+    // актуальной сводкой пропускается целиком: все формулы в нём вычислены.
+    template <typename Func>
+    void ForEachStaleDependency(const Cell& cell, Func func) {
+        for (Cell* used : cell.GetUsedCells()) {
+            func(used);
+        }
+        if (const FormulaAST* ast = cell.GetFormulaAST()) {
+            ast->ForEachRange(cell.GetPosition(), [this, &func](Range range) {
+                if (!range_summaries_.IsValid(range)) {
+                    ForEachCellIn(range, func);
+                }
+            });
+        }
+    }
+
+    // То же для ссылок формулы cell на другие листы книги: func(Cell*)
+    // вызывается для ячеек диапазонов, в которых есть невычисленные формулы.
+    template <typename Func>
+    void ForEachStaleSheetDependency(const Cell& cell, Func func) {
+        const FormulaAST* ast = cell.GetFormulaAST();
+        if (workbook_ == nullptr || ast == nullptr || ast->GetSheetCount() == 0) {
+            return;
+        }
+        ast->ForEachSheetReference(cell.GetPosition(), [this, &func](std::string_view name, Range range) {
+            Sheet* sheet = FindWorkbookSheet(name);
+            if (sheet != nullptr && sheet->values_.HasStale(range)) {
+                sheet->ForEachCellIn(range, func);
+            }
+        });
+    }
+
+    // Вызывает func(Cell*) для каждой существующей ячейки диапазона range.
+    template <typename Func>
+    void ForEachCellIn(Range range, Func func) {
+        cells_.ForEachIn(range.first, range.last, [&func](Position, Cell& cell) {
+            func(&cell);
+        });
+    }
 private:
-    struct Hasher {
-        size_t operator()(const Position& pos) const;
+    friend void SaveSnapshot(const Sheet& sheet, std::ostream& output);
+    friend void LoadSnapshot(Sheet& sheet, std::string_view snapshot);
+    friend class Workbook;
+
+    void UpdateOccupancy(Position pos, bool was_empty, bool is_empty);
+    // Вычисляет устаревшие формулы диапазона, чтобы их значения можно было
+    // читать из values_.
+    void CalculateStale(Range range) const;
+    // Вычисляет формулы, помеченные устаревшими за правку, и сообщает
+    // подписчикам, значения каких ячеек изменились. В книге то же делается
+    // для всех её листов, см. CalculateMarked.
+    void FinishEdit();
+    // То же только для этого листа.
+    void CalculateMarked();
+    // Вычисляет все устаревшие формулы в пуле pool или, если его нет, в
+    // текущем потоке.
+    void RecalculateIn(WorkStealingPool* pool);
+    // Помечает устаревшими формулы других листов книги, которые ссылаются
+    // на этот лист, и заканчивает правку книги. Вызывается, когда лист
+    // заполнен целиком, например из снимка.
+    void InvalidateSheetDependents();
+    // Видимое значение ячейки pos до правки; nullopt, если это формула,
+    // значение которой не вычислено.
+    [[nodiscard]] std::optional<CellInterface::Value> GetValueBeforeEdit(Position pos) const;
+    void Notify(const std::vector<Position>& changed) const;
+    // Ячейки, которых касается пакет правок: сначала изменённые, в том же
+    // порядке, что и их черновики, затем зависящие от них.
+    struct BatchGraph {
+        TiledStorage<uint32_t> ids;
+        std::vector<Position> nodes;
+    };
+    // Дополняет граф зависимыми ячейками и возвращает место каждой ячейки
+    // в топологическом порядке с учётом новых формул. Бросает
+    // CircularDependencyException.
+    std::vector<uint32_t> RankBatch(BatchGraph& graph, const std::vector<Cell::Draft>& drafts) const;
+    // Проверяет пакет черновиков, узлы которого - первые узлы graph, и
+    // записывает его в лист. Правку не заканчивает. Бросает, если пакет
+    // замыкает цикл; лист при этом не меняется.
+    void ApplyDrafts(BatchGraph& graph, std::vector<Cell::Draft>& drafts);
+    // Начинает вести содержимое ячеек для точек сохранения, если ещё не
+    // ведёт.
+    void KeepContents();
+    // Есть ли на листе формулы, читающие другие листы книги.
+    [[nodiscard]] bool ReadsSheets() const;
+
+    // Число непустых ячеек в каждой строке (или столбце). Вектор всегда
+    // обрезан по последнему ненулевому счётчику, поэтому его размер - это
+    // протяжённость печатной области по данному измерению.
+    class Occupancy {
+    public:
+        void Add(int index);
+        void Remove(int index);
+        [[nodiscard]] int Extent() const;
+    private:
+        std::vector<int> counts_;
+    };
+
+    FormulaTable formulas_;
+    TextPool texts_;
+    TiledStorage<Cell> cells_;
+    // диапазоны формул листа и ячейки с этими формулами
+    RangeIndex<Cell*> range_dependents_;
+    RangeSummaries range_summaries_;
+    ValueStore values_;
+    // содержимое ячеек для точек сохранения; ведётся с первой точки
+    ContentStore contents_{texts_};
+    bool keeps_contents_ = false;
+    Occupancy rows_;
+    Occupancy cols_;
+    std::unique_ptr<WorkStealingPool> pool_;
+    CalculationMode calculation_mode_ = CalculationMode::Lazy;
+    // Формула, устаревшая за текущую правку, и её значение до правки,
+    // если оно было вычислено.
+    struct Marked {
+        const Cell* cell;
+        std::optional<CellInterface::NumericValue> old_value;
     };
-    std::unordered_map<Position, std::unique_ptr<Cell>, Hasher> cells_;
+    std::vector<Marked> marked_;
+    // ячейки, которые правка изменила сама, и их видимые значения до неё;
+    // заполняется, только если есть подписчики
+    std::vector<std::pair<Position, std::optional<CellInterface::Value>>> edited_;
+    std::vector<std::pair<size_t, ChangeListener>> listeners_;
+    size_t next_listener_ = 0;
+    Published<Version> published_;
+    std::uint64_t published_count_ = 0;
+    std::int64_t front_order_ = 0;
+    std::int64_t back_order_ = 0;
+    // книга листа и формулы её листов, которые ссылаются на этот лист;
+    // задаются книгой
+    Workbook* workbook_ = nullptr;
+    const RangeIndex<SheetDependent>* sheet_dependents_ = nullptr;
 };
@@ -0,0 +1,172 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <unordered_set>
+
+// Множество указателей, которое хранит до N элементов прямо в себе и
+// переносит их в хеш-множество в куче, только когда элементов становится
+// больше. Занимает N указателей; пустое и маленькое множество памяти не
+// выделяют. Порядок обхода не определён.
+template <typename T, size_t N = 2>
+class SmallPtrSet {
+    static_assert(std::is_pointer_v<T> && N >= 2);
+
+public:
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = T;
+
+        T operator*() const {
+            return slot_ != nullptr ? reinterpret_cast<T>(*slot_) : *spilled_;
+        }
+
+        Iterator& operator++() {
+            if (slot_ != nullptr) {
+                ++slot_;
+            } else {
+                ++spilled_;
+            }
+            return *this;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return slot_ == rhs.slot_ && spilled_ == rhs.spilled_;
+        }
+
+        bool operator!=(const Iterator& rhs) const {
+            return !(*this == rhs);
+        }
+
+    private:
+        friend class SmallPtrSet;
+
+        explicit Iterator(const std::uintptr_t* slot) : slot_(slot) {}
+        explicit Iterator(typename std::unordered_set<T>::const_iterator spilled) : spilled_(spilled) {}
+
+        const std::uintptr_t* slot_ = nullptr;
+        typename std::unordered_set<T>::const_iterator spilled_{};
+    };
+
+    SmallPtrSet() = default;
+    SmallPtrSet(const SmallPtrSet&) = delete;
+    SmallPtrSet& operator=(const SmallPtrSet&) = delete;
+
+    ~SmallPtrSet() {
+        Clear();
+    }
+
+    // Добавляет value, если его ещё нет.
+    void Insert(T value) {
+        if (auto* spilled = GetSpilled()) {
+            spilled->insert(value);
+            return;
+        }
+        const auto raw = reinterpret_cast<std::uintptr_t>(value);
+        for (std::uintptr_t& slot : slots_) {
+            if (slot == raw) {
+                return;
+            }
+            if (slot == 0) {
+                slot = raw;
+                return;
+            }
+        }
+        auto* spilled = new std::unordered_set<T>();
+        for (std::uintptr_t& slot : slots_) {
+            spilled->insert(reinterpret_cast<T>(slot));
+            slot = 0;
+        }
+        spilled->insert(value);
+        slots_[0] = reinterpret_cast<std::uintptr_t>(spilled);
+        slots_[N - 1] = SPILLED;
+    }
+
+    // Удаляет value, если он есть.
+    void Erase(T value) {
+        if (auto* spilled = GetSpilled()) {
+            spilled->erase(value);
+            // обратно в себя элементы переносятся с запасом, чтобы
+            // чередование вставок и удалений на границе не выделяло память
+            if (spilled->size() < N) {
+                slots_[N - 1] = 0;
+                size_t i = 0;
+                for (T item : *spilled) {
+                    slots_[i++] = reinterpret_cast<std::uintptr_t>(item);
+                }
+                for (; i < N; ++i) {
+                    slots_[i] = 0;
+                }
+                delete spilled;
+            }
+            return;
+        }
+        const auto raw = reinterpret_cast<std::uintptr_t>(value);
+        for (size_t i = 0; i < N && slots_[i] != 0; ++i) {
+            if (slots_[i] == raw) {
+                // элементы лежат подряд с начала
+                for (; i + 1 < N; ++i) {
+                    slots_[i] = slots_[i + 1];
+                }
+                slots_[N - 1] = 0;
+                return;
+            }
+        }
+    }
+
+    void Clear() {
+        delete GetSpilled();
+        for (std::uintptr_t& slot : slots_) {
+            slot = 0;
+        }
+    }
+
+    [[nodiscard]] bool Empty() const {
+        return slots_[0] == 0;
+    }
+
+    [[nodiscard]] size_t Size() const {
+        if (const auto* spilled = GetSpilled()) {
+            return spilled->size();
+        }
+        return InlineSize();
+    }
+
+    [[nodiscard]] Iterator begin() const {
+        if (const auto* spilled = GetSpilled()) {
+            return Iterator(spilled->begin());
+        }
+        return Iterator(slots_);
+    }
+
+    [[nodiscard]] Iterator end() const {
+        if (const auto* spilled = GetSpilled()) {
+            return Iterator(spilled->end());
+        }
+        return Iterator(slots_ + InlineSize());
+    }
+
+private:
+    // Признак переноса в куче в последнем слоте: выровненный указатель не
+    // может быть равен единице. Тогда в первом слоте лежит хеш-множество.
+    static constexpr std::uintptr_t SPILLED = 1;
+
+    std::unordered_set<T>* GetSpilled() const {
+        return slots_[N - 1] == SPILLED ? reinterpret_cast<std::unordered_set<T>*>(slots_[0]) : nullptr;
+    }
+
+    size_t InlineSize() const {
+        size_t size = 0;
+        while (size < N && slots_[size] != 0) {
+            ++size;
+        }
+        return size;
+    }
+
+    std::uintptr_t slots_[N] = {};
+};
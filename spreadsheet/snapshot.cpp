@@ -0,0 +1,457 @@
+#include "snapshot.h"
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+#include "mapped_file.h"
+#include "sheet.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Снимок - заголовок и за ним подряд:
+// * formula_count деревьев формул: длина ключа в FormulaTable (ноль, если
+//   дерево не делится), ключ и дерево в виде FormulaAST::Serialize;
+// * cell_count записей CellRecord в построчном порядке позиций;
+// * edge_count 32-битных номеров записей: для каждой формулы по порядку -
+//   ячейки, на которые она ссылается по отдельности, в порядке возрастания
+//   позиций. Ячейки её диапазонов не записываются: связи через диапазоны
+//   восстанавливаются по дереву формулы;
+// * text_size байт текстов ячеек подряд, длины - в записях.
+// Все числа записаны в порядке байтов машины, который проверяется по
+// полю byte_order.
+namespace {
+
+    constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+    constexpr std::uint32_t VERSION = 4;
+    constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::uint32_t node_size;
+        std::uint32_t instruction_size;
+        std::uint64_t formula_count;
+        std::uint64_t cell_count;
+        std::uint64_t edge_count;
+        std::uint64_t text_size;
+        std::int64_t front_order;
+        std::int64_t back_order;
+    };
+
+    enum class CellKind : std::uint8_t {
+        Empty,
+        Text,
+        Formula,
+    };
+
+    // Числовое значение ячейки: прочтение текста или вычисленная формула.
+    enum class ValueKind : std::uint8_t {
+        None,
+        Number,
+        Error,
+    };
+
+    struct CellRecord {
+        std::int32_t row;
+        std::int32_t col;
+        std::int64_t order;
+        double number;
+        // длина текста или номер дерева формулы
+        std::uint32_t payload;
+        CellKind kind;
+        ValueKind value;
+        std::uint8_t error;
+        std::uint8_t reserved;
+    };
+
+    static_assert(std::is_trivially_copyable_v<Header> && sizeof(Header) == 72);
+    static_assert(std::is_trivially_copyable_v<CellRecord> && sizeof(CellRecord) == 32);
+
+    template <typename T>
+    void Append(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // Последовательное чтение снимка с проверкой границ.
+    class Reader {
+    public:
+        explicit Reader(std::string_view data)
+            : data_(data) {
+        }
+
+        template <typename T>
+        T Read() {
+            T value;
+            std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+            return value;
+        }
+
+        std::string_view Take(size_t size) {
+            if (data_.size() < size) {
+                throw SnapshotException("Truncated snapshot");
+            }
+            const std::string_view result = data_.substr(0, size);
+            data_.remove_prefix(size);
+            return result;
+        }
+
+        std::string_view& Rest() {
+            return data_;
+        }
+
+    private:
+        std::string_view data_;
+    };
+
+    void SetValue(CellRecord& record, CellInterface::NumericValue value) {
+        if (const double* number = std::get_if<double>(&value)) {
+            record.value = ValueKind::Number;
+            record.number = *number;
+        } else {
+            record.value = ValueKind::Error;
+            record.error = static_cast<std::uint8_t>(std::get<FormulaError>(value).GetCategory());
+        }
+    }
+
+    std::optional<CellInterface::NumericValue> GetValue(const CellRecord& record) {
+        switch (record.value) {
+            case ValueKind::None:
+                return std::nullopt;
+            case ValueKind::Number:
+                return record.number;
+            case ValueKind::Error:
+                return FormulaError(static_cast<FormulaError::Category>(record.error));
+        }
+        return std::nullopt;
+    }
+
+    bool IsValidValue(const CellRecord& record) {
+        switch (record.value) {
+            case ValueKind::None:
+            case ValueKind::Number:
+                return true;
+            case ValueKind::Error:
+                return record.error <= static_cast<std::uint8_t>(FormulaError::Category::Div0);
+        }
+        return false;
+    }
+
+}  // namespace
+
+void SaveSnapshot(const Sheet& sheet, std::ostream& output) {
+    std::unordered_map<const FormulaAST*, std::string_view> keys;
+    sheet.formulas_.ForEach([&keys](std::string_view key, const auto& ast) {
+        keys.emplace(ast.get(), key);
+    });
+
+    // номера записей по позициям и номера деревьев
+    TiledStorage<std::uint32_t> cell_ids;
+    std::unordered_map<const FormulaAST*, std::uint32_t> formula_ids;
+    std::string formulas;
+    std::uint32_t cell_count = 0;
+    sheet.cells_.ForEach([&](Position pos, const Cell& cell) {
+        cell_ids.Emplace(pos, cell_count++);
+        const FormulaAST* ast = cell.GetFormulaAST();
+        if (ast != nullptr && formula_ids.emplace(ast, static_cast<std::uint32_t>(formula_ids.size())).second) {
+            const auto it = keys.find(ast);
+            const std::string_view key = it != keys.end() ? it->second : std::string_view();
+            Append(formulas, static_cast<std::uint32_t>(key.size()));
+            formulas.append(key);
+            ast->Serialize(formulas);
+        }
+    });
+
+    std::string records;
+    std::string edges;
+    std::string texts;
+    std::vector<Position> used_cells;
+    std::vector<Range> ranges;
+    std::string text_buffer;
+    records.reserve(size_t{cell_count} * sizeof(CellRecord));
+    sheet.cells_.ForEach([&](Position pos, const Cell& cell) {
+        CellRecord record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.order = cell.GetOrder();
+        if (const FormulaAST* ast = cell.GetFormulaAST()) {
+            record.kind = CellKind::Formula;
+            record.payload = formula_ids.at(ast);
+            // у вычисленной формулы GetNumericValue только читает кэш
+            if (cell.IsCalculated()) {
+                SetValue(record, cell.GetNumericValue());
+            }
+            ast->GetDependencies(pos, used_cells, ranges);
+            for (const Position used : used_cells) {
+                Append(edges, *cell_ids.Find(used));
+            }
+        } else if (!cell.IsEmpty()) {
+            const std::string_view text = cell.GetTextView(text_buffer);
+            record.kind = CellKind::Text;
+            record.payload = static_cast<std::uint32_t>(text.size());
+            SetValue(record, cell.GetNumericValue());
+            texts += text;
+        }
+        Append(records, record);
+    });
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.node_size = sizeof(ASTImpl::Node);
+    header.instruction_size = sizeof(ASTImpl::Instruction);
+    header.formula_count = formula_ids.size();
+    header.cell_count = cell_count;
+    header.edge_count = edges.size() / sizeof(std::uint32_t);
+    header.text_size = texts.size();
+    header.front_order = sheet.front_order_;
+    header.back_order = sheet.back_order_;
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(formulas.data(), static_cast<std::streamsize>(formulas.size()));
+    output.write(records.data(), static_cast<std::streamsize>(records.size()));
+    output.write(edges.data(), static_cast<std::streamsize>(edges.size()));
+    output.write(texts.data(), static_cast<std::streamsize>(texts.size()));
+}
+
+void LoadSnapshot(Sheet& sheet, std::string_view snapshot) {
+    if (!sheet.cells_.Empty()) {
+        throw SnapshotException("Snapshot can only be loaded into an empty sheet");
+    }
+    Reader reader(snapshot);
+    const auto header = reader.Read<Header>();
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw SnapshotException("Not a sheet snapshot");
+    }
+    if (header.version != VERSION || header.byte_order != BYTE_ORDER_MARK
+        || header.node_size != sizeof(ASTImpl::Node) || header.instruction_size != sizeof(ASTImpl::Instruction)) {
+        throw SnapshotException("Unsupported snapshot version");
+    }
+    // каждая запись и каждое дерево занимают хотя бы байт, поэтому
+    // счётчики, которые не поместились бы в снимок, отсекаются здесь
+    if (header.formula_count > snapshot.size() || header.cell_count > snapshot.size() / sizeof(CellRecord)
+        || header.edge_count > snapshot.size() / sizeof(std::uint32_t) || header.text_size > snapshot.size()) {
+        throw SnapshotException("Truncated snapshot");
+    }
+
+    std::vector<std::shared_ptr<const FormulaAST>> formulas;
+    std::vector<std::string_view> keys;
+    formulas.reserve(header.formula_count);
+    keys.reserve(header.formula_count);
+    for (std::uint64_t i = 0; i < header.formula_count; ++i) {
+        keys.push_back(reader.Take(reader.Read<std::uint32_t>()));
+        try {
+            formulas.push_back(std::make_shared<const FormulaAST>(FormulaAST::Deserialize(reader.Rest())));
+        } catch (const ParsingError&) {
+            throw SnapshotException("Corrupted formula in snapshot");
+        }
+    }
+    // ключ попадёт в таблицу формул листа, и формулы, заданные потом с тем
+    // же ключом, возьмут это дерево без разбора, поэтому ключ проверяется:
+    // формула, восстановленная из него, должна разбираться в то же дерево
+    std::string key_formula;
+    std::string rebuilt_key;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (keys[i].empty()) {
+            continue;
+        }
+        Position anchor;
+        if (!ExpandRelativeKey(keys[i], key_formula, anchor) || !MakeRelativeKey(key_formula, anchor, rebuilt_key)
+            || rebuilt_key != keys[i]) {
+            throw SnapshotException("Corrupted formula key in snapshot");
+        }
+        try {
+            FormulaAST parsed = ParseFormulaAST(key_formula, ParserBackend::Native);
+            parsed.Rebase(anchor);
+            if (!(parsed == *formulas[i])) {
+                throw SnapshotException("Corrupted formula key in snapshot");
+            }
+        } catch (const ParsingError&) {
+            throw SnapshotException("Corrupted formula key in snapshot");
+        } catch (const FormulaException&) {
+            throw SnapshotException("Corrupted formula key in snapshot");
+        }
+    }
+    const std::string_view records = reader.Take(header.cell_count * sizeof(CellRecord));
+    const std::string_view edges = reader.Take(header.edge_count * sizeof(std::uint32_t));
+    const std::string_view texts = reader.Take(header.text_size);
+    if (!reader.Rest().empty()) {
+        throw SnapshotException("Trailing data in snapshot");
+    }
+    auto record_at = [&records](size_t index) {
+        CellRecord record;
+        std::memcpy(&record, records.data() + index * sizeof(CellRecord), sizeof(CellRecord));
+        return record;
+    };
+    auto edge_at = [&edges](size_t index) {
+        std::uint32_t edge;
+        std::memcpy(&edge, edges.data() + index * sizeof(edge), sizeof(edge));
+        return edge;
+    };
+
+    // Проверка до изменения листа. Ссылки формулы должны совпадать с
+    // ячейками её дерева, а ключ порядка ячейки, на которую ссылается
+    // формула, в том числе диапазоном, - быть меньше ключа формулы: тогда
+    // связи не образуют цикла.
+    size_t edge = 0;
+    size_t text_end = 0;
+    Position previous = Position::NONE;
+    std::vector<Position> used_cells;
+    std::vector<Range> ranges;
+    // формулы с диапазонами проверяются после всех записей по ключам
+    // порядка ячеек, которые собираются, только если такие формулы есть
+    std::vector<size_t> range_formulas;
+    for (size_t i = 0; i < header.cell_count; ++i) {
+        const CellRecord record = record_at(i);
+        const Position pos{record.row, record.col};
+        if (!pos.IsValid() || (i > 0 && !(previous < pos))) {
+            throw SnapshotException("Corrupted cell in snapshot");
+        }
+        previous = pos;
+        if (record.order < header.front_order || record.order > header.back_order || !IsValidValue(record)) {
+            throw SnapshotException("Corrupted cell in snapshot");
+        }
+        switch (record.kind) {
+            case CellKind::Empty:
+                break;
+            case CellKind::Text:
+                text_end += record.payload;
+                if (record.payload == 0 || text_end > texts.size() || record.value == ValueKind::None) {
+                    throw SnapshotException("Corrupted cell in snapshot");
+                }
+                break;
+            case CellKind::Formula: {
+                if (record.payload >= formulas.size()) {
+                    throw SnapshotException("Corrupted cell in snapshot");
+                }
+                formulas[record.payload]->GetDependencies(pos, used_cells, ranges);
+                if (!ranges.empty()) {
+                    range_formulas.push_back(i);
+                }
+                for (const Position used : used_cells) {
+                    if (edge == header.edge_count || edge_at(edge) >= header.cell_count) {
+                        throw SnapshotException("Corrupted reference in snapshot");
+                    }
+                    const CellRecord target = record_at(edge_at(edge++));
+                    if (!(Position{target.row, target.col} == used) || target.order >= record.order) {
+                        throw SnapshotException("Corrupted reference in snapshot");
+                    }
+                }
+                break;
+            }
+            default:
+                throw SnapshotException("Corrupted cell in snapshot");
+        }
+    }
+    if (edge != header.edge_count || text_end != texts.size()) {
+        throw SnapshotException("Corrupted snapshot");
+    }
+    if (!range_formulas.empty()) {
+        TiledStorage<std::int64_t> orders;
+        for (size_t i = 0; i < header.cell_count; ++i) {
+            const CellRecord record = record_at(i);
+            orders.Emplace(Position{record.row, record.col}, record.order);
+        }
+        for (const size_t i : range_formulas) {
+            const CellRecord record = record_at(i);
+            formulas[record.payload]->GetDependencies(Position{record.row, record.col}, used_cells, ranges);
+            for (const Range range : ranges) {
+                // ключ самой формулы не меньше её ключа, так что ссылка на
+                // себя тоже отсекается
+                orders.ForEachIn(range.first, range.last, [&record](Position, std::int64_t order) {
+                    if (order >= record.order) {
+                        throw SnapshotException("Corrupted reference in snapshot");
+                    }
+                });
+            }
+        }
+    }
+
+    // в книге формулы снимка могут замкнуть цикл через другие листы
+    if (sheet.workbook_ != nullptr) {
+        std::vector<std::pair<Position, const FormulaAST*>> edits;
+        for (size_t i = 0; i < header.cell_count; ++i) {
+            const CellRecord record = record_at(i);
+            if (record.kind == CellKind::Formula) {
+                edits.emplace_back(Position{record.row, record.col}, formulas[record.payload].get());
+            }
+        }
+        if (sheet.ClosesSheetCycle(edits)) {
+            throw SnapshotException("Snapshot closes a circular dependency across sheets");
+        }
+    }
+
+    std::vector<Cell*> cells;
+    cells.reserve(header.cell_count);
+    size_t text_begin = 0;
+    for (size_t i = 0; i < header.cell_count; ++i) {
+        const CellRecord record = record_at(i);
+        const Position pos{record.row, record.col};
+        Cell& cell = sheet.cells_.Emplace(pos, sheet, pos);
+        if (record.kind == CellKind::Text) {
+            std::string text(texts.substr(text_begin, record.payload));
+            text_begin += record.payload;
+            cell.Apply(sheet, Cell::MakeTextDraft(std::move(text), *GetValue(record)));
+        } else if (record.kind == CellKind::Formula) {
+            cell.Apply(sheet, Cell::MakeFormulaDraft(sheet, pos, formulas[record.payload], GetValue(record)));
+        }
+        cell.SetOrder(record.order);
+        sheet.UpdateOccupancy(pos, true, cell.IsEmpty());
+        cells.push_back(&cell);
+    }
+    edge = 0;
+    for (size_t i = 0; i < header.cell_count; ++i) {
+        if (const FormulaAST* ast = cells[i]->GetFormulaAST()) {
+            ast->GetDependencies(cells[i]->GetPosition(), used_cells, ranges);
+            for (size_t j = 0; j < used_cells.size(); ++j) {
+                cells[i]->AddUsedCell(cells[edge_at(edge++)]);
+            }
+        }
+    }
+    // значения формул, которые читают другие листы, из снимка не взяты;
+    // вместе с ними устаревают все формулы листа, которые от них зависят
+    for (Cell* cell : cells) {
+        if (const FormulaAST* ast = cell->GetFormulaAST(); ast != nullptr && ast->GetSheetCount() != 0) {
+            cell->CacheInvalidate(sheet, true);
+        }
+    }
+    for (size_t i = 0; i < formulas.size(); ++i) {
+        if (!keys[i].empty()) {
+            sheet.formulas_.Insert(std::string(keys[i]), formulas[i]);
+        }
+    }
+    sheet.front_order_ = header.front_order;
+    sheet.back_order_ = header.back_order;
+    // значения, которых нет в снимке, жадный лист вычисляет сразу, а
+    // подписчики узнают обо всех непустых ячейках
+    if (sheet.calculation_mode_ == Sheet::CalculationMode::Eager || !sheet.listeners_.empty()) {
+        sheet.Recalculate();
+    }
+    // подписчики узнают обо всех ячейках ниже, сравнивать со значениями из
+    // снимка нечего
+    sheet.marked_.clear();
+    if (!sheet.listeners_.empty()) {
+        std::vector<Position> changed;
+        sheet.cells_.ForEach([&changed](Position pos, const Cell& cell) {
+            if (!cell.IsEmpty()) {
+                changed.push_back(pos);
+            }
+        });
+        if (!changed.empty()) {
+            sheet.Notify(changed);
+        }
+    }
+    sheet.InvalidateSheetDependents();
+}
+
+void LoadSnapshotFile(Sheet& sheet, const std::string& path) {
+    const MappedFile file(path);
+    LoadSnapshot(sheet, file.GetData());
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+class Sheet;
+
+// Исключение, выбрасываемое при загрузке снимка другого формата, другой
+// версии или повреждённого снимка
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичный снимок листа: тексты ячеек, разобранные деревья формул, связи
+// между ячейками, их топологический порядок и вычисленные значения. Снимок
+// читается только сборкой с тем же порядком байтов и той же раскладкой
+// деревьев формул; версия формата записана в его заголовке.
+void SaveSnapshot(const Sheet& sheet, std::ostream& output);
+
+// Восстанавливает пустой лист из снимка без разбора формул ячеек:
+// вычисленные значения сразу доступны без пересчёта. Снимок проверяется
+// целиком до того, как лист изменится; ключ каждого дерева в таблице
+// формул проверяется разбором формулы, восстановленной из ключа, по разу
+// на дерево. Бросает SnapshotException, если снимок не
+// подходит или лист не пуст. Значения формул, которые ссылаются на другие
+// листы, из снимка не берутся: они вычисляются заново.
+void LoadSnapshot(Sheet& sheet, std::string_view snapshot);
+
+// То же для файла, который отображается в память. Если файл не удаётся
+// открыть, бросается std::system_error.
+void LoadSnapshotFile(Sheet& sheet, const std::string& path);
@@ -1,8 +1,10 @@
 #include "common.h"
+#include "FormulaAST.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -22,7 +24,9 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
-    if (!IsValid()){ throw InvalidPositionException("Invalid position exception");}
+    if (!IsValid()) {
+        return "";
+    }
 
     std::string result;
     result.reserve(MAX_POSITION_LENGTH);
@@ -51,8 +55,8 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    const auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc{} || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
     int col = 0;
@@ -66,3 +70,58 @@ Position Position::FromString(std::string_view str) {
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
+
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+CellInterface::NumericValue SheetInterface::GetNumericValue(Position pos) const {
+    const CellInterface* cell = GetCell(pos);
+    if (cell == nullptr) {
+        return 0.0;
+    }
+    return cell->GetNumericValue();
+}
+
+void SheetInterface::GetNumericValues(Range range, std::vector<double>& values) const {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = GetCell({row, col});
+            if (cell == nullptr) {
+                continue;
+            }
+            const auto value = cell->GetValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                values.push_back(*number);
+            } else if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+                throw *error;
+            } else if (!std::get<std::string>(value).empty()) {
+                // текст попадает в диапазон, только если представляет число
+                const auto text_number = cell->GetNumericValue();
+                if (const double* number = std::get_if<double>(&text_number)) {
+                    values.push_back(*number);
+                }
+            }
+        }
+    }
+}
+
+const SheetInterface* SheetInterface::FindSheet(std::string_view /* name */) const {
+    return nullptr;
+}
+
+RangeSummary SheetInterface::GetRangeSummary(Range range, bool with_extrema) const {
+    // буфер покидает слот потока, пока заполняется: чтение ячейки может
+    // вычислить другую формулу с диапазоном
+    thread_local std::vector<double> buffer;
+    std::vector<double> values = std::move(buffer);
+    values.clear();
+    GetNumericValues(range, values);
+    const RangeSummary summary = Summarize(values, with_extrema);
+    buffer = std::move(values);
+    return summary;
+}
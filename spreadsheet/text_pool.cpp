@@ -0,0 +1,138 @@
+#include "text_pool.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+
+namespace {
+// Разбирает число по тем же правилам, что и чтение double из потока с
+// проверкой на конец ввода: допускаются ведущие пробелы и знак, но не
+// хвостовые символы, inf, nan и шестнадцатеричная запись.
+std::optional<double> ParseNumber(std::string_view text) {
+    size_t start = 0;
+    while (start < text.size() && std::isspace(static_cast<unsigned char>(text[start]))) {
+        ++start;
+    }
+    text.remove_prefix(start);
+    const bool has_plus = !text.empty() && text.front() == '+';
+    std::string_view digits = has_plus ? text.substr(1) : text;
+    const size_t first_digit = !digits.empty() && digits.front() == '-' ? 1 : 0;
+    if (has_plus && first_digit == 1) {
+        return std::nullopt;
+    }
+    if (first_digit >= digits.size()
+        || !(std::isdigit(static_cast<unsigned char>(digits[first_digit])) || digits[first_digit] == '.')) {
+        return std::nullopt;
+    }
+    double result = 0;
+    const auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), result);
+    if (error != std::errc{} || end != digits.data() + digits.size()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+// Числовое прочтение текста ячейки: пустой текст после апострофа - ноль.
+CellInterface::NumericValue ReadText(std::string_view text) {
+    if (!text.empty() && text.front() == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    if (text.empty()) {
+        return 0.0;
+    }
+    if (const auto number = ParseNumber(text)) {
+        return *number;
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
+}  // namespace
+
+TextPool::TextPool() = default;
+TextPool::~TextPool() = default;
+
+const TextPool::Entry* TextPool::Intern(std::string_view text, std::optional<CellInterface::NumericValue> number) {
+    if (const auto it = index_.find(text); it != index_.end()) {
+        ++it->second->refs;
+        return it->second;
+    }
+    Entry* entry = nullptr;
+    if (free_entries_.empty()) {
+        entry = &entries_.emplace_back();
+    } else {
+        entry = free_entries_.back();
+        free_entries_.pop_back();
+    }
+    entry->text = Store(text);
+    entry->number = number ? *number : ReadText(text);
+    entry->refs = 1;
+    live_bytes_ += text.size();
+    index_.emplace(entry->text, entry);
+    return entry;
+}
+
+void TextPool::Retain(const Entry* entry) {
+    ++const_cast<Entry*>(entry)->refs;
+}
+
+void TextPool::Release(const Entry* entry) {
+    auto* released = const_cast<Entry*>(entry);
+    if (--released->refs > 0) {
+        return;
+    }
+    index_.erase(released->text);
+    live_bytes_ -= released->text.size();
+    dead_bytes_ += released->text.size();
+    released->text = {};
+    free_entries_.push_back(released);
+    if (dead_bytes_ > BLOCK_SIZE && dead_bytes_ > live_bytes_) {
+        Compact();
+    }
+}
+
+size_t TextPool::Size() const {
+    return index_.size();
+}
+
+size_t TextPool::GetTextBytes() const {
+    return live_bytes_;
+}
+
+std::string_view TextPool::Store(std::string_view text) {
+    if (text.empty()) {
+        return {};
+    }
+    char* data = nullptr;
+    if (text.size() > BLOCK_SIZE / 2) {
+        // длинный текст получает свой блок, а свободный хвост текущего
+        // блока остаётся для следующих текстов
+        blocks_.emplace_back(new char[text.size()]);
+        data = blocks_.back().get();
+    } else {
+        if (text.size() > block_left_) {
+            blocks_.emplace_back(new char[BLOCK_SIZE]);
+            block_free_ = blocks_.back().get();
+            block_left_ = BLOCK_SIZE;
+        }
+        data = block_free_;
+        block_free_ += text.size();
+        block_left_ -= text.size();
+    }
+    std::memcpy(data, text.data(), text.size());
+    return {data, text.size()};
+}
+
+void TextPool::Compact() {
+    // старые блоки живут, пока из них копируются тексты
+    const auto old_blocks = std::move(blocks_);
+    blocks_.clear();
+    block_free_ = nullptr;
+    block_left_ = 0;
+    std::unordered_map<std::string_view, Entry*> index;
+    index.reserve(index_.size());
+    for (const auto& [text, entry] : index_) {
+        entry->text = Store(text);
+        index.emplace(entry->text, entry);
+    }
+    index_ = std::move(index);
+    dead_bytes_ = 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "common.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Тексты ячеек листа. Одинаковые тексты хранятся один раз: ячейки держат
+// указатель на общую запись со счётчиком ссылок. Символы лежат подряд в
+// крупных блоках, а не в отдельной строке на каждую ячейку. Запись
+// хранит и числовое прочтение текста, которое разбирается один раз.
+// Освобождённые символы переиспользуются при уплотнении, которое
+// переносит живые тексты в новые блоки; адреса записей при этом не
+// меняются, а представления текстов, полученные раньше, - становятся
+// недействительными. Все методы вызываются только при правках листа.
+class TextPool {
+public:
+    struct Entry {
+        std::string_view text;
+        // как текст видит формула: пустой текст после апострофа - ноль,
+        // текст, не представляющий число, - #VALUE!
+        CellInterface::NumericValue number;
+        std::uint32_t refs = 0;
+    };
+
+    TextPool();
+    ~TextPool();
+
+    // Запись с текстом text, счётчик ссылок которой увеличен на один. Если
+    // такого текста ещё нет, он копируется в пул, а его прочтение берётся
+    // из number или разбирается.
+    const Entry* Intern(std::string_view text, std::optional<CellInterface::NumericValue> number = std::nullopt);
+    // Увеличивает счётчик ссылок записи, которая уже есть в пуле.
+    void Retain(const Entry* entry);
+    // Уменьшает счётчик ссылок записи и удаляет её, когда ссылок нет.
+    void Release(const Entry* entry);
+
+    // Число различных текстов и байт, которые занимают их символы.
+    [[nodiscard]] size_t Size() const;
+    [[nodiscard]] size_t GetTextBytes() const;
+
+private:
+    static constexpr size_t BLOCK_SIZE = size_t{1} << 16;
+
+    std::string_view Store(std::string_view text);
+    // Переносит живые тексты в новые блоки, когда освобождённых символов
+    // больше, чем живых.
+    void Compact();
+
+    std::unordered_map<std::string_view, Entry*> index_;
+    // записи не перемещаются: освобождённые ждут повторного использования
+    std::deque<Entry> entries_;
+    std::vector<Entry*> free_entries_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    // свободное место в последнем блоке
+    char* block_free_ = nullptr;
+    size_t block_left_ = 0;
+    size_t live_bytes_ = 0;
+    size_t dead_bytes_ = 0;
+};
@@ -0,0 +1,122 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+// пул и очередь, к которым относится текущий поток, если он рабочий
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(size_t thread_count) {
+    thread_count = std::max<size_t>(thread_count, 1);
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    workers_.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers_.emplace_back([this, i] {
+            WorkerLoop(i);
+        });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void WorkStealingPool::Submit(Task task) {
+    const size_t index = current_pool == this
+                             ? current_index
+                             : next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    unfinished_.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    queued_.fetch_add(1, std::memory_order_release);
+    {
+        // под мьютексом, чтобы не потерять пробуждение потока, который
+        // как раз проверил условие и собирается заснуть
+        std::lock_guard lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+}
+
+void WorkStealingPool::Wait() {
+    std::unique_lock lock(done_mutex_);
+    done_.wait(lock, [this] {
+        return unfinished_.load(std::memory_order_acquire) == 0;
+    });
+    if (error_) {
+        std::exception_ptr error = std::exchange(error_, nullptr);
+        std::rethrow_exception(error);
+    }
+}
+
+void WorkStealingPool::WorkerLoop(size_t index) {
+    current_pool = this;
+    current_index = index;
+    Task task;
+    while (true) {
+        if (TryPop(index, task)) {
+            Run(task);
+            continue;
+        }
+        std::unique_lock lock(sleep_mutex_);
+        wake_.wait(lock, [this] {
+            return stop_ || queued_.load(std::memory_order_acquire) > 0;
+        });
+        if (stop_ && queued_.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+    }
+}
+
+bool WorkStealingPool::TryPop(size_t index, Task& task) {
+    {
+        Queue& own = *queues_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    for (size_t shift = 1; shift < queues_.size(); ++shift) {
+        Queue& victim = *queues_[(index + shift) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::Run(Task& task) {
+    try {
+        task();
+    } catch (...) {
+        std::lock_guard lock(done_mutex_);
+        if (!error_) {
+            error_ = std::current_exception();
+        }
+    }
+    task = nullptr;
+    if (unfinished_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard lock(done_mutex_);
+        done_.notify_all();
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с кражей задач. У каждого потока своя очередь: поток берёт
+// задачи с её конца (последние поставленные, они горячие в кэше), а когда
+// очередь пуста - крадёт из начала очередей соседей.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(size_t thread_count);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Ставит задачу в очередь. Задача, поставленная из рабочего потока пула,
+    // попадает в очередь этого потока.
+    void Submit(Task task);
+    // Ждёт выполнения всех задач, включая поставленные из самих задач.
+    // Если какая-то задача бросила исключение, перебрасывает первое из них.
+    void Wait();
+
+    [[nodiscard]] size_t GetThreadCount() const {
+        return workers_.size();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void WorkerLoop(size_t index);
+    bool TryPop(size_t index, Task& task);
+    void Run(Task& task);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::atomic<size_t> queued_{0};     // задачи, лежащие в очередях
+    std::atomic<size_t> unfinished_{0};  // поставленные, но не выполненные задачи
+    std::atomic<size_t> next_queue_{0};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+
+    std::mutex done_mutex_;
+    std::condition_variable done_;
+    std::exception_ptr error_;
+};
@@ -0,0 +1,146 @@
+#pragma once
+#include "common.h"
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Хранилище объектов, привязанных к позициям таблицы. Лист разбит на плитки
+// фиксированного размера; каждая плитка - непрерывный блок памяти, который
+// выделяется при первом обращении к любой её позиции и освобождается, когда в
+// ней не остаётся объектов. Поиск - два индексирования без хеширования.
+// Адреса объектов стабильны, пока объект не удалён.
+template <typename T, int TILE_ROWS = 16, int TILE_COLS = 64>
+class TiledStorage {
+public:
+    static_assert(Position::MAX_ROWS % TILE_ROWS == 0 && Position::MAX_COLS % TILE_COLS == 0);
+
+    [[nodiscard]] T* Find(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (tile == nullptr) {
+            return nullptr;
+        }
+        auto& slot = tile->slots[SlotIndex(pos)];
+        return slot ? &*slot : nullptr;
+    }
+
+    [[nodiscard]] const T* Find(Position pos) const {
+        return const_cast<TiledStorage*>(this)->Find(pos);
+    }
+
+    // Создаёт объект в позиции pos. Если объект уже есть, возвращает его.
+    template <typename... Args>
+    T& Emplace(Position pos, Args&&... args) {
+        Tile& tile = GetOrCreateTile(pos);
+        auto& slot = tile.slots[SlotIndex(pos)];
+        if (!slot) {
+            slot.emplace(std::forward<Args>(args)...);
+            ++tile.count;
+            ++size_;
+        }
+        return *slot;
+    }
+
+    bool Erase(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (tile == nullptr || !tile->slots[SlotIndex(pos)]) {
+            return false;
+        }
+        tile->slots[SlotIndex(pos)].reset();
+        --size_;
+        if (--tile->count == 0) {
+            tiles_[pos.row / TILE_ROWS][pos.col / TILE_COLS].reset();
+        }
+        return true;
+    }
+
+    [[nodiscard]] size_t Size() const {
+        return size_;
+    }
+
+    [[nodiscard]] bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Обходит объекты в построчном порядке: строка за строкой, слева направо.
+    template <typename Func>
+    void ForEach(Func func) const {
+        ForEachIn(Position{0, 0}, Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, func);
+    }
+
+    // То же для объектов прямоугольника с углами first и last включительно.
+    // Плитки, которые прямоугольник не задевает, не просматриваются.
+    template <typename Func>
+    void ForEachIn(Position first, Position last, Func func) const {
+        const size_t last_tile_row = std::min<size_t>(last.row / TILE_ROWS + 1, tiles_.size());
+        for (size_t tile_row = first.row / TILE_ROWS; tile_row < last_tile_row; ++tile_row) {
+            const auto& row_tiles = tiles_[tile_row];
+            const size_t last_tile_col = std::min<size_t>(last.col / TILE_COLS + 1, row_tiles.size());
+            const int tile_top = static_cast<int>(tile_row) * TILE_ROWS;
+            const int row_end = std::min(last.row, tile_top + TILE_ROWS - 1);
+            for (int row = std::max(first.row, tile_top); row <= row_end; ++row) {
+                for (size_t tile_col = first.col / TILE_COLS; tile_col < last_tile_col; ++tile_col) {
+                    const Tile* tile = row_tiles[tile_col].get();
+                    if (tile == nullptr) {
+                        continue;
+                    }
+                    const int tile_left = static_cast<int>(tile_col) * TILE_COLS;
+                    const int col_end = std::min(last.col, tile_left + TILE_COLS - 1);
+                    for (int col = std::max(first.col, tile_left); col <= col_end; ++col) {
+                        const auto& slot = tile->slots[SlotIndex(Position{row, col})];
+                        if (slot) {
+                            func(Position{row, col}, *slot);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    template <typename Func>
+    void ForEachIn(Position first, Position last, Func func) {
+        std::as_const(*this).ForEachIn(first, last, [&func](Position pos, const T& value) {
+            func(pos, const_cast<T&>(value));
+        });
+    }
+
+private:
+    struct Tile {
+        std::array<std::optional<T>, TILE_ROWS * TILE_COLS> slots;
+        int count = 0;
+    };
+
+    static int SlotIndex(Position pos) {
+        return (pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS;
+    }
+
+    Tile* FindTile(Position pos) const {
+        const size_t tile_row = pos.row / TILE_ROWS;
+        const size_t tile_col = pos.col / TILE_COLS;
+        if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+            return nullptr;
+        }
+        return tiles_[tile_row][tile_col].get();
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        const size_t tile_row = pos.row / TILE_ROWS;
+        const size_t tile_col = pos.col / TILE_COLS;
+        if (tile_row >= tiles_.size()) {
+            tiles_.resize(tile_row + 1);
+        }
+        auto& row_tiles = tiles_[tile_row];
+        if (tile_col >= row_tiles.size()) {
+            row_tiles.resize(tile_col + 1);
+        }
+        if (!row_tiles[tile_col]) {
+            row_tiles[tile_col] = std::make_unique<Tile>();
+        }
+        return *row_tiles[tile_col];
+    }
+
+    std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+    size_t size_ = 0;
+};
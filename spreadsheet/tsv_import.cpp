@@ -0,0 +1,56 @@
+#include "tsv_import.h"
+#include "common.h"
+#include "mapped_file.h"
+#include "sheet.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace {
+
+    // Столько ячеек уходит в лист одним вызовом SetCells. Черновики пакета
+    // записываются в лист вторым проходом, и при таком размере они ещё
+    // лежат в кэше процессора.
+    constexpr size_t BATCH_SIZE = 4096;
+
+}  // namespace
+
+void ImportTexts(Sheet& sheet, std::string_view tsv) {
+    std::vector<std::pair<Position, std::string>> batch;
+    batch.reserve(BATCH_SIZE);
+    Position pos;
+    const char* it = tsv.data();
+    const char* const end = it + tsv.size();
+    while (it != end) {
+        const char* field_end = std::find_if(it, end, [](char c) {
+            return c == '\t' || c == '\n';
+        });
+        // пустые поля - пустые ячейки, их не создаём
+        if (field_end != it) {
+            batch.emplace_back(pos, std::string(it, field_end));
+            if (batch.size() == BATCH_SIZE) {
+                sheet.SetCells(std::move(batch));
+                batch.clear();
+                batch.reserve(BATCH_SIZE);
+            }
+        }
+        if (field_end == end) {
+            break;
+        }
+        if (*field_end == '\t') {
+            ++pos.col;
+        } else {
+            ++pos.row;
+            pos.col = 0;
+        }
+        it = field_end + 1;
+    }
+    if (!batch.empty()) {
+        sheet.SetCells(std::move(batch));
+    }
+}
+
+void ImportTextsFile(Sheet& sheet, const std::string& path) {
+    const MappedFile file(path);
+    ImportTexts(sheet, file.GetData());
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+class Sheet;
+
+// Загрузка таблицы в формате PrintTexts: строки таблицы разделены '\n',
+// ячейки строки - '\t', первая строка и первый столбец начинаются с A1.
+// Пустое поле означает пустую ячейку. Тексты, содержащие '\t' или '\n',
+// этим форматом не представимы.
+//
+// Ячейки записываются в лист пакетами через SetCells, поэтому ссылки вперёд
+// по файлу допустимы. Исключения те же, что у SetCells; пакеты, записанные
+// до ошибки, остаются в листе.
+void ImportTexts(Sheet& sheet, std::string_view tsv);
+
+// То же для файла. Файл отображается в память и разбирается на месте;
+// если его не удаётся открыть, бросается std::system_error.
+void ImportTextsFile(Sheet& sheet, const std::string& path);
@@ -0,0 +1,276 @@
+#include "value_store.h"
+#include "FormulaAST.h"
+#include <algorithm>
+#include <thread>
+#include <variant>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+int CountBits(std::uint64_t word) {
+#if defined(_MSC_VER)
+    return static_cast<int>(__popcnt64(word));
+#else
+    return __builtin_popcountll(word);
+#endif
+}
+
+int LowestBit(std::uint64_t word) {
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward64(&index, word);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+// Ставит или снимает bit в word. Слово меняется, только если бит другой:
+// соседние строки столбца могут записываться из других потоков.
+void Assign(std::atomic<std::uint64_t>& word, std::uint64_t bit, bool value,
+            std::memory_order order = std::memory_order_relaxed) {
+    const bool current = (word.load(std::memory_order_relaxed) & bit) != 0;
+    if (current == value) {
+        return;
+    }
+    if (value) {
+        word.fetch_or(bit, order);
+    } else {
+        word.fetch_and(~bit, order);
+    }
+}
+
+int HighestBit(std::uint64_t word) {
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, word);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(word);
+#endif
+}
+
+FormulaError ReadError(double category) {
+    return FormulaError(static_cast<FormulaError::Category>(static_cast<int>(category)));
+}
+}  // namespace
+
+ValueStore::ValueStore() = default;
+ValueStore::ValueStore(const ValueStore& other) = default;
+ValueStore::~ValueStore() = default;
+
+ValueStore::Column::Column(const Column& other)
+    : values(other.values)
+    , stale(other.stale.load(std::memory_order_relaxed))
+    , numbers(other.numbers.load(std::memory_order_relaxed))
+    , texts(other.texts.load(std::memory_order_relaxed))
+    , errors(other.errors.load(std::memory_order_relaxed)) {}
+
+void ValueStore::SetEmpty(Position pos) {
+    Set(pos, 0.0, 0);
+}
+
+void ValueStore::SetText(Position pos, NumericValue number) {
+    if (const double* value = std::get_if<double>(&number)) {
+        Set(pos, *value, NUMBER);
+    } else {
+        Set(pos, 0.0, TEXT);
+    }
+}
+
+void ValueStore::SetStale(Position pos) {
+    Set(pos, 0.0, STALE);
+}
+
+void ValueStore::SetResult(Position pos, NumericValue value) {
+    // у устаревшего значения плитка есть и она не общая: копии делаются
+    // только без устаревших значений
+    Tile* tile = FindTile(pos);
+    if (tile == nullptr) {
+        return;
+    }
+    Column& column = tile->columns[pos.col % TILE_COLS];
+    const int row = pos.row % TILE_ROWS;
+    const std::uint64_t bit = std::uint64_t{1} << row;
+    // строку занимают на несколько записей, поэтому ожидание короткое
+    while ((column.claimed.fetch_or(bit, std::memory_order_acquire) & bit) != 0) {
+        std::this_thread::yield();
+    }
+    if ((column.stale.load(std::memory_order_relaxed) & bit) != 0) {
+        // значение записывается раньше, чем снимается признак устаревшего:
+        // читатель, который увидел снятый признак, видит и значение
+        const double* number = std::get_if<double>(&value);
+        column.values[row] = number != nullptr ? *number : static_cast<double>(std::get<FormulaError>(value).GetCategory());
+        Assign(column.numbers, bit, number != nullptr);
+        Assign(column.errors, bit, number == nullptr);
+        Assign(column.stale, bit, false, std::memory_order_release);
+    }
+    column.claimed.fetch_and(~bit, std::memory_order_release);
+}
+
+void ValueStore::Set(Position pos, double value, unsigned flags) {
+    if (flags == 0 && FindTile(pos) == nullptr) {
+        return;
+    }
+    Tile* tile = &GetOwnTile(pos);
+    Column& column = tile->columns[pos.col % TILE_COLS];
+    const int row = pos.row % TILE_ROWS;
+    const std::uint64_t bit = std::uint64_t{1} << row;
+    const bool was_set = ((column.stale.load(std::memory_order_relaxed) | column.numbers.load(std::memory_order_relaxed)
+                           | column.texts.load(std::memory_order_relaxed) | column.errors.load(std::memory_order_relaxed))
+                          & bit) != 0;
+    column.values[row] = value;
+    Assign(column.numbers, bit, (flags & NUMBER) != 0);
+    Assign(column.texts, bit, (flags & TEXT) != 0);
+    Assign(column.errors, bit, (flags & ERROR) != 0);
+    Assign(column.stale, bit, (flags & STALE) != 0, std::memory_order_release);
+    if (!was_set && flags != 0) {
+        ++tile->count;
+    } else if (was_set && flags == 0 && --tile->count == 0) {
+        tiles_[pos.row / TILE_ROWS][pos.col / TILE_COLS].reset();
+    }
+}
+
+bool ValueStore::IsStale(Position pos) const {
+    const Column* column = FindColumn(pos);
+    return column != nullptr
+           && (column->stale.load(std::memory_order_acquire) & std::uint64_t{1} << pos.row % TILE_ROWS) != 0;
+}
+
+std::optional<ValueStore::NumericValue> ValueStore::Find(Position pos) const {
+    const Column* column = FindColumn(pos);
+    if (column == nullptr) {
+        return 0.0;
+    }
+    const int row = pos.row % TILE_ROWS;
+    const std::uint64_t bit = std::uint64_t{1} << row;
+    if ((column->stale.load(std::memory_order_acquire) & bit) != 0) {
+        return std::nullopt;
+    }
+    if ((column->numbers.load(std::memory_order_relaxed) & bit) != 0) {
+        return column->values[row];
+    }
+    if ((column->errors.load(std::memory_order_relaxed) & bit) != 0) {
+        return ReadError(column->values[row]);
+    }
+    if ((column->texts.load(std::memory_order_relaxed) & bit) != 0) {
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return 0.0;
+}
+
+bool ValueStore::HasStale(Range range) const {
+    bool found = false;
+    ForEachSegment(range, [&found](const Column& column, std::uint64_t mask) {
+        found = found || (column.stale.load(std::memory_order_acquire) & mask) != 0;
+    });
+    return found;
+}
+
+void ValueStore::GetStale(std::vector<Position>& positions) const {
+    for (size_t tile_row = 0; tile_row < tiles_.size(); ++tile_row) {
+        for (size_t tile_col = 0; tile_col < tiles_[tile_row].size(); ++tile_col) {
+            const Tile* tile = tiles_[tile_row][tile_col].get();
+            if (tile == nullptr) {
+                continue;
+            }
+            for (int col = 0; col < TILE_COLS; ++col) {
+                for (std::uint64_t stale = tile->columns[col].stale.load(std::memory_order_relaxed); stale != 0;
+                     stale &= stale - 1) {
+                    positions.push_back(Position{static_cast<int>(tile_row) * TILE_ROWS + LowestBit(stale),
+                                                 static_cast<int>(tile_col) * TILE_COLS + col});
+                }
+            }
+        }
+    }
+}
+
+void ValueStore::GetNumbers(Range range, std::vector<double>& values) const {
+    ForEachSegment(range, [&values](const Column& column, std::uint64_t mask) {
+        if (const std::uint64_t errors = column.errors.load(std::memory_order_relaxed) & mask; errors != 0) {
+            throw ReadError(column.values[LowestBit(errors)]);
+        }
+        for (std::uint64_t numbers = column.numbers.load(std::memory_order_relaxed) & mask; numbers != 0;
+             numbers &= numbers - 1) {
+            values.push_back(column.values[LowestBit(numbers)]);
+        }
+    });
+}
+
+RangeSummary ValueStore::Summarize(Range range) const {
+    RangeSummary summary;
+    ForEachSegment(range, [&summary](const Column& column, std::uint64_t mask) {
+        if (const std::uint64_t errors = column.errors.load(std::memory_order_relaxed) & mask; errors != 0) {
+            throw ReadError(column.values[LowestBit(errors)]);
+        }
+        const std::uint64_t numbers = column.numbers.load(std::memory_order_relaxed) & mask;
+        if (numbers == 0) {
+            return;
+        }
+        // между первым и последним числом отрезка лежат только нули
+        const int first = LowestBit(numbers);
+        const int last = HighestBit(numbers);
+        summary.sum += ::Summarize(column.values.data() + first, static_cast<size_t>(last - first + 1), false).sum;
+        summary.count += static_cast<size_t>(CountBits(numbers));
+    });
+    return summary;
+}
+
+template <typename Func>
+void ValueStore::ForEachSegment(Range range, Func func) const {
+    const size_t last_tile_row = std::min<size_t>(range.last.row / TILE_ROWS + 1, tiles_.size());
+    for (size_t tile_row = range.first.row / TILE_ROWS; tile_row < last_tile_row; ++tile_row) {
+        const auto& row_tiles = tiles_[tile_row];
+        const int tile_top = static_cast<int>(tile_row) * TILE_ROWS;
+        const int first_row = std::max(range.first.row, tile_top) - tile_top;
+        const int last_row = std::min(range.last.row, tile_top + TILE_ROWS - 1) - tile_top;
+        const std::uint64_t mask = (~std::uint64_t{0} >> (TILE_ROWS - 1 - (last_row - first_row))) << first_row;
+        const size_t last_tile_col = std::min<size_t>(range.last.col / TILE_COLS + 1, row_tiles.size());
+        for (size_t tile_col = range.first.col / TILE_COLS; tile_col < last_tile_col; ++tile_col) {
+            const Tile* tile = row_tiles[tile_col].get();
+            if (tile == nullptr) {
+                continue;
+            }
+            const int tile_left = static_cast<int>(tile_col) * TILE_COLS;
+            const int col_end = std::min(range.last.col, tile_left + TILE_COLS - 1);
+            for (int col = std::max(range.first.col, tile_left); col <= col_end; ++col) {
+                func(tile->columns[col - tile_left], mask);
+            }
+        }
+    }
+}
+
+ValueStore::Tile* ValueStore::FindTile(Position pos) const {
+    const size_t tile_row = pos.row / TILE_ROWS;
+    const size_t tile_col = pos.col / TILE_COLS;
+    if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+        return nullptr;
+    }
+    return tiles_[tile_row][tile_col].get();
+}
+
+const ValueStore::Column* ValueStore::FindColumn(Position pos) const {
+    const Tile* tile = FindTile(pos);
+    return tile != nullptr ? &tile->columns[pos.col % TILE_COLS] : nullptr;
+}
+
+ValueStore::Tile& ValueStore::GetOwnTile(Position pos) {
+    const size_t tile_row = pos.row / TILE_ROWS;
+    const size_t tile_col = pos.col / TILE_COLS;
+    if (tile_row >= tiles_.size()) {
+        tiles_.resize(tile_row + 1);
+    }
+    auto& row_tiles = tiles_[tile_row];
+    if (tile_col >= row_tiles.size()) {
+        row_tiles.resize(tile_col + 1);
+    }
+    auto& tile = row_tiles[tile_col];
+    if (!tile) {
+        tile = std::make_shared<Tile>();
+    } else if (tile.use_count() > 1) {
+        tile = std::make_shared<Tile>(*tile);
+    }
+    return *tile;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "common.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Значения ячеек листа в том виде, в каком их читают формулы, по столбцам.
+// Лист разбит на плитки по 64 строки и 16 столбцов; у каждого столбца
+// плитки непрерывный массив double и битовые маски состояний его строк:
+// значение устарело, число, текст, который не представляет число, ошибка.
+// Вместо числа ошибка хранит в массиве свою категорию, пустые ячейки и
+// текст хранят ноль, поэтому сумма столбца диапазона - сумма отрезка
+// массива, а количество чисел - число единиц маски. Плитка выделяется при
+// первой записи и освобождается, когда в ней не остаётся значений.
+// Копия хранилища делит плитки с оригиналом; плитка копируется, когда
+// одну из её общих копий меняют.
+class ValueStore {
+public:
+    using NumericValue = CellInterface::NumericValue;
+
+    ValueStore();
+    // Копирует только таблицу плиток. Вызывается, когда значения никто не
+    // меняет; в копируемом хранилище не должно быть устаревших значений.
+    ValueStore(const ValueStore& other);
+    ValueStore& operator=(const ValueStore&) = delete;
+    ~ValueStore();
+
+    // Записывают значение ячейки pos. Из нескольких потоков сразу можно
+    // вызывать только SetResult, чтение при этом допустимо; остальные
+    // методы записи - когда значения никто не читает.
+    void SetEmpty(Position pos);
+    // Текст с числовым прочтением number; ошибка - текст не число.
+    void SetText(Position pos, NumericValue number);
+    // Формула, значение которой ещё не вычислено.
+    void SetStale(Position pos);
+    // Вычисленное значение формулы, значение которой устарело. Если одну
+    // формулу вычислили несколько потоков, записывает первый, остальные
+    // ждут его записи; когда метод вернулся, значение уже не устаревшее.
+    void SetResult(Position pos, NumericValue value);
+
+    [[nodiscard]] bool IsStale(Position pos) const;
+    // Значение pos так, как его видит ссылка формулы: пустая ячейка -
+    // ноль, текст не число - #VALUE!; nullopt, если значение устарело.
+    [[nodiscard]] std::optional<NumericValue> Find(Position pos) const;
+    // Есть ли в диапазоне устаревшие значения.
+    [[nodiscard]] bool HasStale(Range range) const;
+    // Дописывает в positions позиции всех устаревших значений. Плитки
+    // просматриваются по маскам, без обхода ячеек.
+    void GetStale(std::vector<Position>& positions) const;
+    // Дописывает в values числа диапазона так, как их видят функции
+    // формул: столбец за столбцом внутри плитки, плитки построчно. Пустые
+    // ячейки и текст, который не представляет число, пропускаются, ошибка
+    // бросается. Устаревшие значения читаются как пустые, поэтому
+    // вызывающий вычисляет их заранее.
+    void GetNumbers(Range range, std::vector<double>& values) const;
+    // Сумма и количество чисел диапазона без копирования, по тем же
+    // правилам. Минимум и максимум не заполняются.
+    [[nodiscard]] RangeSummary Summarize(Range range) const;
+
+private:
+    static constexpr int TILE_ROWS = 64;
+    static constexpr int TILE_COLS = 16;
+    static_assert(Position::MAX_ROWS % TILE_ROWS == 0 && Position::MAX_COLS % TILE_COLS == 0);
+
+    enum Flag : unsigned {
+        STALE = 1,
+        NUMBER = 2,
+        TEXT = 4,
+        ERROR = 8,
+    };
+
+    struct Column {
+        std::array<double, TILE_ROWS> values{};
+        // бит строки в масках соответствует флагу её значения
+        std::atomic<std::uint64_t> stale{0};
+        std::atomic<std::uint64_t> numbers{0};
+        std::atomic<std::uint64_t> texts{0};
+        std::atomic<std::uint64_t> errors{0};
+        // строки, в которые SetResult записывает значение прямо сейчас
+        std::atomic<std::uint64_t> claimed{0};
+
+        Column() = default;
+        Column(const Column& other);
+    };
+
+    struct Tile {
+        std::array<Column, TILE_COLS> columns;
+        // строк со значениями во всех столбцах плитки
+        int count = 0;
+    };
+
+    void Set(Position pos, double value, unsigned flags);
+    Tile* FindTile(Position pos) const;
+    const Column* FindColumn(Position pos) const;
+    // Плитка pos, которая есть только у этого хранилища: недостающая
+    // создаётся, общая с копиями - копируется.
+    Tile& GetOwnTile(Position pos);
+    // Вызывает func(column, mask) для каждого столбца каждой плитки,
+    // которую задевает range; mask - строки столбца внутри range.
+    template <typename Func>
+    void ForEachSegment(Range range, Func func) const;
+
+    std::vector<std::vector<std::shared_ptr<Tile>>> tiles_;
+};
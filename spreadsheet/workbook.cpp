@@ -0,0 +1,359 @@
+#include "workbook.h"
+#include "FormulaAST.h"
+#include "cell.h"
+#include "thread_pool.h"
+#include "tiled_storage.h"
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+    // Ячейка листа книги с номером sheet как одно число: вершина графа
+    // ссылок при поиске циклов.
+    std::uint64_t MakeKey(size_t sheet, Position pos) {
+        return static_cast<std::uint64_t>(sheet) << 32 | static_cast<std::uint64_t>(pos.row) << 16
+               | static_cast<std::uint64_t>(pos.col);
+    }
+
+    size_t KeySheet(std::uint64_t key) {
+        return static_cast<size_t>(key >> 32);
+    }
+
+    Position KeyPosition(std::uint64_t key) {
+        return Position{static_cast<int>(key >> 16 & 0xFFFF), static_cast<int>(key & 0xFFFF)};
+    }
+
+    const Range WHOLE_SHEET{{0, 0}, {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+
+}  // namespace
+
+Workbook::Workbook() = default;
+Workbook::~Workbook() = default;
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw std::invalid_argument("Invalid sheet name: " + name);
+    }
+    if (indices_.count(name) > 0) {
+        throw std::invalid_argument("Sheet already exists: " + name);
+    }
+    auto entry = std::make_unique<Entry>();
+    entry->name = std::move(name);
+    entry->sheet = std::make_unique<Sheet>();
+    Sheet& sheet = *entry->sheet;
+    sheet.workbook_ = this;
+    sheet.sheet_dependents_ = &dependents_[entry->name];
+    ++graph_version_;
+    indices_.emplace(entry->name, sheets_.size());
+    sheet_indices_.emplace(&sheet, sheets_.size());
+    const std::string_view added = entry->name;
+    sheets_.push_back(std::move(entry));
+    // формулы, которые ссылались на лист до его появления, читали #REF!
+    InvalidateReferencesTo(added);
+    FinishEdit();
+    return sheet;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    const auto it = indices_.find(name);
+    return it != indices_.end() ? sheets_[it->second]->sheet.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    return const_cast<Workbook*>(this)->GetSheet(name);
+}
+
+std::vector<std::string_view> Workbook::GetSheetNames() const {
+    std::vector<std::string_view> names;
+    names.reserve(sheets_.size());
+    for (const auto& entry : sheets_) {
+        names.push_back(entry->name);
+    }
+    return names;
+}
+
+// Листы, которые ссылаются друг на друга по кругу, - компонента сильной
+// связности графа листов. Компоненты вычисляются волнами: в волну входят
+// те, все листы которых ссылаются только на компоненты прошлых волн.
+void Workbook::Recalculate(size_t thread_count) {
+    const size_t count = sheets_.size();
+    std::vector<std::vector<size_t>> references(count);
+    for (size_t sheet = 0; sheet < count; ++sheet) {
+        references[sheet] = GetReferencedSheets(*sheets_[sheet]);
+    }
+    // reachable[i][j] - лист i ссылается на лист j, хотя бы косвенно
+    std::vector<std::vector<char>> reachable(count, std::vector<char>(count, 0));
+    for (size_t sheet = 0; sheet < count; ++sheet) {
+        std::vector<size_t> queue = references[sheet];
+        for (size_t i = 0; i < queue.size(); ++i) {
+            if (!reachable[sheet][queue[i]]) {
+                reachable[sheet][queue[i]] = 1;
+                queue.insert(queue.end(), references[queue[i]].begin(), references[queue[i]].end());
+            }
+        }
+    }
+    constexpr size_t none = static_cast<size_t>(-1);
+    std::vector<size_t> component(count, none);
+    std::vector<std::vector<size_t>> components;
+    for (size_t sheet = 0; sheet < count; ++sheet) {
+        if (component[sheet] != none) {
+            continue;
+        }
+        components.emplace_back();
+        for (size_t other = sheet; other < count; ++other) {
+            if (other == sheet || (reachable[sheet][other] && reachable[other][sheet])) {
+                component[other] = components.size() - 1;
+                components.back().push_back(other);
+            }
+        }
+    }
+    std::vector<size_t> pending(components.size(), 0);
+    std::vector<std::vector<size_t>> dependents(components.size());
+    for (size_t sheet = 0; sheet < count; ++sheet) {
+        for (const size_t used : references[sheet]) {
+            if (component[used] != component[sheet]) {
+                dependents[component[used]].push_back(component[sheet]);
+                ++pending[component[sheet]];
+            }
+        }
+    }
+
+    std::vector<size_t> wave;
+    for (size_t i = 0; i < components.size(); ++i) {
+        if (pending[i] == 0) {
+            wave.push_back(i);
+        }
+    }
+    if (thread_count > 1 && (!pool_ || pool_->GetThreadCount() != thread_count)) {
+        pool_ = std::make_unique<WorkStealingPool>(thread_count);
+    }
+    std::vector<size_t> next;
+    while (!wave.empty()) {
+        if (thread_count <= 1) {
+            for (const size_t i : wave) {
+                for (const size_t sheet : components[i]) {
+                    sheets_[sheet]->sheet->Recalculate();
+                }
+            }
+        } else if (wave.size() == 1) {
+            // одну компоненту параллельно вычисляет сам лист в пуле книги
+            for (const size_t sheet : components[wave.front()]) {
+                sheets_[sheet]->sheet->Recalculate(*pool_);
+            }
+        } else {
+            for (const size_t i : wave) {
+                pool_->Submit([this, &components, i] {
+                    for (const size_t sheet : components[i]) {
+                        sheets_[sheet]->sheet->Recalculate(1);
+                    }
+                });
+            }
+            pool_->Wait();
+        }
+        next.clear();
+        for (const size_t i : wave) {
+            for (const size_t dependent : dependents[i]) {
+                if (--pending[dependent] == 0) {
+                    next.push_back(dependent);
+                }
+            }
+        }
+        wave.swap(next);
+    }
+}
+
+void Workbook::AddDependency(Sheet& sheet, std::string_view sheet_name, Range range, Cell* cell) {
+    dependents_[std::string(sheet_name)].Insert(range, Sheet::SheetDependent{&sheet, cell});
+    if (++GetEntry(sheet).references[std::string(sheet_name)] == 1) {
+        ++graph_version_;
+    }
+}
+
+void Workbook::RemoveDependency(Sheet& sheet, std::string_view sheet_name, Range range, Cell* cell) {
+    dependents_.at(std::string(sheet_name)).Erase(range, Sheet::SheetDependent{&sheet, cell});
+    auto& references = GetEntry(sheet).references;
+    const auto it = references.find(std::string(sheet_name));
+    if (--it->second == 0) {
+        references.erase(it);
+        ++graph_version_;
+    }
+}
+
+// Цикл, который замыкают правки, проходит через правленую ячейку и
+// выходит из её листа, поэтому лист по ссылкам листов достижим из самого
+// себя. Только тогда ячейки обходятся в глубину от правок: формулы правок
+// берутся новые, остальных - текущие, а цикл - ячейка, до которой обход
+// дошёл, пока она на пути обхода.
+bool Workbook::ClosesCycle(const Sheet& sheet, const std::vector<std::pair<Position, const FormulaAST*>>& edits) {
+    const size_t origin = sheet_indices_.at(&sheet);
+    if (!IsOnSheetCycle(origin, edits)) {
+        return false;
+    }
+
+    TiledStorage<const FormulaAST*> edited;
+    for (const auto& [pos, ast] : edits) {
+        edited.Emplace(pos, ast);
+    }
+    // аргументы-формулы вершины дописываются в arguments; ячейки, которые
+    // не формулы, циклу не принадлежат
+    std::vector<std::uint64_t> arguments;
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+    auto push_range = [this, origin, &edited, &arguments](size_t target, Range range) {
+        sheets_[target]->sheet->cells_.ForEachIn(range.first, range.last,
+                                                  [target, &arguments](Position pos, const Cell& cell) {
+            if (cell.GetFormulaAST() != nullptr) {
+                arguments.push_back(MakeKey(target, pos));
+            }
+        });
+        if (target == origin) {
+            edited.ForEachIn(range.first, range.last, [origin, &arguments](Position pos, const FormulaAST* ast) {
+                if (ast != nullptr) {
+                    arguments.push_back(MakeKey(origin, pos));
+                }
+            });
+        }
+    };
+    auto push_arguments = [&](std::uint64_t node) {
+        const size_t target = KeySheet(node);
+        const Position pos = KeyPosition(node);
+        const FormulaAST* ast = nullptr;
+        const FormulaAST* const* edit = target == origin ? edited.Find(pos) : nullptr;
+        if (edit != nullptr) {
+            ast = *edit;
+        } else if (const Cell* cell = sheets_[target]->sheet->cells_.Find(pos)) {
+            ast = cell->GetFormulaAST();
+        }
+        if (ast == nullptr) {
+            return;
+        }
+        ast->GetDependencies(pos, cells, ranges);
+        for (const Position used : cells) {
+            push_range(target, Range{used, used});
+        }
+        for (const Range range : ranges) {
+            push_range(target, range);
+        }
+        ast->ForEachSheetReference(pos, [this, &push_range](std::string_view name, Range range) {
+            if (const auto it = indices_.find(name); it != indices_.end()) {
+                push_range(it->second, range);
+            }
+        });
+    };
+
+    enum State : char {
+        ON_PATH = 1,
+        DONE = 2,
+    };
+    std::unordered_map<std::uint64_t, char> states;
+    struct Frame {
+        std::uint64_t node;
+        size_t first_argument;
+    };
+    std::vector<Frame> stack;
+    auto push = [&](std::uint64_t node) {
+        states[node] = ON_PATH;
+        stack.push_back({node, arguments.size()});
+        push_arguments(node);
+    };
+    for (const auto& [pos, ast] : edits) {
+        const std::uint64_t start = MakeKey(origin, pos);
+        if (ast == nullptr || states.count(start) > 0) {
+            continue;
+        }
+        push(start);
+        while (!stack.empty()) {
+            const Frame frame = stack.back();
+            if (arguments.size() > frame.first_argument) {
+                const std::uint64_t node = arguments.back();
+                arguments.pop_back();
+                const auto it = states.find(node);
+                if (it == states.end()) {
+                    push(node);
+                } else if (it->second == ON_PATH) {
+                    return true;
+                }
+            } else {
+                states[frame.node] = DONE;
+                stack.pop_back();
+            }
+        }
+    }
+    return false;
+}
+
+void Workbook::FinishEdit() {
+    for (const auto& entry : sheets_) {
+        Sheet& sheet = *entry->sheet;
+        if (!sheet.marked_.empty() || !sheet.edited_.empty()) {
+            sheet.CalculateMarked();
+        }
+    }
+}
+
+void Workbook::InvalidateReferencesTo(std::string_view name) {
+    const std::string key(name);
+    for (const auto& entry : sheets_) {
+        if (entry->references.count(key) == 0) {
+            continue;
+        }
+        Sheet& sheet = *entry->sheet;
+        sheet.ForEachCellIn(WHOLE_SHEET, [&sheet, name](Cell* cell) {
+            const FormulaAST* ast = cell->GetFormulaAST();
+            for (std::uint32_t i = 1; ast != nullptr && i <= ast->GetSheetCount(); ++i) {
+                if (ast->GetSheetName(i) == name) {
+                    cell->CacheInvalidate(sheet);
+                    break;
+                }
+            }
+        });
+    }
+}
+
+Workbook::Entry& Workbook::GetEntry(const Sheet& sheet) {
+    return *sheets_[sheet_indices_.at(&sheet)];
+}
+
+bool Workbook::IsOnSheetCycle(size_t origin, const std::vector<std::pair<Position, const FormulaAST*>>& edits) {
+    Entry& entry = *sheets_[origin];
+    std::vector<size_t> queue;
+    for (const auto& [pos, ast] : edits) {
+        for (std::uint32_t i = 1; ast != nullptr && i <= ast->GetSheetCount(); ++i) {
+            const std::string_view name = ast->GetSheetName(i);
+            const auto it = indices_.find(name);
+            if (it != indices_.end() && entry.references.count(std::string(name)) == 0) {
+                queue.push_back(it->second);
+            }
+        }
+    }
+    const bool new_references = !queue.empty();
+    if (!new_references && entry.cycle_version == graph_version_) {
+        return entry.on_cycle;
+    }
+    const std::vector<size_t> references = GetReferencedSheets(entry);
+    queue.insert(queue.end(), references.begin(), references.end());
+    std::vector<char> reached(sheets_.size(), 0);
+    for (size_t i = 0; i < queue.size() && !reached[origin]; ++i) {
+        if (!reached[queue[i]]) {
+            reached[queue[i]] = 1;
+            const std::vector<size_t> next = GetReferencedSheets(*sheets_[queue[i]]);
+            queue.insert(queue.end(), next.begin(), next.end());
+        }
+    }
+    if (!new_references) {
+        entry.cycle_version = graph_version_;
+        entry.on_cycle = reached[origin] != 0;
+    }
+    return reached[origin] != 0;
+}
+
+std::vector<size_t> Workbook::GetReferencedSheets(const Entry& entry) const {
+    std::vector<size_t> sheets;
+    for (const auto& [name, count] : entry.references) {
+        if (const auto it = indices_.find(name); it != indices_.end()) {
+            sheets.push_back(it->second);
+        }
+    }
+    return sheets;
+}
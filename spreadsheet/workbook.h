@@ -0,0 +1,98 @@
+#pragma once
+#include "common.h"
+#include "range_index.h"
+#include "sheet.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Cell;
+class FormulaAST;
+class WorkStealingPool;
+
+// Книга: именованные листы, формулы которых ссылаются на ячейки друг
+// друга как Sheet2!A1 и SUM(Sheet2!A1:B10). Правка ячейки одного листа
+// помечает устаревшими формулы всех листов, которые от неё зависят; в
+// жадном режиме и при подписчиках они вычисляются в конце той же правки.
+// Ссылка на лист, которого в книге нет, - ошибка #REF!, пока лист с таким
+// именем не добавят.
+// Циклы через несколько листов ищутся при правке, только если листы
+// ссылаются друг на друга по кругу; правки листов, которые так не
+// связаны, стоят столько же, сколько правки отдельного листа.
+class Workbook {
+public:
+    Workbook();
+    ~Workbook();
+
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустой лист name. Формулы, которые уже ссылаются на это
+    // имя, пересчитываются. Бросает std::invalid_argument, если имя занято
+    // или не годится для ссылок, см. IsValidSheetName.
+    Sheet& AddSheet(std::string name);
+    // Лист name или nullptr, если его нет.
+    [[nodiscard]] Sheet* GetSheet(std::string_view name);
+    [[nodiscard]] const Sheet* GetSheet(std::string_view name) const;
+    // Имена листов в порядке добавления.
+    [[nodiscard]] std::vector<std::string_view> GetSheetNames() const;
+    // Вычисляет устаревшие формулы всех листов. Листы, которые ссылаются
+    // друг на друга по кругу, вычисляются вместе; лист вычисляется после
+    // листов, на которые он ссылается. При thread_count > 1 листы, которые
+    // не зависят друг от друга даже косвенно, вычисляются параллельно.
+    void Recalculate(size_t thread_count = 1);
+
+private:
+    friend class Sheet;
+
+    struct Entry {
+        std::string name;
+        std::unique_ptr<Sheet> sheet;
+        // число ссылок формул листа на каждое имя листа
+        std::unordered_map<std::string, size_t> references;
+        // достижим ли лист из себя по ссылкам листов при версии графа
+        // листов cycle_version; ноль - не проверялось
+        std::uint64_t cycle_version = 0;
+        bool on_cycle = false;
+    };
+
+    // Связывают формулу cell листа sheet со ссылкой на диапазон range листа
+    // sheet_name и разрывают эту связь.
+    void AddDependency(Sheet& sheet, std::string_view sheet_name, Range range, Cell* cell);
+    void RemoveDependency(Sheet& sheet, std::string_view sheet_name, Range range, Cell* cell);
+    // Замкнут ли новые формулы ячеек листа sheet цикл, который проходит
+    // через другие листы; edits - позиции правок и их формулы (nullptr -
+    // не формула). Ищет цикл, только если sheet с новыми формулами
+    // ссылается сам на себя через другие листы.
+    [[nodiscard]] bool ClosesCycle(const Sheet& sheet, const std::vector<std::pair<Position, const FormulaAST*>>& edits);
+    // Вычисляет формулы всех листов, помеченные устаревшими за правку, и
+    // сообщает их подписчикам об изменениях.
+    void FinishEdit();
+    // Помечает устаревшими формулы всех листов, которые ссылаются на лист
+    // name, вместе с их зависимыми.
+    void InvalidateReferencesTo(std::string_view name);
+
+    Entry& GetEntry(const Sheet& sheet);
+    // Номера листов, на которые ссылаются формулы листа entry.
+    [[nodiscard]] std::vector<size_t> GetReferencedSheets(const Entry& entry) const;
+    // Достижим ли лист origin из себя по ссылкам листов, если добавить
+    // ссылки формул edits. Без новых ссылок ответ берётся из Entry, пока
+    // граф листов не изменился.
+    [[nodiscard]] bool IsOnSheetCycle(size_t origin, const std::vector<std::pair<Position, const FormulaAST*>>& edits);
+
+    std::vector<std::unique_ptr<Entry>> sheets_;
+    std::unordered_map<std::string_view, size_t> indices_;
+    std::unordered_map<const Sheet*, size_t> sheet_indices_;
+    // формулы, которые ссылаются на лист, по его имени; записи появляются
+    // раньше листа, если формула ссылается на лист, которого ещё нет
+    std::unordered_map<std::string, RangeIndex<Sheet::SheetDependent>> dependents_;
+    // растёт, когда появляется лист или ссылка одного листа на другой либо
+    // пропадает последняя такая ссылка
+    std::uint64_t graph_version_ = 1;
+    std::unique_ptr<WorkStealingPool> pool_;
+};